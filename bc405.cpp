@@ -22,10 +22,27 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
 #include <stdbool.h>
 #include <math.h>
 #include <assert.h>
+#ifndef _WIN32
+   #include <unistd.h>
+   #include <sys/mman.h>
+#endif
+#if defined( __AVX2__)
+   #include <immintrin.h>
+   #define BOX_VECTOR_WIDTH 16
+#elif defined( __SSE2__) || defined( _M_X64) \
+               || (defined( _M_IX86_FP) && _M_IX86_FP >= 2)
+   #include <emmintrin.h>
+   #define BOX_VECTOR_WIDTH 8
+#else
+   #define BOX_VECTOR_WIDTH 1
+#endif
 #include "watdefs.h"
 #include "constant.h"
 #include "comets.h"
+#include "mpc_obs.h"
 #include "afuncs.h"
+#include "integrat.h"
+#include "pl_cache.h"
 
 /* BC-405 gives orbital elements for 300 large asteroids at 40-day intervals,
 running from JD 2378495.0 = 1799 Dec 30.5 to JD 2524615.0 = 2200 Jan 22.5.
@@ -52,38 +69,148 @@ double *get_asteroid_mass( const int astnum);   /* bc405.cpp */
 int generic_message_box( const char *message, const char *box_type);
 int asteroid_position_raw( const int astnum, const double jd,
                               double *posn, double *vel);      /* bc405.cpp */
-int planet_posn( const int planet_no, const double jd, double *vect_2000);
 FILE *fopen_ext( const char *filename, const char *permits);   /* miscell.cpp */
 const char *get_environment_ptr( const char *env_ptr);     /* mpc_obs.cpp */
+char *make_config_dir_name( char *oname, const char *iname);  /* miscell.cpp */
+int64_t nanoseconds_since_1970( void);                      /* nanosecs.c */
+int debug_printf( const char *format, ...)                 /* mpc_obs.cpp */
+#ifdef __GNUC__
+         __attribute__ (( format( printf, 1, 2)))
+#endif
+;
 
 #define BC405_INVALID_CHUNK            (-1)
 #define NO_BC405_FILE                  (-2)
 #define BC405_COULDNT_OPEN_BINARY_FILE (-3)
-#define MAX_BC405_N_ASTEROIDS    300
 
 static int n_bc405_chunks = 3654;
-static int bc405_n_asteroids = MAX_BC405_N_ASTEROIDS;
+static int bc405_n_asteroids = 300;
 static double bc405_start_jd = 2378495.;
 static double bc405_chunk_time = 40.;
 
-static FILE *open_bc405_file( const bool shutting_down)
+#define N_CACHED_ELEMS 30
+
+         /* Room for n asteroids,  rounded up to a multiple */
+         /* of the widest (AVX2) vector of int16_ts :       */
+#define N_BOX_ENTRIES( n) (((n) + 15) & ~15)
+
+         /* See build_perturber_grid() for the following :  */
+#define GRID_N_CELLS           32
+#define GRID_CELL_SIZE         400
+#define GRID_MAX_CELLS_PER_BOX 16
+#define MIN_ASTEROIDS_FOR_GRID 512
+
+/* Each integration context (see 'integrat.h') has its own file handle
+and its own small cache of recently used BC-405 elements.  That lets
+several contexts find asteroid perturbations at once in different threads.
+The 'usual' functions (detect_perturbers(),  asteroid_position_raw()) use
+the default cache.  The asteroid masses and numbers,  and the precomputed
+asteroid ranges (see below),  are shared,  and are loaded when a cache is
+allocated.  Each cache also has the 'boxes' for the 40-day chunk it last
+used (see build_perturber_boxes()),  and for large perturber sets,  a grid
+to find the boxes near a given point (see build_perturber_grid()).  */
+
+ASTEROID_CACHE
+   {
+   bool initialized, bc405_available;
+   FILE *elem_fp;
+   int astnums[N_CACHED_ELEMS], chunk_num[N_CACHED_ELEMS];
+   ELEMENTS elems[N_CACHED_ELEMS];
+   int box_chunk, n_box_entries;
+   unsigned box_config_serial;
+   int16_t *box_lo, *box_hi;
+   int *candidates, *wide, n_wide;
+   int *grid_start, *grid_entries, n_grid_entries_alloced;
+   };
+
+static ASTEROID_CACHE default_cache;
+
+/* detect_perturbers() is called for every derivative evaluation of objects
+crossing the main belt.  It depends on the ASTEROID_THRESH,  ASTEROID_PERT_LIST,
+and BC405_ASTEROIDS settings,  and on the asteroid masses.  Rather than
+looking up and parsing those every time,  we 'compile' them into the
+following,  and rebuild it only when the settings change (as indicated by
+'environment_generation' : see 'mpc_obs.cpp').  The configuration is shared
+by all caches,  and is built when a cache is allocated (i.e.,  before any
+threads start) and whenever detect_perturbers() finds the settings changed. */
+
+typedef struct
+{
+   unsigned generation, serial;
+   int n_asteroids_to_use, n_fixed, n_alloced;
+   uint32_t *fixed;              /* bit per asteroid */
+   int16_t *ithresh;
+} perturber_config_t;
+
+static perturber_config_t perturber_config;
+
+/* The asteroid numbers and masses come from 'mu1.txt',  in the same order
+as in the BC-405 (or sub-ephemeris) file.  There can be any number of
+them,  but only the first bc405_n_asteroids can be perturbers.  */
+
+static int *asteroid_numbers;
+static int n_masses;
+int excluded_asteroid_number = 0;
+static double *masses;
+
+#define IS_FIXED_PERTURBER( config, i) \
+               (((config)->fixed[(i) >> 5] >> ((i) & 31)) & 1)
+
+static void reset_cached_elems( ASTEROID_CACHE *cache)
+{
+   int i;
+
+   for( i = 0; i < N_CACHED_ELEMS; i++)
+      cache->astnums[i] = cache->chunk_num[i] = -1;
+}
+
+static ASTEROID_CACHE *get_asteroid_cache( INTEGRATION_CONTEXT *ctx)
+{
+   ASTEROID_CACHE *rval = (ctx && ctx->asteroid_cache ?
+                                 ctx->asteroid_cache : &default_cache);
+
+   if( !rval->initialized)
+      {
+      rval->initialized = rval->bc405_available = true;
+      rval->box_chunk = -1;
+      reset_cached_elems( rval);
+      }
+   return( rval);
+}
+
+      /* Once we've found the BC-405 file,  other caches can just reopen */
+      /* it, using the same name and 'permits' :                        */
+static const char *bc405_filename = NULL, *bc405_permits;
+
+static FILE *open_bc405_file( ASTEROID_CACHE *cache, const bool shutting_down)
 {
    const char *data_file_name = "bc405.dat";
-   static FILE *ifile;
+   FILE *ifile = cache->elem_fp;
    static int failure_detected = 0;
 
    if( shutting_down)
       {
       if( ifile)
          fclose( ifile);
-      ifile = NULL;
+      cache->elem_fp = NULL;
       return( NULL);
       }
-   if( failure_detected)
-      return( NULL);
-   if( !ifile)
-      ifile = fopen_ext( data_file_name, "crb");
-   if( !ifile)
+   if( failure_detected || ifile)
+      return( ifile);
+   if( bc405_filename)
+      {
+      cache->elem_fp = (*bc405_permits ?
+                          fopen_ext( bc405_filename, bc405_permits) :
+                          fopen( bc405_filename, "rb"));
+      return( cache->elem_fp);
+      }
+   ifile = fopen_ext( data_file_name, "crb");
+   if( ifile)
+      {
+      bc405_filename = data_file_name;
+      bc405_permits = "crb";
+      }
+   else
       {
       ifile = fopen_ext( "asteroid_ephemeris.txt", "crb");
       if( !ifile)       /* file name may be specified in environ.dat */
@@ -93,6 +220,11 @@ static FILE *open_bc405_file( const bool shutting_down)
 
          if( *ast_ephem_filename)
             ifile = fopen( ast_ephem_filename, "rb");
+         if( ifile)
+            {
+            bc405_filename = ast_ephem_filename;
+            bc405_permits = "";
+            }
          }
       if( !ifile)       /* maybe the sub-ephemeris is available? */
          {
@@ -107,10 +239,17 @@ static FILE *open_bc405_file( const bool shutting_down)
             assert( count);
             count = fread( &temp, sizeof( int32_t), 1, ifile);
             assert( count);
-            bc405_n_asteroids = (int)temp;
+            if( bc405_n_asteroids != (int)temp)
+               {
+               bc405_n_asteroids = (int)temp;
+               perturber_config.generation = 0;    /* force a rebuild */
+               }
             count = fread( &temp, sizeof( int32_t), 1, ifile);
             assert( count);
             n_bc405_chunks = (int)temp;
+            bc405_filename = "bc405sub.dat";
+            bc405_permits = "crb";
+            cache->elem_fp = ifile;
             return( ifile);
             }
          }
@@ -131,6 +270,8 @@ static FILE *open_bc405_file( const bool shutting_down)
          fclose( ofile);
          ifile = fopen_ext( data_file_name, "crb");
          assert( ifile != NULL);
+         bc405_filename = data_file_name;
+         bc405_permits = "crb";
          }
       }
    if( !ifile)             /* no asteroid ephems;  show err msg */
@@ -138,6 +279,7 @@ static FILE *open_bc405_file( const bool shutting_down)
       failure_detected = 1;
       generic_message_box( get_find_orb_text( 2021), "o");
       }
+   cache->elem_fp = ifile;
    return( ifile);
 }
 
@@ -166,32 +308,21 @@ static void grab_elems( ELEMENTS *elems, FILE *fp, const int chunk_number)
    assert( array[1] > 0. && array[1] < 1.);
 }
 
-#define N_CACHED_ELEMS 30
-
-static void grab_cached_elems( ELEMENTS *elems, const int chunk_number,
-                                 const int asteroid_number)
+static void grab_cached_elems( ASTEROID_CACHE *acache, ELEMENTS *elems,
+                  const int chunk_number, const int asteroid_number)
 {
-   static int astnums[N_CACHED_ELEMS], chunk_num[N_CACHED_ELEMS];
-   static ELEMENTS *cache = NULL;
+   int *astnums = acache->astnums, *chunk_num = acache->chunk_num;
+   ELEMENTS *cache = acache->elems;
    FILE *fp;
    int i;
 
    if( !elems)
       {
-      if( cache)
-         free( cache);
-      cache = NULL;
-      for( i = 0; i < N_CACHED_ELEMS; i++)
-         astnums[i] = chunk_num[i] = -1;
+      reset_cached_elems( acache);
       return;
       }
-   fp = open_bc405_file( false);
+   fp = open_bc405_file( acache, false);
    assert( fp);
-   if( !cache)
-      cache = (ELEMENTS *)calloc( N_CACHED_ELEMS, sizeof( ELEMENTS));
-   assert( cache);
-   if( !cache)
-      return;
    for( i = 0; i < N_CACHED_ELEMS && (asteroid_number != astnums[i]
                || chunk_number != chunk_num[i]); i++)
       ;
@@ -238,11 +369,18 @@ do all of these tests with integer arithmetic.  This will usually result
 in the number of potentially significant perturbers being dropped from 300
 to zero,  or sometimes a few.
 
-   A few wrinkles to be considered : the scaled-integer xyz ranges are
-stored in the file 'bc405pre.dat'.  This file is created if it does not
-exist,  and filled with zeroes for all the 40-day ranges for all 300
-asteroids.  Then,  as ranges are needed,  they are computed and written
-back out to the file.  This wasn't a big deal to do,  and spared the
+   A few wrinkles to be considered : the scaled-integer xyz positions
+(at the start of each 40-day range) are stored in the file 'bc405pre.dat'.
+This file used to be filled in lazily,  as ranges were needed;  but when
+'fo' runs several processes,  they'd all be writing to it at once,  and
+each change of chunk cost seeks and reads.  Now,  the first time it's
+needed,  all ranges for all asteroids are computed (this takes about a
+second),  written to a temporary file,  and renamed to 'bc405pre.dat' (so
+other processes see either no file or a complete one).  After that,  the
+file is mapped read-only into memory and shared by all processes and
+contexts,  and the positions for a given chunk are just at an offset
+within it.  An old partially-filled file (one with a chunk that's still
+all zeroes) or one of the wrong size is rebuilt.  This still spares the
 need to distribute a rather large data file.
 
    Also:  the "effective range" for perturbations,  0.27 in the above
@@ -261,77 +399,525 @@ has a "Big-16" list of asteroid perturbers they use frequently.)
 Normally,  Find_Orb's method will be more accurate,  but it'll be
 different,  making comparisons difficult.   */
 
-static FILE *get_precomputed_data_fp( void)
+      /* Our pre-computed data for asteroid location limits is stored */
+      /* in integer units,  with 1000 such units equalling one AU:    */
+const double integer_scale = 1000.;
+
+static const int16_t *precomputed_data = NULL;
+static bool precomputed_data_is_mapped = false;
+
+static size_t precomputed_data_size( void)
 {
-   const char *data_file_name = "bc405pre.dat";
-   FILE *ifile = fopen_ext( data_file_name, "cr+b");
+   return( (size_t)n_bc405_chunks * (size_t)bc405_n_asteroids
+                                  * 3 * sizeof( int16_t));
+}
 
-   if( !ifile)             /* Create output binary file if not found, */
-      {                    /* seeding with zeroes :                   */
-      FILE *ofile = fopen_ext( data_file_name, "cw+b");
-      int16_t posns[MAX_BC405_N_ASTEROIDS];
-      int i;
+static char *bc405_data_filename( char *filename, const char *name)
+{
+   extern int use_config_directory;
 
-      assert( ofile);
-      for( i = 0; i < bc405_n_asteroids; i++)
-         posns[i] = 0;
-      for( i = 0; i < 3 * n_bc405_chunks; i++)
-         {
-         size_t count = fwrite( posns, sizeof( int16_t), bc405_n_asteroids, ofile);
+   if( use_config_directory)
+      make_config_dir_name( filename, name);
+   else
+      strcpy( filename, name);
+   return( filename);
+}
 
-         assert( count == (size_t)bc405_n_asteroids);
-         }
-      fclose( ofile);
-      ifile = fopen_ext( data_file_name, "cr+b");
-      assert( ifile);
+static void unload_precomputed_data( void)
+{
+   if( precomputed_data)
+      {
+#ifndef _WIN32
+      if( precomputed_data_is_mapped)
+         munmap( (void *)precomputed_data, precomputed_data_size( ));
+      else
+#endif
+         free( (void *)precomputed_data);
       }
-   return( ifile);
+   precomputed_data = NULL;
+   precomputed_data_is_mapped = false;
 }
 
-      /* Our pre-computed data for asteroid location limits is stored */
-      /* in integer units,  with 1000 such units equalling one AU:    */
-const double integer_scale = 1000.;
+/* Returns NULL if 'bc405pre.dat' doesn't exist,  is of the wrong size,  or
+has a chunk that's still all zeroes (i.e.,  was partly filled in by an
+older version of this code).   */
 
-static int find_and_set_precomputed_data( FILE *precomputed_fp,
-                         const int bc_chunk, int16_t *__restrict posns)
+static const int16_t *load_precomputed_data( void)
 {
-   const int chunk_size = bc405_n_asteroids * 3;
-   FILE *bc405_elem_file = open_bc405_file( false);
+   char filename[255];
+   FILE *ifile = fopen( bc405_data_filename( filename, "bc405pre.dat"), "rb");
+   const size_t n_bytes = precomputed_data_size( );
+   const size_t chunk_size = (size_t)bc405_n_asteroids * 3;
+   int16_t *rval = NULL;
    int i;
 
-   assert( bc405_elem_file);
-   if( bc_chunk < 0 || bc_chunk >= n_bc405_chunks)
-      printf( "%d %d\n", bc_chunk, n_bc405_chunks);
-   assert( bc_chunk >= 0 && bc_chunk < n_bc405_chunks);
-   fseek( precomputed_fp, (size_t)( bc_chunk * chunk_size) * sizeof( int16_t), SEEK_SET);
-   if( !fread( posns, chunk_size, sizeof( int16_t), precomputed_fp))
-      return( -1);
-   if( !posns[0] && !posns[1] && !posns[2])     /* still all zeroes; gotta compute */
+   if( !ifile)
+      return( NULL);
+   fseek( ifile, 0L, SEEK_END);
+   if( (size_t)ftell( ifile) == n_bytes)
       {
-      int16_t * __restrict pptr = posns;
+#ifndef _WIN32
+      void *mapped = mmap( NULL, n_bytes, PROT_READ, MAP_SHARED,
+                                        fileno( ifile), 0);
 
-      fseek( bc405_elem_file, (size_t)bc_chunk * bc405_n_asteroids
-                    * 6 * sizeof( double), SEEK_SET);
-      for( i = 0; i < bc405_n_asteroids; i++)
+      if( mapped != MAP_FAILED)
+         {
+         rval = (int16_t *)mapped;
+         precomputed_data_is_mapped = true;
+         }
+#else
+      rval = (int16_t *)malloc( n_bytes);
+      fseek( ifile, 0L, SEEK_SET);
+      if( rval && fread( rval, n_bytes, 1, ifile) != 1)
+         {
+         free( rval);
+         rval = NULL;
+         }
+#endif
+      }
+   fclose( ifile);
+   precomputed_data = rval;
+   for( i = 0; rval && i < n_bc405_chunks; i++)
+      {
+      const int16_t *pptr = rval + (size_t)i * chunk_size;
+
+      if( !pptr[0] && !pptr[1] && !pptr[2])
+         {
+         unload_precomputed_data( );
+         rval = NULL;
+         }
+      }
+   return( rval);
+}
+
+static int16_t *compute_precomputed_data( ASTEROID_CACHE *cache)
+{
+   FILE *bc405_elem_file = open_bc405_file( cache, false);
+   int16_t *rval, * __restrict pptr;
+   int i, j;
+
+   assert( bc405_elem_file);
+   if( !bc405_elem_file)
+      return( NULL);
+   rval = pptr = (int16_t *)malloc( precomputed_data_size( ));
+   assert( rval);
+   if( !rval)
+      return( NULL);
+   fseek( bc405_elem_file, 0L, SEEK_SET);
+   for( i = 0; i < n_bc405_chunks; i++)
+      for( j = 0; j < bc405_n_asteroids; j++)
          {
          ELEMENTS elems;
          double posn[4];
 
-         grab_elems( &elems, bc405_elem_file, bc_chunk);
+         grab_elems( &elems, bc405_elem_file, i);
          comet_posn( &elems, elems.epoch - bc405_chunk_time / 2., posn);
          *pptr++ = (int16_t)( posn[0] * integer_scale);
          *pptr++ = (int16_t)( posn[1] * integer_scale);
          *pptr++ = (int16_t)( posn[2] * integer_scale);
          }
-      fseek( precomputed_fp, -chunk_size * sizeof( int16_t), SEEK_CUR);
-      fwrite( posns, chunk_size, sizeof( int16_t), precomputed_fp);
+   return( rval);
+}
+
+/* Write to a temporary file,  then rename it,  so that any other process
+looking for 'bc405pre.dat' sees either nothing or a complete file.  */
+
+static int save_precomputed_data( const int16_t *data)
+{
+   char filename[255], temp_name[255], buff[40];
+   FILE *ofile;
+   int rval = -1;
+
+#ifndef _WIN32
+   snprintf( buff, sizeof( buff), "bc405pre.%d", (int)getpid( ));
+#else
+   strcpy( buff, "bc405pre.tmp");
+#endif
+   ofile = fopen( bc405_data_filename( temp_name, buff), "wb");
+   if( ofile)
+      {
+      const size_t n_bytes = precomputed_data_size( );
+
+      if( fwrite( data, n_bytes, 1, ofile) == 1)
+         rval = 0;
+      fclose( ofile);
+      bc405_data_filename( filename, "bc405pre.dat");
+#ifdef _WIN32
+      remove( filename);
+#endif
+      if( !rval)
+         rval = rename( temp_name, filename);
+      if( rval)
+         remove( temp_name);
+      }
+   return( rval);
+}
+
+/* If we can't write out 'bc405pre.dat' (say,  the config directory is
+read-only),  we just keep the ranges we computed in (unshared) memory.  */
+
+static const int16_t *get_precomputed_data( ASTEROID_CACHE *cache)
+{
+   if( !precomputed_data && !load_precomputed_data( ))
+      {
+      int16_t *data = compute_precomputed_data( cache);
+
+      if( data && !save_precomputed_data( data) && load_precomputed_data( ))
+         free( data);
+      else
+         precomputed_data = data;
+      }
+   return( precomputed_data);
+}
+
+/* Finding an asteroid's position from BC-405 means finding the right
+elements (from a small cache,  or reading them from 'bc405.dat'),  then
+solving Kepler's equation.  That happens for every asteroid perturber at
+every step.  Optionally,  one can instead run 'bc405chb' to create
+'bc405chb.dat',  which has Chebyshev polynomials fitted to those Kepler
+positions over each 40-day chunk for each asteroid.  If it's found,  it's
+mapped into memory (shared by all processes and contexts,  as for
+'bc405pre.dat'),  and positions and velocities are found with a few
+multiply-adds and no file I/O.  Times not covered by the file (which can
+cover just part of the BC-405 time span,  to save space) fall back to the
+Kepler solution.  With the default of eight coefficients,  the file covers
+the full BC-405 span in about 210 MBytes.  Errors relative to the Kepler
+positions are well under a km,  except for the more eccentric objects near
+perihelion (about a km for e=.45);  'bc405chb' reports them.   */
+
+#define BC405_CHEBYSHEV_MAGIC "bc405chb"
+
+typedef struct
+{
+   char magic[8];
+   int32_t n_asteroids, n_coeffs, first_chunk, n_chunks;
+   double start_jd, chunk_time;
+} chebyshev_header_t;
+
+static const chebyshev_header_t *chebyshev_data = NULL;
+static size_t chebyshev_data_size;
+static bool use_chebyshev = true, chebyshev_load_tried = false;
+
+static void unload_chebyshev_data( void)
+{
+#ifndef _WIN32
+   if( chebyshev_data)
+      munmap( (void *)chebyshev_data, chebyshev_data_size);
+#else
+   if( chebyshev_data)
+      free( (void *)chebyshev_data);
+#endif
+   chebyshev_data = NULL;
+   chebyshev_load_tried = false;
+}
+
+/* Returns NULL if there's no 'bc405chb.dat',  or if it doesn't match the
+BC-405 data we're using.  Must be called after open_bc405_file( ),  since
+that may find we're using a sub-ephemeris with different parameters.  */
+
+static const chebyshev_header_t *get_chebyshev_data( void)
+{
+   char filename[255];
+   FILE *ifile;
+   chebyshev_header_t hdr;
+
+   if( chebyshev_load_tried || !use_chebyshev)
+      return( use_chebyshev ? chebyshev_data : NULL);
+   chebyshev_load_tried = true;
+   ifile = fopen( bc405_data_filename( filename, "bc405chb.dat"), "rb");
+   if( !ifile)
+      return( NULL);
+   if( fread( &hdr, sizeof( hdr), 1, ifile) == 1
+            && !memcmp( hdr.magic, BC405_CHEBYSHEV_MAGIC, 8)
+            && hdr.n_asteroids == bc405_n_asteroids
+            && hdr.start_jd == bc405_start_jd
+            && hdr.chunk_time == bc405_chunk_time
+            && hdr.first_chunk >= 0 && hdr.n_chunks > 0
+            && hdr.first_chunk + hdr.n_chunks <= n_bc405_chunks
+            && hdr.n_coeffs > 0 && hdr.n_coeffs <= 30)
+      {
+      chebyshev_data_size = sizeof( chebyshev_header_t) + sizeof( double)
+                  * (size_t)hdr.n_chunks * (size_t)hdr.n_asteroids
+                  * 3 * (size_t)hdr.n_coeffs;
+      fseek( ifile, 0L, SEEK_END);
+      if( (size_t)ftell( ifile) == chebyshev_data_size)
+         {
+#ifndef _WIN32
+         void *mapped = mmap( NULL, chebyshev_data_size, PROT_READ,
+                                    MAP_SHARED, fileno( ifile), 0);
+
+         if( mapped != MAP_FAILED)
+            chebyshev_data = (const chebyshev_header_t *)mapped;
+#else
+         void *data = malloc( chebyshev_data_size);
+
+         fseek( ifile, 0L, SEEK_SET);
+         if( data && fread( data, chebyshev_data_size, 1, ifile) == 1)
+            chebyshev_data = (const chebyshev_header_t *)data;
+         else if( data)
+            free( data);
+#endif
+         }
+      }
+   fclose( ifile);
+   if( !chebyshev_data)
+      debug_printf( "'%s' not used\n", filename);
+   return( chebyshev_data);
+}
+
+/* Lets 'bc405chb' compare Chebyshev and Kepler positions.  */
+
+void use_bc405_chebyshev( const bool use_it)
+{
+   use_chebyshev = use_it;
+}
+
+/* Evaluates the Chebyshev series,  and optionally its derivative,  at
+x (-1 <= x <= 1),  using the usual recurrences T(n+1) = 2xT(n) - T(n-1),
+T'(n+1) = 2T(n) + 2xT'(n) - T'(n-1).  */
+
+static double chebyshev_value( const double *coeffs, const int n_coeffs,
+                  const double x, double *deriv)
+{
+   double t0 = 1., t1 = x, d0 = 0., d1 = 1.;
+   double rval = coeffs[0] + coeffs[1] * x, drval = coeffs[1];
+   int i;
+
+   for( i = 2; i < n_coeffs; i++)
+      {
+      const double t2 = 2. * x * t1 - t0;
+      const double d2 = 2. * t1 + 2. * x * d1 - d0;
+
+      rval += coeffs[i] * t2;
+      drval += coeffs[i] * d2;
+      t0 = t1;
+      t1 = t2;
+      d0 = d1;
+      d1 = d2;
+      }
+   if( deriv)
+      *deriv = drval;
+   return( rval);
+}
+
+/* Returns -1 if this time isn't covered by the Chebyshev data. */
+
+static int chebyshev_asteroid_posn( const chebyshev_header_t *hdr,
+                  const int astnum, const int chunk, const double jd,
+                  double *posn, double *vel)
+{
+   const double half_span = hdr->chunk_time / 2.;
+   const double x = (jd - (hdr->start_jd + (double)chunk * hdr->chunk_time))
+                                    / half_span;
+   const double *coeffs;
+   int i;
+
+   if( chunk < hdr->first_chunk || chunk >= hdr->first_chunk + hdr->n_chunks
+               || x < -1. || x > 1. || astnum < 0 || astnum >= hdr->n_asteroids)
+      return( -1);
+   coeffs = (const double *)( hdr + 1) + ((size_t)( chunk - hdr->first_chunk)
+               * (size_t)hdr->n_asteroids + (size_t)astnum)
+               * 3 * (size_t)hdr->n_coeffs;
+   for( i = 0; i < 3; i++, coeffs += hdr->n_coeffs)
+      {
+      double deriv;
+      const double value = chebyshev_value( coeffs, hdr->n_coeffs, x,
+                                 (vel ? &deriv : NULL));
+
+      if( posn)
+         posn[i] = value;
+      if( vel)
+         vel[i] = deriv / half_span;
+      }
+   if( posn)
+      posn[3] = sqrt( posn[0] * posn[0] + posn[1] * posn[1] + posn[2] * posn[2]);
+   return( 0);
+}
+
+/* Creates the Chebyshev file described above,  for the chunks covering
+jd_start to jd_end (or all of them,  if jd_end <= jd_start).  For each
+chunk and asteroid,  we compute Kepler positions at the n_coeffs
+Chebyshev nodes,  and get the coefficients from those in the usual way.
+As with 'bc405pre.dat',  the file is written under a temporary name and
+then renamed.  Returns the number of chunks written,  or a negative
+error code.  */
+
+int create_bc405_chebyshev_file( const int n_coeffs, const double jd_start,
+                  const double jd_end)
+{
+   ASTEROID_CACHE *cache = get_asteroid_cache( NULL);
+   FILE *elem_fp = open_bc405_file( cache, false), *ofile;
+   chebyshev_header_t hdr;
+   char filename[255], temp_name[255];
+   double *coeffs, *node_posns, cos_table[30 * 30];
+   int chunk, i, j, k, rval = 0, first_chunk = 0, n_chunks = n_bc405_chunks;
+
+   if( !elem_fp)
+      return( NO_BC405_FILE);
+   assert( n_coeffs > 1 && n_coeffs <= 30);
+   if( jd_end > jd_start)
+      {
+      const int last_chunk =
+               (int)( (jd_end - bc405_start_jd) / bc405_chunk_time + .5);
+
+      first_chunk = (int)( (jd_start - bc405_start_jd) / bc405_chunk_time + .5);
+      if( first_chunk < 0)
+         first_chunk = 0;
+      n_chunks = last_chunk - first_chunk + 1;
+      if( n_chunks > n_bc405_chunks - first_chunk)
+         n_chunks = n_bc405_chunks - first_chunk;
+      if( n_chunks <= 0)
+         return( BC405_INVALID_CHUNK);
+      }
+   memcpy( hdr.magic, BC405_CHEBYSHEV_MAGIC, 8);
+   hdr.n_asteroids = bc405_n_asteroids;
+   hdr.n_coeffs = n_coeffs;
+   hdr.first_chunk = first_chunk;
+   hdr.n_chunks = n_chunks;
+   hdr.start_jd = bc405_start_jd;
+   hdr.chunk_time = bc405_chunk_time;
+   ofile = fopen( bc405_data_filename( temp_name, "bc405chb.tmp"), "wb");
+   if( !ofile)
+      return( BC405_COULDNT_OPEN_BINARY_FILE);
+   fwrite( &hdr, sizeof( hdr), 1, ofile);
+   for( j = 0; j < n_coeffs; j++)      /* cos_table[j * n + k] = T_j(x_k) */
+      for( k = 0; k < n_coeffs; k++)
+         cos_table[j * n_coeffs + k] =
+                     cos( PI * (double)j * ((double)k + .5) / (double)n_coeffs);
+   coeffs = (double *)malloc( bc405_n_asteroids * 3 * n_coeffs * sizeof( double));
+   node_posns = (double *)malloc( 3 * n_coeffs * sizeof( double));
+   assert( coeffs && node_posns);
+   fseek( elem_fp, (size_t)first_chunk * (size_t)bc405_n_asteroids
+                         * 6 * sizeof( double), SEEK_SET);
+   for( chunk = first_chunk; !rval && chunk < first_chunk + n_chunks; chunk++)
+      {
+      for( i = 0; i < bc405_n_asteroids; i++)
+         {
+         ELEMENTS elems;
+         double *cptr = coeffs + i * 3 * n_coeffs;
+
+         grab_elems( &elems, elem_fp, chunk);
+         for( k = 0; k < n_coeffs; k++)
+            {
+            double loc[4];
+            const double x = cos_table[n_coeffs + k];    /* = T_1(x_k) = x_k */
+
+            comet_posn( &elems, elems.epoch + x * bc405_chunk_time / 2., loc);
+            for( j = 0; j < 3; j++)
+               node_posns[j * n_coeffs + k] = loc[j];
+            }
+         for( j = 0; j < 3; j++)
+            for( k = 0; k < n_coeffs; k++)
+               {
+               const double *tptr = cos_table + k * n_coeffs;
+               const double *pptr = node_posns + j * n_coeffs;
+               double sum = 0.;
+               int l;
+
+               for( l = 0; l < n_coeffs; l++)
+                  sum += tptr[l] * pptr[l];
+               cptr[j * n_coeffs + k] = sum * (k ? 2. : 1.) / (double)n_coeffs;
+               }
+         }
+      if( fwrite( coeffs, sizeof( double), bc405_n_asteroids * 3 * n_coeffs,
+                     ofile) != (size_t)( bc405_n_asteroids * 3 * n_coeffs))
+         rval = BC405_COULDNT_OPEN_BINARY_FILE;
+      }
+   free( coeffs);
+   free( node_posns);
+   fclose( ofile);
+   if( !rval)
+      {
+      bc405_data_filename( filename, "bc405chb.dat");
+      unload_chebyshev_data( );
+#ifdef _WIN32
+      remove( filename);
+#endif
+      if( rename( temp_name, filename))
+         rval = BC405_COULDNT_OPEN_BINARY_FILE;
+      }
+   if( rval)
+      remove( temp_name);
+   return( rval ? rval : n_chunks);
+}
+
+/* Compares Chebyshev and Kepler positions and velocities for each asteroid
+at 'n_samples' random times within the span covered by 'bc405chb.dat',
+and writes a summary to 'ofile'.  Returns -1 if there's no usable file. */
+
+int bc405_chebyshev_report( FILE *ofile, const int n_samples)
+{
+   const chebyshev_header_t *hdr;
+   double max_perr = 0., max_verr = 0., sum_perr2 = 0., sum_verr2 = 0.;
+   double worst_jd = 0.;
+   int i, j, worst_asteroid = -1;
+   long n_compared = 0;
+
+   use_bc405_chebyshev( true);
+   get_asteroid_mass( 1);        /* ensures asteroid numbers are loaded */
+   open_bc405_file( get_asteroid_cache( NULL), false);
+   hdr = get_chebyshev_data( );
+   if( !hdr)
+      return( -1);
+   fprintf( ofile, "%d asteroids, %d coefficients, JD %.1f to %.1f\n",
+            hdr->n_asteroids, hdr->n_coeffs,
+            hdr->start_jd + ((double)hdr->first_chunk - .5) * hdr->chunk_time,
+            hdr->start_jd + ((double)( hdr->first_chunk + hdr->n_chunks) - .5)
+                                             * hdr->chunk_time);
+   for( i = 0; i < hdr->n_asteroids; i++)
+      for( j = 0; j < n_samples; j++)
+         {
+         const double jd = hdr->start_jd + hdr->chunk_time *
+                   ((double)hdr->first_chunk - .5 + (double)hdr->n_chunks
+                   * (double)rand( ) / ((double)RAND_MAX + 1.));
+         double cheb_posn[4], cheb_vel[3], kep_posn[4], kep_vel[3];
+         double perr = 0., verr = 0.;
+         int k;
+
+         use_bc405_chebyshev( true);
+         asteroid_position_raw( i, jd, cheb_posn, cheb_vel);
+         use_bc405_chebyshev( false);
+         asteroid_position_raw( i, jd, kep_posn, kep_vel);
+         for( k = 0; k < 3; k++)
+            {
+            perr += (cheb_posn[k] - kep_posn[k]) * (cheb_posn[k] - kep_posn[k]);
+            verr += (cheb_vel[k] - kep_vel[k]) * (cheb_vel[k] - kep_vel[k]);
+            }
+         sum_perr2 += perr;
+         sum_verr2 += verr;
+         n_compared++;
+         if( max_perr < perr)
+            {
+            max_perr = perr;
+            worst_asteroid = i;
+            worst_jd = jd;
+            }
+         if( max_verr < verr)
+            max_verr = verr;
+         }
+   use_bc405_chebyshev( true);
+   if( n_compared)
+      {
+      const double au_per_day_in_mm_per_sec = AU_IN_KM * 1e+6 / seconds_per_day;
+
+      fprintf( ofile, "%ld positions compared\n", n_compared);
+      fprintf( ofile, "Posn error: RMS %.3g km,  max %.3g km (asteroid %d, JD %.3f)\n",
+               sqrt( sum_perr2 / (double)n_compared) * AU_IN_KM,
+               sqrt( max_perr) * AU_IN_KM,
+               (worst_asteroid >= 0 && worst_asteroid < n_masses ?
+                        asteroid_numbers[worst_asteroid] : worst_asteroid),
+               worst_jd);
+      fprintf( ofile, "Vel error: RMS %.3g mm/s,  max %.3g mm/s\n",
+               sqrt( sum_verr2 / (double)n_compared) * au_per_day_in_mm_per_sec,
+               sqrt( max_verr) * au_per_day_in_mm_per_sec);
       }
    return( 0);
 }
 
-static int asteroid_numbers[MAX_BC405_N_ASTEROIDS];
-int excluded_asteroid_number = 0;
-static double *masses;
+
+/* We don't necessarily know how many asteroids the BC-405 (or
+sub-ephemeris) file has until it's opened,  so all of 'mu1.txt' is read,
+sizing the arrays to fit.  */
 
 static double *load_asteroid_masses( void)
 {
@@ -341,20 +927,26 @@ static double *load_asteroid_masses( void)
    assert( ifile);
    if( ifile)
       {
-      int i = 0, ast_number;
+      int i = 0, n_alloced = 0, ast_number;
       char buff[180];
       double mass;
 
-      rval = (double *)calloc( bc405_n_asteroids, sizeof( double));
-      assert( rval);
-      while( i < bc405_n_asteroids && fgets( buff, sizeof( buff), ifile))
+      while( fgets( buff, sizeof( buff), ifile))
          if( *buff != ';'
                && sscanf( buff, "%d%lf", &ast_number, &mass) == 2)
             {
+            if( i == n_alloced)
+               {
+               n_alloced = 2 * n_alloced + 400;
+               rval = (double *)realloc( rval, n_alloced * sizeof( double));
+               asteroid_numbers = (int *)realloc( asteroid_numbers,
+                                       n_alloced * sizeof( int));
+               assert( rval && asteroid_numbers);
+               }
             asteroid_numbers[i] = ast_number;
-            if( rval)
-               rval[i++] = mass;
+            rval[i++] = mass;
             }
+      n_masses = i;
       fclose( ifile);
 /*    rval[0] = 4.747105847157599504245142421641e-10;  (solar masses) */
       }  /* Ceres: special 63 km^3/s^2 value:  not now in use */
@@ -363,23 +955,411 @@ static double *load_asteroid_masses( void)
    return( rval);
 }
 
-int asteroid_position_raw( const int astnum, const double jd,
-                              double *posn, double *vel)
+static void build_perturber_config( perturber_config_t *config)
+{
+   extern unsigned environment_generation;
+   const char *fixed_perturber_list = get_environment_ptr( "ASTEROID_PERT_LIST");
+   double thresh = atof( get_environment_ptr( "ASTEROID_THRESH"));
+   int i;
+
+   if( config->n_alloced < bc405_n_asteroids)
+      {
+      free( config->fixed);
+      free( config->ithresh);
+      config->n_alloced = bc405_n_asteroids;
+      config->fixed = (uint32_t *)malloc( ((bc405_n_asteroids + 31) / 32)
+                                             * sizeof( uint32_t));
+      config->ithresh = (int16_t *)malloc( bc405_n_asteroids * sizeof( int16_t));
+      assert( config->fixed && config->ithresh);
+      }
+   memset( config->fixed, 0, ((bc405_n_asteroids + 31) / 32) * sizeof( uint32_t));
+   config->n_fixed = 0;
+   config->generation = environment_generation;
+   config->serial++;                   /* caches must rebuild their boxes */
+   while( *fixed_perturber_list)  /* see ASTEROID_PERT_LIST comments in */
+      {                           /* 'environ.def' for info on this */
+      const int astnum = atoi( fixed_perturber_list);
+
+      config->n_fixed++;
+      for( i = 0; i < bc405_n_asteroids && i < n_masses; i++)
+         if( asteroid_numbers[i] == astnum)
+            config->fixed[i >> 5] |= (uint32_t)1 << (i & 31);
+      while( *fixed_perturber_list && *fixed_perturber_list != ',')
+         fixed_perturber_list++;
+      if( *fixed_perturber_list == ',')
+         fixed_perturber_list++;
+      }
+   config->n_asteroids_to_use = atoi( get_environment_ptr( "BC405_ASTEROIDS"));
+   if( config->n_asteroids_to_use <= 0
+               || config->n_asteroids_to_use > bc405_n_asteroids)
+      config->n_asteroids_to_use = bc405_n_asteroids;
+   if( config->n_asteroids_to_use > n_masses)
+      config->n_asteroids_to_use = n_masses;
+   if( !thresh)
+      thresh = 10.;                              /* Pallas extends 10 AU;  all others */
+   thresh *= integer_scale / sqrt( masses[1]);   /* scaled by sqrt of their masses    */
+   for( i = 0; i < config->n_asteroids_to_use; i++)
+      {
+      const double dthresh = thresh * sqrt( masses[i]) + .1 * integer_scale;
+
+      config->ithresh[i] = (int16_t)( dthresh > 27000. ? 27000 : dthresh);
+      }
+}
+
+static const perturber_config_t *get_perturber_config( void)
+{
+   extern unsigned environment_generation;
+
+   if( perturber_config.generation != environment_generation)
+      build_perturber_config( &perturber_config);
+   return( &perturber_config);
+}
+
+/* For each asteroid,  the object being integrated is a possible perturber
+if,  on each axis,  it's within ithresh of the range between its positions
+at the start of this chunk and at the start of the next one.  Rather than
+test that one axis and asteroid at a time,  with lots of unpredictable
+branches,  we store the 'boxes' as separate arrays of lower and upper
+limits for each axis,  with ithresh already applied,  and rebuild them
+only when we change chunks or the configuration changes.  Entries past
+'n_asteroids_to_use' get an empty box,  so find_box_candidates() can
+always handle a full vector's worth of asteroids.  */
+
+static void build_perturber_boxes( ASTEROID_CACHE *cache,
+            const perturber_config_t *config,
+            const int16_t *posns0, const int16_t *posns1)
+{
+   const int n_entries = N_BOX_ENTRIES( config->n_asteroids_to_use);
+   int axis, i;
+
+   if( cache->n_box_entries < n_entries)
+      {
+      free( cache->box_lo);
+      free( cache->box_hi);
+      free( cache->candidates);
+      free( cache->wide);
+      cache->box_lo = (int16_t *)malloc( 3 * n_entries * sizeof( int16_t));
+      cache->box_hi = (int16_t *)malloc( 3 * n_entries * sizeof( int16_t));
+      cache->candidates = (int *)malloc( n_entries * sizeof( int));
+      cache->wide = (int *)malloc( n_entries * sizeof( int));
+      assert( cache->box_lo && cache->box_hi);
+      assert( cache->candidates && cache->wide);
+      cache->n_box_entries = n_entries;
+      }
+   for( axis = 0; axis < 3; axis++)
+      {
+      int16_t *lo = cache->box_lo + axis * cache->n_box_entries;
+      int16_t *hi = cache->box_hi + axis * cache->n_box_entries;
+
+      for( i = 0; i < cache->n_box_entries; i++)
+         if( i < config->n_asteroids_to_use)
+            {
+            const int p0 = (int)posns0[i * 3 + axis];
+            const int p1 = (int)posns1[i * 3 + axis];
+            const int ithresh = (int)config->ithresh[i];
+            const int ilo = (p0 < p1 ? p0 : p1) - ithresh;
+            const int ihi = (p0 < p1 ? p1 : p0) + ithresh;
+
+            lo[i] = (int16_t)( ilo < INT16_MIN ? INT16_MIN : ilo);
+            hi[i] = (int16_t)( ihi > INT16_MAX ? INT16_MAX : ihi);
+            }
+         else
+            {
+            lo[i] = INT16_MAX;
+            hi[i] = INT16_MIN;
+            }
+      }
+}
+
+/* Puts the indices of asteroids whose boxes contain ixyz into
+'candidates',  and returns the number found.  Usually,  that's zero or a
+few,  so we check a vector's worth of asteroids at a time and only look
+at individual ones if something in that vector is inside its box.  */
+
+static int find_box_candidates( const ASTEROID_CACHE *cache,
+            const int n_asteroids, const int16_t *ixyz, int *candidates)
+{
+   const int16_t *lo = cache->box_lo, *hi = cache->box_hi;
+   const int stride = cache->n_box_entries;
+   int i, n_found = 0;
+#if BOX_VECTOR_WIDTH == 16
+   const __m256i x = _mm256_set1_epi16( ixyz[0]);
+   const __m256i y = _mm256_set1_epi16( ixyz[1]);
+   const __m256i z = _mm256_set1_epi16( ixyz[2]);
+
+   for( i = 0; i < n_asteroids; i += 16)
+      {
+      __m256i inside = _mm256_and_si256(
+         _mm256_cmpgt_epi16( x, _mm256_loadu_si256( (const __m256i *)( lo + i))),
+         _mm256_cmpgt_epi16( _mm256_loadu_si256( (const __m256i *)( hi + i)), x));
+      unsigned mask;
+
+      inside = _mm256_and_si256( inside, _mm256_and_si256(
+         _mm256_cmpgt_epi16( y, _mm256_loadu_si256( (const __m256i *)( lo + stride + i))),
+         _mm256_cmpgt_epi16( _mm256_loadu_si256( (const __m256i *)( hi + stride + i)), y)));
+      inside = _mm256_and_si256( inside, _mm256_and_si256(
+         _mm256_cmpgt_epi16( z, _mm256_loadu_si256( (const __m256i *)( lo + 2 * stride + i))),
+         _mm256_cmpgt_epi16( _mm256_loadu_si256( (const __m256i *)( hi + 2 * stride + i)), z)));
+      mask = (unsigned)_mm256_movemask_epi8( inside);
+      if( mask)         /* two mask bits per int16_t */
+         {
+         int j;
+
+         for( j = 0; j < 16; j++)
+            if( (mask >> (j * 2)) & 1)
+               candidates[n_found++] = i + j;
+         }
+      }
+#elif BOX_VECTOR_WIDTH == 8
+   const __m128i x = _mm_set1_epi16( ixyz[0]);
+   const __m128i y = _mm_set1_epi16( ixyz[1]);
+   const __m128i z = _mm_set1_epi16( ixyz[2]);
+
+   for( i = 0; i < n_asteroids; i += 8)
+      {
+      __m128i inside = _mm_and_si128(
+         _mm_cmpgt_epi16( x, _mm_loadu_si128( (const __m128i *)( lo + i))),
+         _mm_cmpgt_epi16( _mm_loadu_si128( (const __m128i *)( hi + i)), x));
+      unsigned mask;
+
+      inside = _mm_and_si128( inside, _mm_and_si128(
+         _mm_cmpgt_epi16( y, _mm_loadu_si128( (const __m128i *)( lo + stride + i))),
+         _mm_cmpgt_epi16( _mm_loadu_si128( (const __m128i *)( hi + stride + i)), y)));
+      inside = _mm_and_si128( inside, _mm_and_si128(
+         _mm_cmpgt_epi16( z, _mm_loadu_si128( (const __m128i *)( lo + 2 * stride + i))),
+         _mm_cmpgt_epi16( _mm_loadu_si128( (const __m128i *)( hi + 2 * stride + i)), z)));
+      mask = (unsigned)_mm_movemask_epi8( inside);
+      if( mask)         /* two mask bits per int16_t */
+         {
+         int j;
+
+         for( j = 0; j < 8; j++)
+            if( (mask >> (j * 2)) & 1)
+               candidates[n_found++] = i + j;
+         }
+      }
+#else
+   for( i = 0; i < n_asteroids; i++)
+      if( (ixyz[0] > lo[i]) & (ixyz[0] < hi[i])
+            & (ixyz[1] > lo[i + stride]) & (ixyz[1] < hi[i + stride])
+            & (ixyz[2] > lo[i + 2 * stride]) & (ixyz[2] < hi[i + 2 * stride]))
+         candidates[n_found++] = i;
+#endif
+   return( n_found);
+}
+
+/* With a few hundred asteroids,  testing every box (a vector at a time)
+is about as fast as anything.  With thousands,  it'd make each derivative
+evaluation linear in the number of perturbers,  even though the object is
+near very few of them.  So for MIN_ASTEROIDS_FOR_GRID or more asteroids,
+we also build a uniform grid of GRID_N_CELLS by GRID_N_CELLS cells,  each
+GRID_CELL_SIZE (.4 AU) on a side,  in x and y (the belt is flat enough that
+z doesn't help much).  Each box is listed in every cell it overlaps.  Boxes
+outside the grid go into the edge cells,  and the point we're testing is
+clamped to the grid in the same way,  so nothing is missed.  Boxes covering
+more than GRID_MAX_CELLS_PER_BOX cells (big asteroids,  or fast-moving ones)
+go on a 'wide' list that is always tested.
+
+   The cell lists are stored end to end in 'grid_entries',  with cell n's
+list running from grid_start[n] up to (but not including) grid_start[n+1].
+Each list,  like the 'wide' list,  is in increasing order,  so that
+find_grid_candidates() finds the same candidates,  in the same order,  as
+find_box_candidates() would;  the perturbations are then summed in the same
+order,  and we get exactly the same result either way.  */
+
+static int grid_cell( const int coord)
+{
+   const int rval = (coord + GRID_N_CELLS * GRID_CELL_SIZE / 2) / GRID_CELL_SIZE;
+
+   return( rval < 0 ? 0 : (rval >= GRID_N_CELLS ? GRID_N_CELLS - 1 : rval));
+}
+
+static void build_perturber_grid( ASTEROID_CACHE *cache, const int n_asteroids)
+{
+   const int16_t *lo = cache->box_lo, *hi = cache->box_hi;
+   const int stride = cache->n_box_entries;
+   int *start = cache->grid_start;
+   int i, x, y, n_entries = 0;
+
+   if( !start)
+      {
+      start = cache->grid_start = (int *)malloc(
+                  (GRID_N_CELLS * GRID_N_CELLS + 1) * sizeof( int));
+      assert( start);
+      }
+   memset( start, 0, (GRID_N_CELLS * GRID_N_CELLS + 1) * sizeof( int));
+   cache->n_wide = 0;
+   for( i = 0; i < n_asteroids; i++)      /* first pass:  count entries */
+      {                                   /* for each cell */
+      const int x0 = grid_cell( lo[i]), x1 = grid_cell( hi[i]);
+      const int y0 = grid_cell( lo[i + stride]), y1 = grid_cell( hi[i + stride]);
+
+      if( (x1 - x0 + 1) * (y1 - y0 + 1) > GRID_MAX_CELLS_PER_BOX)
+         cache->wide[cache->n_wide++] = i;
+      else
+         for( y = y0; y <= y1; y++)
+            for( x = x0; x <= x1; x++)
+               {
+               start[x + y * GRID_N_CELLS]++;
+               n_entries++;
+               }
+      }
+   if( cache->n_grid_entries_alloced < n_entries)
+      {
+      free( cache->grid_entries);
+      cache->n_grid_entries_alloced = n_entries + n_entries / 4;
+      cache->grid_entries = (int *)malloc(
+                  cache->n_grid_entries_alloced * sizeof( int));
+      assert( cache->grid_entries);
+      }
+   for( i = 1; i <= GRID_N_CELLS * GRID_N_CELLS; i++)
+      start[i] += start[i - 1];     /* start[n] now = end of cell n's list */
+   for( i = n_asteroids - 1; i >= 0; i--)    /* second pass:  fill lists */
+      {                                      /* from the end back */
+      const int x0 = grid_cell( lo[i]), x1 = grid_cell( hi[i]);
+      const int y0 = grid_cell( lo[i + stride]), y1 = grid_cell( hi[i + stride]);
+
+      if( (x1 - x0 + 1) * (y1 - y0 + 1) <= GRID_MAX_CELLS_PER_BOX)
+         for( y = y0; y <= y1; y++)
+            for( x = x0; x <= x1; x++)
+               cache->grid_entries[--start[x + y * GRID_N_CELLS]] = i;
+      }
+}
+
+static inline bool inside_perturber_box( const ASTEROID_CACHE *cache,
+                     const int idx, const int16_t *ixyz)
 {
+   const int16_t *lo = cache->box_lo + idx, *hi = cache->box_hi + idx;
+   const int stride = cache->n_box_entries;
+
+   return( ixyz[0] > lo[0] && ixyz[0] < hi[0]
+        && ixyz[1] > lo[stride] && ixyz[1] < hi[stride]
+        && ixyz[2] > lo[2 * stride] && ixyz[2] < hi[2 * stride]);
+}
+
+/* Merges the 'wide' list and the list for the cell containing ixyz,  keeping
+the boxes that actually contain ixyz.  Returns the number found,  and sets
+*n_tested to the number of boxes we had to look at.  */
+
+static int find_grid_candidates( const ASTEROID_CACHE *cache,
+            const int16_t *ixyz, int *candidates, int *n_tested)
+{
+   const int cell = grid_cell( ixyz[0]) + GRID_N_CELLS * grid_cell( ixyz[1]);
+   const int *list = cache->grid_entries + cache->grid_start[cell];
+   const int n_list = cache->grid_start[cell + 1] - cache->grid_start[cell];
+   int i = 0, j = 0, n_found = 0;
+
+   while( i < cache->n_wide || j < n_list)
+      {
+      int idx;
+
+      if( j == n_list || (i < cache->n_wide && cache->wide[i] < list[j]))
+         idx = cache->wide[i++];
+      else
+         idx = list[j++];
+      if( inside_perturber_box( cache, idx, ixyz))
+         candidates[n_found++] = idx;
+      }
+   *n_tested = cache->n_wide + n_list;
+   return( n_found);
+}
+
+/* Asteroid masses and numbers are shared by all caches,  so we load them
+when the first cache is allocated (i.e.,  before any threads start).  The
+precomputed ranges (and Chebyshev data,  if any) are also loaded then,  if
+we've already found the BC-405 file;  if not,  we leave that for
+detect_perturbers(),  to avoid complaining about a missing file that may
+never be needed.  */
+
+ASTEROID_CACHE *alloc_asteroid_cache( void)
+{
+   ASTEROID_CACHE *rval = (ASTEROID_CACHE *)calloc( 1, sizeof( ASTEROID_CACHE));
+
+   assert( rval);
+   if( !masses)
+      masses = load_asteroid_masses( );
+   if( masses)
+      get_perturber_config( );
+   if( rval && masses && bc405_filename && open_bc405_file( rval, false))
+      {
+      get_precomputed_data( rval);
+      get_chebyshev_data( );
+      }
+   return( rval);
+}
+
+/* Called by 'fo' before it forks,  so that the precomputed ranges are
+built (if need be) once,  then shared by all the processes (as is the
+Chebyshev data,  if any).  The BC-405 file is closed again,  so each
+process will open its own (processes sharing a FILE would share its file
+position).  */
+
+int load_bc405_precomputed_data( void)
+{
+   ASTEROID_CACHE *cache = get_asteroid_cache( NULL);
+   int rval;
+
+   if( !open_bc405_file( cache, false))
+      return( NO_BC405_FILE);
+   rval = (get_precomputed_data( cache) ? 0 : BC405_COULDNT_OPEN_BINARY_FILE);
+   get_chebyshev_data( );
+   open_bc405_file( cache, true);
+   return( rval);
+}
+
+static void free_perturber_boxes( ASTEROID_CACHE *cache)
+{
+   free( cache->box_lo);
+   free( cache->box_hi);
+   free( cache->candidates);
+   free( cache->wide);
+   free( cache->grid_start);
+   free( cache->grid_entries);
+   cache->box_lo = cache->box_hi = NULL;
+   cache->candidates = cache->wide = NULL;
+   cache->grid_start = cache->grid_entries = NULL;
+   cache->n_box_entries = cache->n_grid_entries_alloced = 0;
+   cache->box_chunk = -1;
+}
+
+void free_asteroid_cache( ASTEROID_CACHE *cache)
+{
+   if( cache && cache != &default_cache)
+      {
+      open_bc405_file( cache, true);
+      free_perturber_boxes( cache);
+      free( cache);
+      }
+}
+
+int asteroid_position_ctx( INTEGRATION_CONTEXT *ctx, const int astnum,
+                      const double jd, double *posn, double *vel)
+{
+   ASTEROID_CACHE *cache = get_asteroid_cache( ctx);
+   const chebyshev_header_t *cheby;
    ELEMENTS elem;
    int chunk;
 
-   open_bc405_file( false);
+   open_bc405_file( cache, false);
    chunk = (int)( (jd - bc405_start_jd) / bc405_chunk_time + .5);
    if( chunk < 0)
       chunk = 0;
    else if( chunk >= n_bc405_chunks - 1)
       chunk = n_bc405_chunks - 1;
-   grab_cached_elems( &elem, chunk, astnum);
+   cheby = get_chebyshev_data( );
+   if( cheby && !chebyshev_asteroid_posn( cheby, astnum, chunk, jd, posn, vel))
+      return( 0);
+   grab_cached_elems( cache, &elem, chunk, astnum);
    comet_posn_and_vel( &elem, jd, posn, vel);
    return( 0);
 }
 
+int asteroid_position_raw( const int astnum, const double jd,
+                              double *posn, double *vel)
+{
+   return( asteroid_position_ctx( NULL, astnum, jd, posn, vel));
+}
+
 double *get_asteroid_mass( const int astnum)
 {
    int i;
@@ -387,7 +1367,7 @@ double *get_asteroid_mass( const int astnum)
 
    if( !masses)
       masses = load_asteroid_masses( );
-   for( i = 0; !rval && i < bc405_n_asteroids; i++)
+   for( i = 0; !rval && i < n_masses; i++)
       if( asteroid_numbers[i] == astnum)
          rval = &masses[i];
    return( rval);
@@ -396,64 +1376,70 @@ double *get_asteroid_mass( const int astnum)
 int detect_perturbers( const double jd, const double * __restrict xyz,
                        double *accel)
 {
-   static int curr_chunk = -1;
-   static int16_t posns0[MAX_BC405_N_ASTEROIDS * 3];
-   static int16_t posns1[MAX_BC405_N_ASTEROIDS * 3];
+   return( detect_perturbers_ctx( NULL, jd, xyz, accel));
+}
+
+int detect_perturbers_ctx( INTEGRATION_CONTEXT *ctx, const double jd,
+                        const double * __restrict xyz, double *accel)
+{
+   ASTEROID_CACHE *cache = get_asteroid_cache( ctx);
+   const int16_t *posns0, *posns1;
    int16_t ixyz[3];
-   static FILE *precomputed_fp;
-   static bool bc405_available = true;
-   static int n_asteroids_to_use = 0;
-   double thresh;
-   int i, load_posn0 = 0, load_posn1 = 0, chunk, n_fixed = 0;
-   const char *fixed_perturber_list;
-   int fixed_perturbers[MAX_BC405_N_ASTEROIDS];
-
-   if( !bc405_available)
+   int i, k, chunk, n_candidates, *candidates;
+   const perturber_config_t *config;
+   INTEGRATION_COUNTERS *counters;
+   int64_t t_start;
+   bool time_it;
+
+   if( !cache->bc405_available)
       return( NO_BC405_FILE);
    if( !xyz)              /* freeing memory, closing cached file pointers */
       {
-      if( precomputed_fp)
-         fclose( precomputed_fp);
-      if( masses)
+      if( masses && cache == &default_cache)
+         {
          free( masses);
-      precomputed_fp = NULL;
-      masses = NULL;
-      open_bc405_file( true);
-      grab_cached_elems( NULL, 0, 0);
+         free( asteroid_numbers);
+         masses = NULL;
+         asteroid_numbers = NULL;
+         n_masses = 0;
+         perturber_config.generation = 0;    /* force a rebuild */
+         }
+      if( cache == &default_cache)
+         {
+         unload_precomputed_data( );
+         unload_chebyshev_data( );
+         }
+      free_perturber_boxes( cache);
+      open_bc405_file( cache, true);
+      grab_cached_elems( cache, NULL, 0, 0);
       return( 0);
       }
-   thresh = atof( get_environment_ptr( "ASTEROID_THRESH"));
-   fixed_perturber_list = get_environment_ptr( "ASTEROID_PERT_LIST");
    if( !masses)
       masses = load_asteroid_masses( );
    if( !masses)
       {
-      bc405_available = false;
+      cache->bc405_available = false;
       return( NO_BC405_FILE);
       }
-   if( !open_bc405_file( false))
+   if( !open_bc405_file( cache, false))
       {
-      bc405_available = false;
+      cache->bc405_available = false;
       return( NO_BC405_FILE);
       }
 
-   if( !precomputed_fp)
-      precomputed_fp = get_precomputed_data_fp( );
-   if( !precomputed_fp)
+   posns0 = get_precomputed_data( cache);
+   if( !posns0)
       {
-      bc405_available = false;
+      cache->bc405_available = false;
       return( NO_BC405_FILE);
       }
 
-   while( *fixed_perturber_list)  /* see ASTEROID_PERT_LIST comments in */
-      {                           /* 'environ.def' for info on this */
-      fixed_perturbers[n_fixed++] = atoi( fixed_perturber_list);
-      while( *fixed_perturber_list && *fixed_perturber_list != ',')
-         fixed_perturber_list++;
-      if( *fixed_perturber_list == ',')
-         fixed_perturber_list++;
-      }
-
+   counters = (ctx ? &ctx->counters : default_integration_counters( ));
+            /* This is called for every derivative evaluation;  the two */
+            /* clock reads are only worth it if the counters are output */
+   time_it = get_environment_snapshot( )->counters_wanted;
+   t_start = (time_it ? nanoseconds_since_1970( ) : 0);
+   config = get_perturber_config( );
    chunk = (int)( (jd - bc405_start_jd) / bc405_chunk_time + .5);
    if( chunk < 0)
       chunk = 0;
@@ -461,102 +1447,80 @@ int detect_perturbers( const double jd, const double * __restrict xyz,
                   /* chunks,  we can't go past n_bc405_chunks - 2 :   */
    if( chunk > n_bc405_chunks - 2)
       chunk = n_bc405_chunks - 2;
-   if( chunk == curr_chunk - 1)
-      {
-      memcpy( posns1, posns0, bc405_n_asteroids * 3 * sizeof( int16_t));
-      load_posn0 = 1;
-      }
-   else if( chunk == curr_chunk + 1)
-      {
-      memcpy( posns0, posns1, bc405_n_asteroids * 3 * sizeof( int16_t));
-      load_posn1 = 1;
-      }
-   else if( chunk != curr_chunk)
-      load_posn0 = load_posn1 = 1;
-   if( load_posn0)
-      find_and_set_precomputed_data( precomputed_fp, chunk, posns0);
-   if( load_posn1)
-      find_and_set_precomputed_data( precomputed_fp, chunk + 1, posns1);
-   curr_chunk = chunk;
-   if( !n_asteroids_to_use)
-      n_asteroids_to_use = atoi( get_environment_ptr( "BC405_ASTEROIDS"));
-   if( !n_asteroids_to_use)
-      n_asteroids_to_use = bc405_n_asteroids;
-   if( !thresh)
-      thresh = 10.;                              /* Pallas extends 10 AU;  all others */
-   thresh *= integer_scale / sqrt( masses[1]);   /* scaled by sqrt of their masses    */
+   posns0 += (size_t)chunk * (size_t)( bc405_n_asteroids * 3);
+   posns1 = posns0 + bc405_n_asteroids * 3;
    for( i = 0; i < 3; i++)
       ixyz[i] = (int16_t)( integer_scale * xyz[i]);
-   for( i = 0; i < n_asteroids_to_use; i++)
+   if( cache->box_chunk != chunk
+               || cache->box_config_serial != config->serial)
       {
-      const int16_t *p0 = posns0 + i * 3;
-      const int16_t *p1 = posns1 + i * 3;
-      int j, possible_perturber = 1, fixed_perturber = 0;
-      const double dthresh = thresh * sqrt( masses[i]) + .1 * integer_scale;
-      const int16_t ithresh = (int16_t)( dthresh > 27000. ? 27000 : dthresh);
+      build_perturber_boxes( cache, config, posns0, posns1);
+      if( !config->n_fixed
+               && config->n_asteroids_to_use >= MIN_ASTEROIDS_FOR_GRID)
+         build_perturber_grid( cache, config->n_asteroids_to_use);
+      cache->box_chunk = chunk;
+      cache->box_config_serial = config->serial;
+      }
+   candidates = cache->candidates;
+   if( config->n_fixed)  /* fixed perturbers set;  only consider them */
+      {
+      n_candidates = 0;
+      for( i = 0; i < config->n_asteroids_to_use; i++)
+         if( IS_FIXED_PERTURBER( config, i))
+            candidates[n_candidates++] = i;
+      counters->perturber_candidates += config->n_asteroids_to_use;
+      }
+   else if( config->n_asteroids_to_use >= MIN_ASTEROIDS_FOR_GRID)
+      {
+      int n_tested;
 
-      for( j = 0; j < n_fixed; j++)
-         if( asteroid_numbers[i] == fixed_perturbers[j])
-            fixed_perturber = 1;
-      if( *p0 > *p1)
-         possible_perturber = (ixyz[0] + ithresh > *p1 && ixyz[0] - ithresh < *p0);
-      else
-         possible_perturber = (ixyz[0] + ithresh > *p0 && ixyz[0] - ithresh < *p1);
-      if( asteroid_numbers[i] == excluded_asteroid_number)
-         possible_perturber = fixed_perturber = 0;  /* don't let an asteroid perturb itself! */
+      n_candidates = find_grid_candidates( cache, ixyz, candidates, &n_tested);
+      counters->perturber_candidates += n_tested;
+      }
+   else
+      {
+      n_candidates = find_box_candidates( cache, config->n_asteroids_to_use,
+                                                ixyz, candidates);
+      counters->perturber_candidates += config->n_asteroids_to_use;
+      }
+   for( k = 0; k < n_candidates; k++)
+      {
+      const int i = candidates[k];
+      double asteroid_loc[4], dist2 = 0., delta[3], sun_dist2 = 0.;
+      double factor1, factor2;
+      int j;
 
-      if( possible_perturber || fixed_perturber)
+      if( asteroid_numbers[i] == excluded_asteroid_number)
+         continue;      /* don't let an asteroid perturb itself! */
+      counters->perturbers_used++;
+      planet_posn_ctx( ctx, PLANET_POSN_ASTEROID( i), jd, asteroid_loc);
+      for( j = 0; j < 3; j++)
          {
-         p0++;
-         p1++;
-         if( *p0 > *p1)
-            possible_perturber = (ixyz[1] + ithresh > *p1 && ixyz[1] - ithresh < *p0);
-         else
-            possible_perturber = (ixyz[1] + ithresh > *p0 && ixyz[1] - ithresh < *p1);
-         if( possible_perturber || fixed_perturber)
-            {
-            p0++;
-            p1++;
-            if( *p0 > *p1)
-               possible_perturber = (ixyz[2] + ithresh > *p1 && ixyz[2] - ithresh < *p0);
-            else
-               possible_perturber = (ixyz[2] + ithresh > *p0 && ixyz[2] - ithresh < *p1);
-            if( n_fixed)          /* fixed perturbers set;  only consider them */
-               possible_perturber = 0;
-            if( possible_perturber || fixed_perturber)
-               {
-               double asteroid_loc[4], dist2 = 0., delta[3], sun_dist2 = 0.;
-               double factor1, factor2;
-
-               planet_posn( i + 100, jd, asteroid_loc);
-               for( j = 0; j < 3; j++)
-                  {
-                  delta[j] = asteroid_loc[j] - xyz[j];
-                  sun_dist2 += asteroid_loc[j] * asteroid_loc[j];
-                  dist2 += delta[j] * delta[j];
-                  }
-               factor1 = SOLAR_GM * masses[i] / (sun_dist2 * sqrt( sun_dist2));
-               factor2 = SOLAR_GM * masses[i] / (dist2 * sqrt( dist2));
-               for( j = 0; j < 3; j++)
-                  {
-                  accel[j + 3] += factor2 * delta[j];
-                  accel[j + 3] -= factor1 * asteroid_loc[j];
-                  }
+         delta[j] = asteroid_loc[j] - xyz[j];
+         sun_dist2 += asteroid_loc[j] * asteroid_loc[j];
+         dist2 += delta[j] * delta[j];
+         }
+      factor1 = SOLAR_GM * masses[i] / (sun_dist2 * sqrt( sun_dist2));
+      factor2 = SOLAR_GM * masses[i] / (dist2 * sqrt( dist2));
+      for( j = 0; j < 3; j++)
+         {
+         accel[j + 3] += factor2 * delta[j];
+         accel[j + 3] -= factor1 * asteroid_loc[j];
+         }
 #ifdef DEBUGGING_CODE
-               if( dist2 < .05 * 0.05)
-                  {
-                  FILE *debug_file = fopen( "astpert.txt", "ab");
-
-                  fprintf( debug_file, "%.5f: %3d, %f: mass %g\n",
-                           JD_TO_YEAR( jd),
-                           asteroid_numbers[i], sqrt( dist2) * AU_IN_KM, masses[i]);
-                  fclose( debug_file);
-                  }
-#endif
-               }
-            }
+      if( dist2 < .05 * 0.05)
+         {
+         FILE *debug_file = fopen( "astpert.txt", "ab");
+
+         fprintf( debug_file, "%.5f: %3d, %f: mass %g\n",
+                  JD_TO_YEAR( jd),
+                  asteroid_numbers[i], sqrt( dist2) * AU_IN_KM, masses[i]);
+         fclose( debug_file);
          }
+#endif
       }
+   if( time_it)
+      counters->perturber_ns += nanoseconds_since_1970( ) - t_start;
    return( 0);
 }
 
@@ -597,10 +1561,11 @@ int main( const int argc, char **argv)
    const int asteroid_number = atoi( argv[1]);
    const double jd = atof( argv[2]);
    const int chunk_number = (int)( (jd - bc405_start_jd) / bc405_chunk_time + .5);
-   FILE *fp = open_bc405_file( false);
+   FILE *fp = open_bc405_file( &default_cache, false);
    ELEMENTS elems;
    double posn[4];
-   int16_t precomputed[bc405_n_asteroids * 3];
+   const int16_t *precomputed = get_precomputed_data( &default_cache)
+                  + (size_t)chunk_number * (size_t)( bc405_n_asteroids * 3);
 
    fseek( fp, (chunk_number * bc405_n_asteroids + asteroid_number)
                        * 6 * sizeof( double), SEEK_SET);
@@ -617,7 +1582,6 @@ int main( const int argc, char **argv)
    comet_posn( &elems, jd, posn);
 // ecliptic_to_equatorial( posn);
    printf( "x = %f; y = %f; z = %f\n", posn[0], posn[1], posn[2]);
-   find_and_set_precomputed_data( chunk_number, precomputed);
    printf( "Precomputed: %d %d %d\n",
             (int)precomputed[asteroid_number * 3 + 0],
             (int)precomputed[asteroid_number * 3 + 1],
@@ -625,11 +1589,11 @@ int main( const int argc, char **argv)
 
    if( argc == 6)
       {
-      int16_t prec2[bc405_n_asteroids * 3];
-      int16_t iposn[3], *pptr1 = precomputed, *pptr2 = prec2;
+      const int16_t *pptr1 = precomputed;
+      const int16_t *pptr2 = precomputed + bc405_n_asteroids * 3;
+      int16_t iposn[3];
       int n_found = 0, i;
 
-      find_and_set_precomputed_data( chunk_number + 1, prec2);
       for( i = 0; i < 3; i++)
          iposn[i] = (int16_t)atoi( argv[i + 3]);
       for( i = 0; i < bc405_n_asteroids; i++, pptr1 += 3, pptr2 += 3)
@@ -0,0 +1,138 @@
+/* bc405chb.cpp: makes Chebyshev asteroid perturber ephemeris from BC-405
+
+Copyright (C) 2026, Project Pluto
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+02110-1301, USA.    */
+
+/* Creates 'bc405chb.dat' in the Find_Orb configuration directory,  with
+Chebyshev polynomials fitted to the BC-405 asteroid positions (see
+'bc405.cpp' for details),  then compares positions and velocities from it
+to those computed from the BC-405 elements.  Run as
+
+bc405chb [-n (number of coefficients)] [-y (start year) (end year)]
+         [-s (samples per asteroid)] [-t]
+
+   By default,  eight coefficients are used and the full BC-405 time span
+is covered.  '-t' skips making the file,  and just tests an existing one.
+After making the file,  Find_Orb will use it automatically;  delete it to
+go back to solving Kepler's equation.     */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include "watdefs.h"
+#include "stringex.h"
+#include "comets.h"
+#include "mpc_obs.h"
+
+int debug_level = 0;
+
+int inquire( const char *prompt, char *buff, const int max_len,
+                     const int color);                /* bc405chb.cpp */
+void refresh_console( void);                          /* bc405chb.cpp */
+void move_add_nstr( const int col, const int row, const char *msg,
+                     const int n_bytes);              /* bc405chb.cpp */
+void ensure_config_directory_exists(); /* miscell.c */
+int get_defaults( ephem_option_t *ephemeris_output_options, int *element_format,
+         int *element_precision, double *max_residual_for_filtering,
+         double *noise_in_arcseconds);                /* elem_out.cpp */
+int create_bc405_chebyshev_file( const int n_coeffs, const double jd_start,
+                  const double jd_end);               /* bc405.cpp */
+int bc405_chebyshev_report( FILE *ofile, const int n_samples); /* bc405.cpp */
+
+int inquire( const char *prompt, char *buff, const int max_len,
+                     const int color)
+{
+   INTENTIONALLY_UNUSED_PARAMETER( buff);
+   INTENTIONALLY_UNUSED_PARAMETER( max_len);
+   INTENTIONALLY_UNUSED_PARAMETER( color);
+   printf( "\n%s\n", prompt);
+   return( 0);
+}
+
+void refresh_console( void)
+{
+}
+
+void move_add_nstr( const int col, const int row, const char *msg, const int n_bytes)
+{
+   INTENTIONALLY_UNUSED_PARAMETER( col);
+   INTENTIONALLY_UNUSED_PARAMETER( row);
+   INTENTIONALLY_UNUSED_PARAMETER( msg);
+   INTENTIONALLY_UNUSED_PARAMETER( n_bytes);
+}
+
+#define YEAR_TO_JD( year) (2451545.0 + ((year) - 2000.) * 365.25)
+
+int main( const int argc, const char **argv)
+{
+   int i, n_coeffs = 8, n_samples = 100, rval;
+   double jd_start = 0., jd_end = 0.;
+   bool test_only = false;
+   extern int use_config_directory;          /* miscell.c */
+
+   for( i = 1; i < argc; i++)
+      if( argv[i][0] == '-')
+         switch( argv[i][1])
+            {
+            case 'n':
+               n_coeffs = atoi( argv[i][2] || i == argc - 1 ? argv[i] + 2 : argv[++i]);
+               break;
+            case 's':
+               n_samples = atoi( argv[i][2] || i == argc - 1 ? argv[i] + 2 : argv[++i]);
+               break;
+            case 't':
+               test_only = true;
+               break;
+            case 'y':
+               if( i + 2 < argc)
+                  {
+                  jd_start = YEAR_TO_JD( atof( argv[i + 1]));
+                  jd_end = YEAR_TO_JD( atof( argv[i + 2]));
+                  i += 2;
+                  }
+               break;
+            default:
+               fprintf( stderr, "Option '%s' unrecognized\n", argv[i]);
+               return( -1);
+            }
+   if( n_coeffs < 2 || n_coeffs > 30)
+      {
+      fprintf( stderr, "Number of coefficients must be 2 to 30\n");
+      return( -1);
+      }
+   use_config_directory = true;
+   ensure_config_directory_exists();
+   get_defaults( NULL, NULL, NULL, NULL, NULL);
+   if( !test_only)
+      {
+      rval = create_bc405_chebyshev_file( n_coeffs, jd_start, jd_end);
+      if( rval < 0)
+         {
+         fprintf( stderr, "Couldn't make Chebyshev file: error %d\n", rval);
+         return( rval);
+         }
+      printf( "%d 40-day chunks written\n", rval);
+      }
+   if( bc405_chebyshev_report( stdout, n_samples))
+      {
+      fprintf( stderr, "No usable 'bc405chb.dat' found\n");
+      return( -2);
+      }
+   return( 0);
+}
@@ -140,6 +140,13 @@ char default_comet_magnitude_type = 'N';
 const char *mpc_fmt_filename = "mpc_fmt.txt";
 const char *sof_filename = "sof.txt";
 const char *sofv_filename = "sofv.txt";
+
+/* When 'fo' runs several processes,  it needs to know where each object's
+output ends in the element,  MPC-format,  SOF,  and SOFV files (see
+'record_object_done()' in fo.cpp).  We note each file's length right
+after writing to it,  in that order,  so it needn't reopen them.  */
+
+long output_file_end[4];
 int force_model = 0;
 extern int forced_central_body;
 int get_planet_posn_vel( const double jd, const int planet_no,
@@ -1459,6 +1466,10 @@ static int add_sof_to_file( const char *filename,
          }
       rval = put_elements_into_sof( obuff, templat, elem, nongravs, n_obs, obs);
       fwrite( obuff, strlen( obuff), 1, fp);
+      if( filename == sof_filename)
+         output_file_end[2] = ftell( fp);
+      if( filename == sofv_filename)
+         output_file_end[3] = ftell( fp);
       fclose( fp);
       }
    return( rval);
@@ -1891,6 +1902,8 @@ int write_out_elements_to_file( const double *orbit,
       fprintf( ofile, "%s\nNo elements available\n", object_name);
       observation_summary_data( buff, obs, n_obs, options);
       fprintf( ofile, "%s\n", buff);
+      if( *elements_filename != 's')     /* i.e.,  not 'sr_elems.txt' */
+         output_file_end[0] = ftell( ofile);
       fclose( ofile);
       return( -1);
       }
@@ -2573,6 +2586,8 @@ int write_out_elements_to_file( const double *orbit,
       if( nongrav_sigmas_found)
          fprintf( ofile, "\n");
       }
+   if( *elements_filename != 's')     /* i.e.,  not 'sr_elems.txt' */
+      output_file_end[0] = ftell( ofile);
    fclose( ofile);
          /* If the eccentricity is greater than about 1.2 for an heliocentric
             orbit,  and it's not marked as an interstellar object either by
@@ -2594,6 +2609,8 @@ int write_out_elements_to_file( const double *orbit,
       elements_in_mpcorb_format( tbuff, obs->packed_id, object_name,
                               &helio_elem, obs, n_obs);
       fprintf( ofile, "%s\n", tbuff);
+      if( output_filename == mpc_fmt_filename)
+         output_file_end[1] = ftell( ofile);
       fclose( ofile);
       }
 
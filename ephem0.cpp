@@ -447,6 +447,7 @@ static void setup_obj_loc( obj_location_t *p, double *orbit,
    planet_no = get_observer_data( mpc_code, NULL, &cinfo);
    compute_observer_loc( p->jd, planet_no, cinfo.rho_cos_phi, cinfo.rho_sin_phi,
                                     cinfo.lon, obs_posn);
+   integrate_orbits( orbit, (int)n_orbits, epoch_jd, p->jd);
    for( i = 0; i < n_orbits; i++)
       {
       double topo[3], time_lag;
@@ -455,7 +456,6 @@ static void setup_obj_loc( obj_location_t *p, double *orbit,
          p[i].r = 0.;
       assert( p[i].r >= 0.);
       assert( p[i].r < 100.);
-      integrate_orbit( orbit, epoch_jd, p->jd);
       time_lag = p[i].r / AU_PER_DAY;
       for( j = 0; j < 3; j++)
          topo[j] = orbit[j] - obs_posn[j] - time_lag * orbit[j + 3];
@@ -465,7 +465,7 @@ static void setup_obj_loc( obj_location_t *p, double *orbit,
       p[i].dec = asin( topo[2] / p[i].r);
       p[i].sun_earth = vector3_length( obs_posn);
       p[i].sun_obj = vector3_length( orbit);
-      orbit += 6;
+      orbit += n_orbit_params;
       }
 }
 
@@ -2133,6 +2133,7 @@ static int _ephemeris_in_a_file( const char *filename, const double *orbit,
    char step_units;
    const char *timescale = get_environment_ptr( "TT_EPHEMERIS");
    const char *override_date_format = get_environment_ptr( "DATE_FORMAT");
+   const environment_snapshot_t *settings = get_environment_snapshot( );
    double abs_mag = calc_absolute_magnitude( obs, n_obs);
    double max_auto_step = 0.;
    bool last_line_shown = true;
@@ -2481,6 +2482,7 @@ static int _ephemeris_in_a_file( const char *filename, const double *orbit,
       compute_observer_loc( ephemeris_t, cinfo->planet, 0., 0., 0., geo_posn);
       compute_observer_vel( ephemeris_t, cinfo->planet, 0., 0., 0., geo_vel);
       strlcpy_error( buff, "Nothing to see here... move along... uninteresting... who cares?...");
+      integrate_orbits( orbits_at_epoch, n_objects, prev_ephem_t, ephemeris_t);
       for( obj_n = 0; obj_n < n_objects; obj_n++)
          {
          double *orbi = orbits_at_epoch + obj_n * n_orbit_params;
@@ -2493,7 +2495,6 @@ static int _ephemeris_in_a_file( const char *filename, const double *orbit,
          const char *sigma_delta_placeholder = "!sigma_delta!";
          const char *sigma_rvel_placeholder = "!sigma_rv!";
 
-         integrate_orbit( orbi, prev_ephem_t, ephemeris_t);
          for( j = 0; j < 3; j++)
             geo[j] = orbi[j] - geo_posn[j];
          if( !obj_n)
@@ -2521,7 +2522,7 @@ static int _ephemeris_in_a_file( const char *filename, const double *orbit,
             {
             extern int use_light_bending;           /* ephem0.cpp */
 
-            if( *get_environment_ptr( "DISABLE_LIGHT_BENDING") && !fake_astrometry)
+            if( settings->disable_light_bending && !fake_astrometry)
                use_light_bending = 0;
             light_time_lag( ephemeris_t, orbi, obs_posn, orbi_after_light_lag, 0);
             use_light_bending = 1;
@@ -2684,8 +2685,7 @@ static int _ephemeris_in_a_file( const char *filename, const double *orbit,
                {
                double dist, posn_ang;
                int int_pa;
-               const double sigma_multiplier =
-                     atof( get_environment_ptr( "SIGMA_MULTIPLIER"));
+               const double sigma_multiplier = settings->sigma_multiplier;
 
                if( n_objects == 2)
                   calc_dist_and_posn_ang( (const double *)&stored_ra_decs[0],
@@ -2833,7 +2833,7 @@ static int _ephemeris_in_a_file( const char *filename, const double *orbit,
                         earth_lunar_posn( ephemeris_t, earth_loc, vect);
                         lunar_eclipse_mag = lunar_eclipse_magnitude( earth_loc, vect);
                         if( lunar_eclipse_mag > -0.75 &&
-                                       !*get_environment_ptr( "NO_LUNAR_ECLIPSES"))
+                                       !settings->no_lunar_eclipses)
                            {
                            if( lunar_eclipse_mag < 0.25)
                               {
@@ -2949,7 +2949,7 @@ static int _ephemeris_in_a_file( const char *filename, const double *orbit,
                   double light_pollution_mags_per_arcsec_squared =
                                 exposure_config.sky_brightness_at_zenith;
                   double galactic_confusion_addendum =
-                           atof( get_environment_ptr( "GALACTIC_ADDENDUM"));
+                           settings->galactic_addendum;
 
                   bdata.latitude = cinfo->lat;
                   bdata.zenith_angle    = PI / 2. - alt_az[0].y;
@@ -3156,7 +3156,7 @@ static int _ephemeris_in_a_file( const char *filename, const double *orbit,
                      }
                   else
                      {
-                     const double exp_time = atof( get_environment_ptr( "EXPTIME"));
+                     const double exp_time = settings->exposure_time;
                      const double snr = snr_from_mag_and_exposure( &exposure_config,
                                     curr_mag, (exp_time ? exp_time : 30.));
                      const char *fmt = (snr > 99. ? " %5.0f" : " %5.2f");
@@ -3169,7 +3169,7 @@ static int _ephemeris_in_a_file( const char *filename, const double *orbit,
 
                if( options & OPTION_EXPOSURE_TIME)
                   {
-                  const double target_snr = atof( get_environment_ptr( "SNR"));
+                  const double target_snr = settings->target_snr;
                   double exposure_time;
 
                   if( exposure_config.airmass > 1e+9)
@@ -3480,7 +3480,7 @@ static int _ephemeris_in_a_file( const char *filename, const double *orbit,
                   const double meters_per_km = 1000.;
 
                   alt_in_meters = find_lat_lon_alt( utc, geo, cinfo->planet, lat_lon,
-                           *get_environment_ptr( "GEOMETRIC_GROUND_TRACK") == '1');
+                           settings->geometric_ground_track);
                   snprintf( tbuff, 30, "%9.4f %+08.4f %10.3f",
                         lat_lon[0] * 180. / PI,
                         lat_lon[1] * 180. / PI,
@@ -6349,10 +6349,11 @@ int main( int argc, const char **argv)
          case ALT_Z:
             {
             extern int integration_method;
+            const char *method_names[3] = { "Using RKF", "Using PD89",
+                                            "Using Gauss-Radau" };
 
-            integration_method ^= 1;
-            strlcpy_error( message_to_user, integration_method ?
-                           "Using PD89" : "Using RKF");
+            integration_method = (integration_method + 1) % 3;
+            strlcpy_error( message_to_user, method_names[integration_method]);
             }
             break;
          case ALT_X:
@@ -20,10 +20,14 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
 /* Under *nix,  this program can distribute the work of determining
 orbits among multiple processes.  If there are N objects for which
 orbits need to be determined and Np processes (Np can be specified
-on the command line),  each process gets N/Np objects to determine.
-At the end,  the "original" process merges the results.  But at least
-at present,  this only works on *nix systems... FORKING is undefined
-for Windows and other non-*nix systems. */
+on the command line),  each process takes the next not-yet-claimed
+object from a shared counter until they're all done.  (Objects used
+to be split up ahead of time,  one in every Np going to each process;
+one slow object would then hold up everything else in its 'stripe'.)
+At the end,  the "original" process merges the results,  in the order
+the objects appeared in the input.  But at least at present,  this
+only works on *nix systems... FORKING is undefined for Windows and
+other non-*nix systems. */
 
 #if defined( __linux) || defined( __unix__) || defined( __APPLE__)
 #define FORKING
@@ -35,6 +39,7 @@ for Windows and other non-*nix systems. */
    #include <errno.h>      /* Errors */
    #include <stdio.h>      /* Input/Output */
    #include <sys/wait.h>   /* Wait for Process Termination  */
+   #include <sys/mman.h>   /* shared memory for the work queue */
             /* above basically allows for forking so we can */
             /* run different objects on different cores     */
    #include <sys/time.h>         /* these allow resource limiting */
@@ -45,6 +50,7 @@ for Windows and other non-*nix systems. */
 #endif
 #include <math.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -58,6 +64,7 @@ for Windows and other non-*nix systems. */
 #include "date.h"
 #include "monte0.h"
 #include "stringex.h"
+#include "integrat.h"
 
 extern int debug_level;
 
@@ -101,6 +108,8 @@ uint64_t parse_bit_string( const char *istr);                /* miscell.cpp */
 char *real_packed_desig( char *obuff, const char *packed_id);     /* ephem0.cpp */
 FILE *open_json_file( char *filename, const char *env_ptr, const char *default_name,
                   const char *packed_desig, const char *permits); /* ephem0.cpp */
+int64_t nanoseconds_since_1970( void);                      /* nanosecs.c */
+int load_bc405_precomputed_data( void);                     /* bc405.cpp */
 
 /* In this non-interactive version of Find_Orb,  we just print out warning
 messages such as "3 observations were made in daylight" or "couldn't find
@@ -185,6 +194,151 @@ static int unlink_config_file( const char *filename)
 #endif
    return( err_code);
 }
+#endif
+
+/* The processes share a 'work queue' in memory mapped before forking.
+Each process claims the next unclaimed object by atomically incrementing
+'next_object'.  When it's done with that object,  it records which
+process it was (so we know whose output files hold that object's
+results) and how long each of those output files then is,  as noted by
+elem_out.cpp when it wrote them (so we know where that object's results
+end).       */
+
+#define N_MERGED_FILES 4
+
+typedef struct
+{
+   int process;            /* process that handled the object */
+   long end_offset[N_MERGED_FILES];
+} object_result_t;
+
+typedef struct
+{
+   int next_object, n_done;
+   object_result_t results[1];      /* actually,  one per object */
+} work_queue_t;
+
+static const char *merged_filename( const int idx)
+{
+   extern const char *elements_filename;
+   extern const char *mpc_fmt_filename;
+   const char *filenames[N_MERGED_FILES] = { elements_filename,
+                  mpc_fmt_filename, sof_filename, sofv_filename };
+
+   return( filenames[idx]);
+}
+
+static void record_object_done( work_queue_t *queue, const int idx)
+{
+   extern int process_count;
+   extern long output_file_end[N_MERGED_FILES];    /* elem_out.cpp */
+   object_result_t *result = queue->results + idx;
+
+   memcpy( result->end_offset, output_file_end, sizeof( output_file_end));
+   result->process = process_count;
+#ifdef FORKING
+   __atomic_add_fetch( &queue->n_done, 1, __ATOMIC_SEQ_CST);
+#else
+   queue->n_done++;
+#endif
+}
+
+/* Returns the index of the next object to process,  or n_objects if
+there are none left.  If 'order' is non-NULL,  objects are handed out
+in that order instead of the order they appear in the input.  */
+
+static int claim_next_object( int *next_object, const int *order,
+                              const int n_objects)
+{
+#ifdef FORKING
+   int rval = __atomic_fetch_add( next_object, 1, __ATOMIC_SEQ_CST);
+#else
+   int rval = (*next_object)++;
+#endif
+
+   if( rval > n_objects)
+      rval = n_objects;
+   if( order && rval < n_objects)
+      rval = order[rval];
+   return( rval);
+}
+
+/* With several processes working through a list of objects,  the run
+isn't done until the last (slowest) object is done.  If a long-arc comet
+happened to be near the end of the input,  everybody else could be done
+while one process grinds away on it.  So we hand out the objects that
+are probably most expensive first,  and let the many quick ones fill in
+the gaps at the end.
+
+   The cost estimate is crude.  Fitting time roughly scales with the
+number of observations times the number of integration steps,  and the
+latter grows (slowly) with the length of the arc.  Objects without a
+stored solution in 'orbits.sof' need an initial orbit determination,
+which usually takes longer than refining an existing orbit.  */
+
+void shellsort_r( void *base, const size_t n_elements, const size_t elem_size,
+         int (*compare)(const void *, const void *, void *), void *context);
+
+static double estimated_cost( const OBJECT_INFO *id)
+{
+   const double arc_length = id->jd_end - id->jd_start;
+   double rval = (double)id->n_obs * (1. + log( 1. + arc_length));
+
+   if( !id->solution_exists)
+      rval *= 2.;
+   return( rval);
+}
+
+static int compare_costs( const void *a, const void *b, void *context)
+{
+   const double *costs = (const double *)context;
+   const int idx1 = *(const int *)a, idx2 = *(const int *)b;
+
+   if( costs[idx1] != costs[idx2])
+      return( costs[idx1] > costs[idx2] ? -1 : 1);
+   return( idx1 - idx2);
+}
+
+static int *cost_ordered_objects( OBJECT_INFO *ids, const int n_ids)
+{
+   int *rval = (int *)malloc( n_ids * sizeof( int));
+   double *costs = (double *)malloc( n_ids * sizeof( double));
+   int i;
+
+   assert( rval && costs);
+   set_solutions_found( ids, n_ids);
+   for( i = 0; i < n_ids; i++)
+      {
+      rval[i] = i;
+      costs[i] = estimated_cost( ids + i);
+      }
+   shellsort_r( rval, n_ids, sizeof( int), compare_costs, costs);
+   free( costs);
+   return( rval);
+}
+
+#ifdef FORKING
+static work_queue_t *alloc_work_queue( const int n_objects)
+{
+   const size_t size = sizeof( work_queue_t)
+                         + n_objects * sizeof( object_result_t);
+   void *rval = mmap( NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+   if( rval == MAP_FAILED)
+      {
+      perror( "mmap");
+      return( NULL);
+      }
+   memset( rval, 0, size);
+   return( (work_queue_t *)rval);
+}
+
+static void free_work_queue( work_queue_t *queue, const int n_objects)
+{
+   munmap( queue, sizeof( work_queue_t)
+                         + n_objects * sizeof( object_result_t));
+}
 
 static bool unlink_partial_files = true;
 
@@ -192,25 +346,28 @@ static bool unlink_partial_files = true;
 slightly complicated by the fact that we have three different types of
 orbital element files.
 
-The MPCORB ones are simplest;  there's no header data.  We just take a
-line from file 0,  then file 1,  then file 2, ... file n_processes-1,
-and repeat,  writing them out as we go,  doing a multi-way merge.
+The MPCORB ones are simplest;  there's no header data.  For each object
+in turn,  we look up which process handled it and copy that process's
+output up to where the object's output ended.
 
-.sof files are almost as easy,  except that there's a single header line.
-So we skip the first n_processes - 1 lines read in,  because they're all
-header lines.  Then we get a header line (and write it);  then we start
-reading in actual orbital element lines and write them.
+.sof files are almost as easy,  except that there's a single header line
+in each file.  We write out the first one we find and skip the rest.
 
 'elements.txt' files,  signified with skip_over == -1,  mean that for each
-file,  we keep reading in lines until we hit the '# Sigmas avail" one.
-We don't really care about that or anything after it.       */
+object,  we copy lines until we hit the '# Sigmas avail" one.  We don't
+really care about that or anything after it (up to the end of that
+object's output).     */
 
-static void _merge_element_files( const char *filename, const int n_processes,
-                  const int skip_over)
+static void _merge_element_files( const int file_idx, const int n_processes,
+                  const int skip_over, const work_queue_t *queue,
+                  const int n_objects)
 {
+   const char *filename = merged_filename( file_idx);
    FILE **input_files = (FILE **)calloc( (size_t)n_processes, sizeof( FILE *));
+   long *offsets = (long *)calloc( (size_t)n_processes, sizeof( long));
    char buff[400];
-   int i, quit;
+   int i;
+   bool header_written = false;
    FILE *ofile;
    extern int process_count;
 
@@ -219,43 +376,59 @@ static void _merge_element_files( const char *filename, const int n_processes,
    for( i = 0; i < n_processes; i++)
       {
       process_count = i + 1;
-      input_files[i] = fopen_ext( get_file_name( buff, filename), "tfclr");
+      input_files[i] = fopen_ext( get_file_name( buff, filename), "tclr");
+      if( input_files[i] && skip_over > 0)      /* skip .sof header line */
+         if( fgets( buff, sizeof( buff), input_files[i]) && !header_written)
+            {
+            fputs( buff, ofile);
+            header_written = true;
+            }
+      if( input_files[i])
+         offsets[i] = ftell( input_files[i]);
       }
-   for( i = quit = 0; !quit; i++)
+   for( i = 0; i < n_objects; i++)
       {
-      if( !fgets( buff, sizeof( buff), input_files[i % n_processes]))
-         quit = 1;
-      else if( skip_over == -1)           /* 'elements.txt' format */
+      const int proc = queue->results[i].process - 1;
+      const long end_offset = queue->results[i].end_offset[file_idx];
+      FILE *ifile = (proc >= 0 ? input_files[proc] : NULL);
+      bool skipping = false;
+
+      while( ifile && offsets[proc] < end_offset
+                        && fgets( buff, sizeof( buff), ifile))
          {
-         fputs( buff, ofile);
-         while( fgets( buff, sizeof( buff), input_files[i % n_processes]) &&
-                     memcmp( buff, "# Sigmas avail", 14))
+         offsets[proc] = ftell( ifile);
+         if( skip_over == -1 && !memcmp( buff, "# Sigmas avail", 14))
+            skipping = true;
+         if( !skipping)
             fputs( buff, ofile);
          }
-      else if( i >= skip_over)
-         fputs( buff, ofile);
       }
    for( i = 0; i < n_processes; i++)
-      {
-      int err_code;
-
-      fclose( input_files[i]);
-      process_count = i + 1;
-      if( unlink_partial_files)
+      if( input_files[i])
          {
-         err_code = unlink_config_file( filename);
-         if( err_code)
-            perror( buff);
-         assert( !err_code);
+         int err_code;
+
+         fclose( input_files[i]);
+         process_count = i + 1;
+         if( unlink_partial_files)
+            {
+            err_code = unlink_config_file( filename);
+            if( err_code)
+               perror( buff);
+            assert( !err_code);
+            }
          }
-      }
    free( input_files);
+   free( offsets);
    fclose( ofile);
 }
 #endif
 
 void compute_variant_orbit( double *variant, const double *ref_orbit,
                      const double n_sigmas);       /* orb_func.cpp */
+int benchmark_integrators( FILE *ofile, const char *obj_name,
+            const double *orbit, const double epoch,
+            const OBSERVE *obs, const int n_obs);  /* orb_func.cpp */
 
 static void extract_value( char *obuff, const char *ibuff,
                         const unsigned n_digits)
@@ -475,14 +648,17 @@ int main( int argc, const char **argv)
    char **summary_lines = NULL;
    const char *separate_residual_file_name = NULL;
    const char *mpec_path = NULL;
-   int n_ids, i, starting_object = 0;
+   int n_ids, i, starting_object = 0, next_object = 0;
+   int *dispatch_order = NULL;
    int n_processes = 1;
+   work_queue_t *queue = NULL;
    OBJECT_INFO *ids;
    int total_objects = 0;
    FILE *ifile;
    extern int process_count;
    int n_lines_written = 0;
    FILE *summary_ofile = NULL;
+   FILE *benchmark_file = NULL;
    extern int forced_central_body;
    int override_forced_central_body = 0;     /* by default,  all orbits are heliocentric */
    extern int use_config_directory;          /* miscell.c */
@@ -528,6 +704,14 @@ int main( int argc, const char **argv)
             case 'b':
                separate_residual_file_name = arg;
                break;
+            case 'B':
+               benchmark_file = fopen( arg, "wb");
+               if( !benchmark_file)
+                  {
+                  fprintf( stderr, "Couldn't open benchmark file '%s'\n", arg);
+                  return( -1);
+                  }
+               break;
             case 'c':
                {
                extern const char *combine_all_observations;
@@ -812,7 +996,19 @@ int main( int argc, const char **argv)
 
    create_combined_json_header( ids, total_objects, "total.json");
    t0 = update_time = time( NULL);
+   if( total_objects > n_ids - starting_object)
+      total_objects = n_ids - starting_object;
 #ifdef FORKING
+   if( n_processes > 1)
+      {
+      queue = alloc_work_queue( total_objects);
+      if( queue)
+         dispatch_order = cost_ordered_objects( ids + starting_object,
+                                                total_objects);
+      else
+         n_processes = 1;
+      load_bc405_precomputed_data( );     /* build/map it once,  for all */
+      }
    while( process_count < n_processes - 1)
       {
       const pid_t childpid = fork( );
@@ -841,10 +1037,13 @@ int main( int argc, const char **argv)
       summary_lines = (char **)calloc( n_ids - starting_object + 1,
                                                     sizeof( char *));
    ifile = fopen( argv[1], "rb");
-   if( total_objects > n_ids - starting_object)
-      total_objects = n_ids - starting_object;
-   for( i = starting_object; i < starting_object + total_objects; i++)
-      if( n_processes == 1 || i % n_processes == process_count - 1)
+   for( ;;)
+      if( (i = starting_object + claim_next_object(
+                      (queue ? &queue->next_object : &next_object),
+                      dispatch_order, total_objects))
+                      >= starting_object + total_objects)
+         break;
+      else
          {
          const char *orbit_constraints = "";
          OBSERVE FAR *obs;
@@ -863,6 +1062,11 @@ int main( int argc, const char **argv)
             int element_options = ELEM_OUT_ALTERNATIVE_FORMAT;
             double epoch_shown, curr_epoch, orbit[2 * MAX_N_PARAMS];
             bool have_json_ephem = false;
+            const INTEGRATION_COUNTERS counters0 =
+                                       *default_integration_counters( );
+            const int64_t t_object = nanoseconds_since_1970( );
+            INTEGRATION_COUNTERS counters;
+            FILE *counters_file;
 
                 /* Start a bit ahead of the actual data,  just in case */
                 /* there's a #Sigma: or similar command in there: */
@@ -900,7 +1104,7 @@ int main( int argc, const char **argv)
                      {
                      if( process_count == 1 && time( NULL) != update_time)
                         {
-                        int elapsed, n_done = i - starting_object + 1;
+                        int elapsed, n_done = queue->n_done + 1;
 
                         update_time = time( NULL);
                         elapsed = (int)update_time - (int)t0;
@@ -1064,6 +1268,22 @@ int main( int argc, const char **argv)
             if( ephemeris_output_options & OPTION_COMPUTER_FRIENDLY)
                if( mpec_path || !is_default_ephem)
                   have_json_ephem = true;
+            counters = *default_integration_counters( );
+            add_integration_counters( &counters, &counters0, -1);
+            counters_file = open_json_file( tbuff, "JSON_COUNTERS_NAME",
+                             "counters.json", obs->packed_id, "wb");
+            if( counters_file)
+               {
+               write_integration_counters_json( counters_file, &counters,
+                     (double)( nanoseconds_since_1970( ) - t_object) * 1e-9);
+               fclose( counters_file);
+               }
+            if( benchmark_file && curr_epoch > 0. && n_obs_actually_loaded > 1)
+               {
+               benchmark_integrators( benchmark_file, ids[i].obj_name, orbit,
+                              curr_epoch, obs, n_obs_actually_loaded);
+               fflush( benchmark_file);
+               }
             if( n_processes == 1)
                add_json_data( "total.json", have_json_ephem, obs->packed_id,
                      i == starting_object + total_objects - 1);
@@ -1075,9 +1295,13 @@ int main( int argc, const char **argv)
                                          (use_colors ? VT_CSI "0m" : ""));
          if( show_processing_steps)
             printf( "  %s\n", tbuff);
+         if( queue)
+            record_object_done( queue, i - starting_object);
          }
    free( ids);
    free( mpc_codes);
+   if( dispatch_order)
+      free( dispatch_order);
    if( summary_ofile)
       {
       int pass;
@@ -1114,6 +1338,8 @@ int main( int argc, const char **argv)
       fprintf( summary_ofile, "</body> </html>\n");
       fclose( summary_ofile);
       }
+   if( benchmark_file)
+      fclose( benchmark_file);
    fclose( ifile);
 #ifdef FORKING
    if( show_processing_steps)
@@ -1121,13 +1347,10 @@ int main( int argc, const char **argv)
    wait( &child_status); /* wait for child to exit, and store its status */
    if( process_count == 1)
       {
-      extern const char *elements_filename;
-      extern const char *mpc_fmt_filename;
-
-      _merge_element_files( elements_filename, n_processes, - 1);
-      _merge_element_files( mpc_fmt_filename, n_processes, 0);
-      _merge_element_files( sof_filename, n_processes, n_processes - 1);
-      _merge_element_files( sofv_filename, n_processes, n_processes - 1);
+      _merge_element_files( 0, n_processes, -1, queue, total_objects);
+      _merge_element_files( 1, n_processes, 0, queue, total_objects);
+      _merge_element_files( 2, n_processes, 1, queue, total_objects);
+      _merge_element_files( 3, n_processes, 1, queue, total_objects);
       for( i = 0; i < n_processes; i++)
          {                             /* clean up temp files: */
          process_count = i + 1;
@@ -1139,19 +1362,8 @@ int main( int argc, const char **argv)
 //       unlink_config_file( sof_filename);
          }
       }
-#ifdef TEST_PLANET_CACHING_HASH_FUNCTION
-   if( process_count == 0)
-      {
-      extern int64_t planet_ns;
-      extern long total_n_searches, total_n_probes, max_probes_required;
-
-      printf( "  tp:%ld.%09ld\n",
-                  (long)( planet_ns / (int64_t)1000000000),
-                  (long)( planet_ns % (int64_t)1000000000));
-      printf( "%ld searches; %ld probes; %ld max probes\n",
-                  total_n_searches, total_n_probes, max_probes_required);
-      }
-#endif
+   if( queue)
+      free_work_queue( queue, total_objects);
 #endif
    clean_up_find_orb_memory( );
    return( 0);
@@ -19,6 +19,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
 
 #include <math.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -33,6 +34,19 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
 #include "date.h"
 #include "monte0.h"
 #include "cgi_func.h"
+#include "integrat.h"
+#ifndef _WIN32
+   #include <unistd.h>
+   #include <errno.h>
+   #include <sys/types.h>
+   #include <sys/socket.h>
+   #include <sys/un.h>
+   #include <sys/wait.h>
+   #include <sys/stat.h>
+   #include <dirent.h>
+   #include <utime.h>
+   #include <signal.h>
+#endif
 
 extern int debug_level;
 
@@ -44,6 +58,8 @@ const char *get_environment_ptr( const char *env_ptr);     /* mpc_obs.cpp */
 void set_environment_ptr( const char *env_ptr, const char *new_value);
 char *get_file_name( char *filename, const char *template_file_name);
 int sanity_test_observations( const char *filename);
+uint64_t fnv1a_hash( uint64_t hash, const char *buff,
+                                   size_t n_bytes);         /* mpc_obs.cpp */
 int debug_printf( const char *format, ...)                 /* mpc_obs.cpp */
 #ifdef __GNUC__
          __attribute__ (( format( printf, 1, 2)))
@@ -61,6 +77,18 @@ int inquire( const char *prompt, char *buff, const int max_len,
 void refresh_console( void);                    /* fo_serve.cpp */
 void move_add_nstr( const int col, const int row, const char *msg,
                      const int n_bytes);        /* fo_serve.cpp */
+FILE *fopen_ext( const char *filename, const char *permits);   /* miscell.cpp */
+FILE *open_json_file( char *filename, const char *env_ptr, const char *default_name,
+                  const char *packed_desig, const char *permits); /* ephem0.cpp */
+int64_t nanoseconds_since_1970( void);                      /* nanosecs.c */
+int load_bc405_precomputed_data( void);                     /* bc405.cpp */
+int reset_astrometry_filename( int *argc, const char **argv);
+#ifndef _WIN32
+int get_temp_dir( char *name, const size_t max_len);      /* miscell.cpp */
+#endif
+int get_jpl_ephemeris_info( int *de_version, double *jd_start, double *jd_end);
+void shellsort_r( void *base, const size_t n_elements, const size_t elem_size,
+         int (*compare)(const void *, const void *, void *), void *context);
 
 /* In the server flavor of Find_Orb,  warning messages such as "3
 observations were made in daylight" or "couldn't find thus-and-such file"
@@ -131,11 +159,217 @@ static void show_problem_message( void)
       }
 }
 
+/* People often submit the same astrometry,  with the same options,  over
+and over.  If FO_SERVE_CACHE_DIR is set in 'environ.dat',  the pseudo-MPEC
+and JSON files made for each request are saved in that directory,  named
+by a hash of the (slightly normalized) astrometry and of every option that
+can affect the output.  If the same request comes in again,  we just send
+back the saved file.
+
+   The cache is kept below FO_SERVE_CACHE_MBYTES by removing the least
+recently used files.  The 'stamp.txt' file in the cache directory records
+the JPL ephemeris version and the sizes and times of the ephemeris and
+bias files.  If any of those change,  the cache is emptied.
+
+   The hash is 64-bit FNV-1a.  Observation lines have trailing spaces and
+CRs removed and blank lines skipped,  so that trivially different copies
+of the same astrometry are recognized as the same.  */
+
+#ifndef _WIN32
+static uint64_t hash_astrometry_file( uint64_t hash, const char *filename)
+{
+   FILE *ifile = fopen( filename, "rb");
+   char buff[1000];
+
+   if( ifile)
+      {
+      while( fgets( buff, sizeof( buff), ifile))
+         {
+         size_t len = strlen( buff);
+
+         while( len && isspace( buff[len - 1]))
+            len--;
+         if( len)
+            {
+            hash = fnv1a_hash( hash, buff, len);
+            hash = fnv1a_hash( hash, "\n", 1);
+            }
+         }
+      fclose( ifile);
+      }
+   return( hash);
+}
+
+static void get_cache_stamp( char *stamp, const size_t max_len)
+{
+   extern const char *fcct14_bias_file_name;
+   const char *filenames[] = { "jpl_eph.txt", "bias.dat", "biases.bin",
+            get_environment_ptr( "LINUX_JPL_FILENAME"),
+            fcct14_bias_file_name, NULL };
+   int de_version, i;
+   double jd_start, jd_end;
+
+   get_jpl_ephemeris_info( &de_version, &jd_start, &jd_end);
+   snprintf_err( stamp, max_len, "DE%d %.1f %.1f",
+                              de_version, jd_start, jd_end);
+   for( i = 0; filenames[i]; i++)
+      {
+      struct stat st;
+
+      if( *filenames[i] && !stat( filenames[i], &st))
+         snprintf_append( stamp, max_len, " %ld:%ld",
+                              (long)st.st_size, (long)st.st_mtime);
+      else
+         snprintf_append( stamp, max_len, " -");
+      }
+}
+
+typedef struct
+{
+   char name[80];
+   long size;
+   time_t mtime;
+} cache_file_t;
+
+static int compare_cache_files( const void *a, const void *b, void *context)
+{
+   const time_t t1 = ((const cache_file_t *)a)->mtime;
+   const time_t t2 = ((const cache_file_t *)b)->mtime;
+
+   INTENTIONALLY_UNUSED_PARAMETER( context);
+   return( t1 > t2 ? 1 : (t1 < t2 ? -1 : 0));
+}
+
+/* Removes least recently used cache files until the total size is at
+most 'max_bytes'.  max_bytes = 0 empties the cache.  Entries in use by
+another process may get removed from under it;  that's harmless,  since
+files are only ever added by renaming completed files into place. */
+
+static void trim_cache( const char *cache_dir, const long max_bytes)
+{
+   DIR *dir = opendir( cache_dir);
+   struct dirent *entry;
+   cache_file_t *files = NULL;
+   size_t n_files = 0, n_alloced = 0, i;
+   long total_bytes = 0;
+   char path[300];
+
+   if( !dir)
+      return;
+   while( (entry = readdir( dir)) != NULL)
+      {
+      struct stat st;
+
+      if( *entry->d_name == '.' || !strcmp( entry->d_name, "stamp.txt")
+                  || strlen( entry->d_name) >= sizeof( files->name))
+         continue;
+      snprintf_err( path, sizeof( path), "%s/%s", cache_dir, entry->d_name);
+      if( stat( path, &st))
+         continue;
+      if( n_files == n_alloced)
+         {
+         n_alloced = n_alloced * 2 + 100;
+         files = (cache_file_t *)realloc( files, n_alloced * sizeof( cache_file_t));
+         assert( files);
+         }
+      strlcpy_error( files[n_files].name, entry->d_name);
+      files[n_files].size = (long)st.st_size;
+      files[n_files].mtime = st.st_mtime;
+      total_bytes += files[n_files++].size;
+      }
+   closedir( dir);
+   if( total_bytes > max_bytes)
+      {
+      shellsort_r( files, n_files, sizeof( cache_file_t),
+                              compare_cache_files, NULL);
+      for( i = 0; i < n_files && total_bytes > max_bytes; i++)
+         {
+         snprintf_err( path, sizeof( path), "%s/%s", cache_dir, files[i].name);
+         if( !unlink( path))
+            total_bytes -= files[i].size;
+         }
+      }
+   free( files);
+}
+
+static void check_cache_stamp( const char *cache_dir)
+{
+   char stamp[300], old_stamp[300], filename[300];
+   FILE *ifile, *ofile;
+
+   get_cache_stamp( stamp, sizeof( stamp));
+   snprintf_err( filename, sizeof( filename), "%s/stamp.txt", cache_dir);
+   *old_stamp = '\0';
+   if( (ifile = fopen( filename, "rb")) != NULL)
+      {
+      if( !fgets( old_stamp, sizeof( old_stamp), ifile))
+         *old_stamp = '\0';
+      fclose( ifile);
+      }
+   if( strcmp( stamp, old_stamp))
+      {
+      trim_cache( cache_dir, 0L);
+      if( (ofile = fopen( filename, "wb")) != NULL)
+         {
+         fputs( stamp, ofile);
+         fclose( ofile);
+         }
+      }
+}
+
+static int copy_file( FILE *ofile, FILE *ifile)
+{
+   char buff[4096];
+   size_t n_read;
+
+   while( (n_read = fread( buff, 1, sizeof( buff), ifile)) > 0)
+      if( fwrite( buff, 1, n_read, ofile) != n_read)
+         return( -1);
+   return( 0);
+}
+
+/* Saves the output file 'filename' as cache file 'key'.'file_no'.  It's
+written to a temporary name first,  then renamed,  so that other processes
+never see a partly written file.  */
+
+static void add_to_cache( const char *cache_dir, const char *key,
+                              const int file_no, const char *filename)
+{
+   FILE *ifile = fopen_ext( filename, "trb");
+   char cache_name[300], temp_name[300];
+
+   if( ifile)
+      {
+      FILE *ofile;
+
+      snprintf_err( cache_name, sizeof( cache_name), "%s/%s.%d",
+                              cache_dir, key, file_no);
+      snprintf_err( temp_name, sizeof( temp_name), "%s/.%s.%d.%d",
+                              cache_dir, key, file_no, (int)getpid( ));
+      if( (ofile = fopen( temp_name, "wb")) != NULL)
+         {
+         const int err = copy_file( ofile, ifile);
+
+         if( fclose( ofile) || err || rename( temp_name, cache_name))
+            unlink( temp_name);
+         }
+      fclose( ifile);
+      }
+}
+#endif         /* _WIN32 */
+
 double current_jd( void);                       /* elem_out.cpp */
 void compute_variant_orbit( double *variant, const double *ref_orbit,
                      const double n_sigmas);       /* orb_func.cpp */
 
-int main( const int argc, const char **argv)
+/* Handles one request.  Run as a CGI program,  that's all we do.  In
+server mode (see below),  each request is handled in a child process of
+the server,  with 'is_server_child' set.  The defaults,  sigmas,  and
+station data are then already loaded,  and all output files go to the
+child's own temporary directory,  so several requests can be handled at
+once without stepping on one another's files.  */
+
+static int process_request( const bool is_server_child)
 {
    const size_t max_buff_size = 400000;       /* room for 5000 obs */
    char *buff = (char *)malloc( max_buff_size);
@@ -145,7 +379,7 @@ int main( const int argc, const char **argv)
    char field[30];
    OBJECT_INFO *ids;
    FILE *ifile;
-   FILE *lock_file = fopen( "lock.txt", "w");
+   FILE *lock_file = fopen_ext( "lock.txt", "tw");
    extern const char *combine_all_observations;
    extern char *temp_obs_filename;     /* miscell.cpp */
    extern int forced_central_body;
@@ -163,13 +397,14 @@ int main( const int argc, const char **argv)
    extern bool neocp_redaction_turned_on;
    int center_object = -2;
 #ifndef _WIN32
+   const char *cache_dir = get_environment_ptr( "FO_SERVE_CACHE_DIR");
+   char cache_key[20];
    extern char **environ;
    extern bool findorb_already_running;
 
    avoid_runaway_process( 90);
+   *cache_key = '\0';
 #endif         /* _WIN32 */
-   INTENTIONALLY_UNUSED_PARAMETER( argv);
-   INTENTIONALLY_UNUSED_PARAMETER( argc);
    setvbuf( lock_file, NULL, _IONBF, 0);
    neocp_redaction_turned_on = false;
    fprintf( lock_file, "We're in\n");
@@ -186,10 +421,11 @@ int main( const int argc, const char **argv)
                /* get_defaults( ) collects a lot of data that's for the  */
                /* interactive find_orb program.  But it also sets some   */
                /* important internal values for blunder detection,  etc. */
-               /* So we still call it:                                   */
-   get_defaults( NULL, NULL, NULL, NULL, NULL);
+               /* So we still call it (in server mode,  the server did). */
+   if( !is_server_child)
+      get_defaults( NULL, NULL, NULL, NULL, NULL);
 #ifndef _WIN32
-   if( findorb_already_running)
+   if( findorb_already_running && !is_server_child)
       {
       printf( "Content-type: text/html\n\n");
       printf( "<h1> Server is busy.  Try again in a minute or two. </h1>");
@@ -377,8 +613,47 @@ int main( const int argc, const char **argv)
       }
    ephemeris_mag_limit = mag_limit;
    forced_central_body = center_object;
+#ifndef _WIN32
+               /* Ephemerides starting 'now' can't be cached;  nor can */
+               /* anything with debugging output requested :           */
+   if( *cache_dir && jd_start && !debug_level)
+      {
+      extern double minimum_observation_jd, maximum_observation_jd;
+      extern char findorb_language;
+      char options[600], cache_name[300];
+      uint64_t hash = (uint64_t)0xcbf29ce484222325;
 
-   load_up_sigma_records( "sigma.txt");
+      check_cache_stamp( cache_dir);
+      snprintf_err( options, sizeof( options),
+               "%.8f %.8f %.8f %d '%s' '%s' %.3f %d %d %llx %d %c %.8f %.8f",
+               jd_start, jd_end, user_selected_epoch, n_ephem_steps,
+               ephemeris_step_size, mpc_code, mag_limit, center_object,
+               residual_format, (unsigned long long)ephemeris_output_options,
+               (int)neocp_redaction_turned_on, findorb_language,
+               minimum_observation_jd, maximum_observation_jd);
+      hash = fnv1a_hash( hash, options, strlen( options));
+      hash = hash_astrometry_file( hash, temp_obs_filename);
+      snprintf_err( cache_key, sizeof( cache_key), "%016llx",
+                              (unsigned long long)hash);
+      snprintf_err( cache_name, sizeof( cache_name), "%s/%s.%d",
+                              cache_dir, cache_key, file_no);
+      if( (ifile = fopen( cache_name, "rb")) != NULL)
+         {
+         printf( file_no ? "Content-type: application/json\n\n"
+                         : "Content-type: text/html\n\n");
+         fflush( stdout);
+         copy_file( stdout, ifile);
+         fclose( ifile);
+         utime( cache_name, NULL);     /* mark it as recently used */
+         fprintf( lock_file, "Served from cache '%s'\n", cache_name);
+         free( buff);
+         return( 0);
+         }
+      }
+#endif
+
+   if( !is_server_child)
+      load_up_sigma_records( "sigma.txt");
    fprintf( lock_file, "Default uncertainties table read\n");
 
    ids = find_objects_in_file( temp_obs_filename, &n_ids, NULL);
@@ -402,6 +677,8 @@ int main( const int argc, const char **argv)
    extern const char *residual_filename;
    extern int available_sigmas;
    unsigned n_orbits_in_ephem = 1;
+   INTEGRATION_COUNTERS counters = *default_integration_counters( );
+   const int64_t t_object = nanoseconds_since_1970( );
 
    ifile = fopen( temp_obs_filename, "rb");
    fprintf( lock_file, "'%s' %sopened\n", temp_obs_filename, ifile ? "" : "not ");
@@ -473,26 +750,51 @@ int main( const int argc, const char **argv)
    fprintf( lock_file, "Resids written\n");
 
    strlcpy_error( mpec_name, get_environment_ptr( "MPEC_NAME"));
-   if( !*mpec_name)
+   if( !*mpec_name || is_server_child)
       strlcpy_error( mpec_name, "mpec.htm");
    make_pseudo_mpec( mpec_name, ids[0].obj_name);
    fprintf( lock_file, "pseudo-MPEC made\n");
+   ifile = open_json_file( buff, "JSON_COUNTERS_NAME", "counters.json",
+                                    obs->packed_id, "wb");
+   if( ifile)
+      {
+      const INTEGRATION_COUNTERS counters0 = counters;
+
+      counters = *default_integration_counters( );
+      add_integration_counters( &counters, &counters0, -1);
+      write_integration_counters_json( ifile, &counters,
+                  (double)( nanoseconds_since_1970( ) - t_object) * 1e-9);
+      fclose( ifile);
+      }
+#ifndef _WIN32
+   if( *cache_key)
+      {
+      const char *cache_mbytes = get_environment_ptr( "FO_SERVE_CACHE_MBYTES");
+
+      for( i = 0; i < 4; i++)
+         add_to_cache( cache_dir, cache_key, (int)i,
+                              (i ? file_names[i] : mpec_name));
+      trim_cache( cache_dir, (*cache_mbytes ? atol( cache_mbytes) : 100L)
+                              * 1024L * 1024L);
+      fprintf( lock_file, "Results cached\n");
+      }
+#endif
    unload_observations( obs, n_obs);
    fprintf( lock_file, "Obs unloaded\n");
    if( !file_no)
       {
       printf( "Content-type: text/html\n\n");
-      ifile = fopen( mpec_name, "rb");
+      ifile = fopen_ext( mpec_name, "trb");
       }
    else
       {
       printf( "Content-type: application/json\n\n");
-      ifile = fopen( file_names[file_no], "rb");
+      ifile = fopen_ext( file_names[file_no], "trb");
       }
    while( fgets( buff, max_buff_size, ifile))
       printf( "%s", buff);
    fclose( ifile);
-   if( (i = strlen( mpec_name)) > 8)
+   if( (i = strlen( mpec_name)) > 8 && !is_server_child)
       {
       const int counter = atoi( mpec_name + i - 7);
 
@@ -502,8 +804,341 @@ int main( const int argc, const char **argv)
          set_environment_ptr( "MPEC_NAME", mpec_name);
          }
       }
-   fprintf( lock_file, "Cleaning memory\n");
-   clean_up_find_orb_memory( );
    fprintf( lock_file, "Done!\n");
+   free( buff);
+   return( 0);
+}
+
+/* Run as a CGI program,  fo_serve has to load the defaults,  the station
+table,  the sigmas,  and so on for every request,  and that start-up time
+can exceed the time spent actually computing a short-arc orbit.  It also
+can only handle one request at a time;  others are told the server is busy.
+
+   Run instead as
+
+fo_serve.cgi -s (socket name) [-n (max requests at once)]
+
+   it loads all that once,  then listens on a UNIX domain socket.  For each
+connection,  it forks a child process that inherits the already-loaded
+data and handles the request.  At most 'max_children' requests are handled
+at once (default four);  any others wait their turn in the socket's
+listen queue rather than being rejected.  A fresh child for each request
+means that nothing one request changes can leak into the next one.  The
+JPL and asteroid ephemeris files are opened by each child,  since children
+sharing a FILE would share its file position.
+
+   The CGI program,  run in the usual way,  checks FO_SERVE_SOCKET in
+'environ.dat'.  If that's set and the server is listening on it,  the CGI
+program just relays the request to the server and the result back to the
+web server.  If not,  it handles the request itself,  as before.
+
+   On the socket,  a request is sent as lines of the form NAME=value for
+the CGI environment variables in 'relayed_vars[]',  then an empty line,
+then CONTENT_LENGTH bytes of CGI data.  The child sets those variables,
+reads the CGI data from the socket as it would from stdin,  and writes
+the output to the socket as it would to stdout.  */
+
+#ifndef _WIN32
+static const char *relayed_vars[] = { "REQUEST_METHOD", "CONTENT_TYPE",
+                  "CONTENT_LENGTH", "QUERY_STRING", NULL };
+
+static int write_all( const int fd, const char *buff, size_t n_bytes)
+{
+   while( n_bytes)
+      {
+      const ssize_t n_written = write( fd, buff, n_bytes);
+
+      if( n_written <= 0)
+         return( -1);
+      buff += n_written;
+      n_bytes -= (size_t)n_written;
+      }
+   return( 0);
+}
+
+static int copy_bytes( const int ifd, const int ofd, long n_bytes)
+{
+   char buff[4096];
+   ssize_t n_read = 1;
+
+   while( n_bytes && n_read > 0)
+      {
+      size_t n_to_read = sizeof( buff);
+
+      if( n_bytes > 0 && (long)n_to_read > n_bytes)
+         n_to_read = (size_t)n_bytes;
+      n_read = read( ifd, buff, n_to_read);
+      if( n_read > 0)
+         {
+         if( write_all( ofd, buff, (size_t)n_read))
+            return( -1);
+         if( n_bytes > 0)
+            n_bytes -= (long)n_read;
+         }
+      }
+   return( n_bytes > 0 ? -1 : 0);
+}
+
+static int connect_to_server( const char *socket_name)
+{
+   struct sockaddr_un addr;
+   int fd;
+
+   if( strlen( socket_name) >= sizeof( addr.sun_path))
+      return( -1);
+   memset( &addr, 0, sizeof( addr));
+   addr.sun_family = AF_UNIX;
+   strlcpy_error( addr.sun_path, socket_name);
+   fd = socket( AF_UNIX, SOCK_STREAM, 0);
+   if( fd >= 0 && connect( fd, (struct sockaddr *)&addr, sizeof( addr)))
+      {
+      close( fd);
+      fd = -1;
+      }
+   return( fd);
+}
+
+/* Returns -1 if the server couldn't be reached (in which case the CGI
+program should handle the request itself),  0 otherwise.  */
+
+static int relay_request_to_server( const char *socket_name)
+{
+   const int fd = connect_to_server( socket_name);
+   const char *content_length = getenv( "CONTENT_LENGTH");
+   size_t i;
+
+   if( fd < 0)
+      return( -1);
+   for( i = 0; relayed_vars[i]; i++)
+      {
+      const char *value = getenv( relayed_vars[i]);
+
+      if( value)
+         {
+         write_all( fd, relayed_vars[i], strlen( relayed_vars[i]));
+         write_all( fd, "=", 1);
+         write_all( fd, value, strlen( value));
+         write_all( fd, "\n", 1);
+         }
+      }
+   write_all( fd, "\n", 1);
+   if( content_length)
+      copy_bytes( STDIN_FILENO, fd, atol( content_length));
+   shutdown( fd, SHUT_WR);
+   copy_bytes( fd, STDOUT_FILENO, -1L);
+   close( fd);
    return( 0);
 }
+
+/* The request header is read a byte at a time,  so that none of the CGI
+data following it gets read;  that's left for the CGI functions to read
+from stdin.   */
+
+static int read_request_header( const int fd)
+{
+   char buff[1000];
+   size_t len = 0;
+
+   while( read( fd, buff + len, 1) == 1)
+      {
+      if( buff[len] == '\n')
+         {
+         char *equals;
+
+         if( !len)            /* empty line:  header is done */
+            return( 0);
+         buff[len] = '\0';
+         equals = strchr( buff, '=');
+         if( equals)
+            {
+            size_t i;
+
+            *equals = '\0';
+            for( i = 0; relayed_vars[i]; i++)
+               if( !strcmp( buff, relayed_vars[i]))
+                  setenv( buff, equals + 1, 1);
+            }
+         len = 0;
+         }
+      else if( len < sizeof( buff) - 1)
+         len++;
+      }
+   return( -1);
+}
+
+/* Each child puts its output into its own /tmp/find_orb(process ID)
+directory or,  if OUTPUT_DIR is set,  into a find_orb(process ID)
+subdirectory of that (see below);  otherwise,  all children would write
+to the same files.  That directory is removed when the child exits,
+whether it exits normally or via one of the exit() calls on errors.  It's
+'flat' (no subdirectories),  so this needn't recurse.  */
+
+static char child_temp_dir[255];
+
+static void remove_child_temp_dir( void)
+{
+   DIR *dir = opendir( child_temp_dir);
+   struct dirent *entry;
+   char path[300];
+
+   if( !dir)
+      return;
+   while( (entry = readdir( dir)) != NULL)
+      if( strcmp( entry->d_name, ".") && strcmp( entry->d_name, ".."))
+         {
+         snprintf_err( path, sizeof( path), "%s/%s", child_temp_dir,
+                                             entry->d_name);
+         unlink( path);
+         }
+   closedir( dir);
+   rmdir( child_temp_dir);
+}
+
+static int handle_connection( const int fd)
+{
+   extern bool findorb_already_running;
+   extern char *temp_obs_filename;     /* miscell.cpp */
+   extern const char *output_directory;     /* miscell.cpp */
+   int rval;
+
+   if( read_request_header( fd))
+      return( -1);
+   dup2( fd, STDIN_FILENO);
+   dup2( fd, STDOUT_FILENO);
+   close( fd);
+               /* The following causes output files to go to our own */
+               /* directory (see above,  and fopen_ext() in miscell.cpp) */
+   findorb_already_running = true;
+   if( output_directory)
+      {
+      snprintf_err( child_temp_dir, sizeof( child_temp_dir), "%s/find_orb%d",
+                              output_directory, (int)getpid( ));
+      mkdir( child_temp_dir, 0777);
+      output_directory = child_temp_dir;
+      }
+   else
+      get_temp_dir( child_temp_dir, sizeof( child_temp_dir));
+   atexit( remove_child_temp_dir);
+   snprintf_err( temp_obs_filename, 260, "%s/temp_obs.txt", child_temp_dir);
+   rval = process_request( true);
+   fflush( stdout);
+   clean_up_find_orb_memory( );
+   return( rval);
+}
+
+/* Finished children are reaped by a SIGCHLD handler,  so they don't
+linger as zombies until the next connection comes in.  SIGCHLD is blocked
+except while we're in accept() or waiting for a free slot,  so the
+handler can't run while the main loop is changing n_children.  Children
+go back to the default SIGCHLD handling;  otherwise,  the handler would
+'steal' the exit status of anything they ran via system().  */
+
+static volatile sig_atomic_t n_children = 0;
+
+static void reap_children( int signal_number)
+{
+   const int saved_errno = errno;
+
+   INTENTIONALLY_UNUSED_PARAMETER( signal_number);
+   while( waitpid( -1, NULL, WNOHANG) > 0)
+      n_children--;
+   errno = saved_errno;
+}
+
+static int run_server( const char *socket_name, const int max_children)
+{
+   struct sockaddr_un addr;
+   struct sigaction action;
+   sigset_t sigchld_only, unblocked;
+   mpc_code_t cinfo;
+   int listen_fd;
+
+   if( strlen( socket_name) >= sizeof( addr.sun_path))
+      {
+      fprintf( stderr, "Socket name '%s' is too long\n", socket_name);
+      return( -1);
+      }
+   get_defaults( NULL, NULL, NULL, NULL, NULL);
+   load_up_sigma_records( "sigma.txt");
+   get_observer_data( "500", NULL, &cinfo);    /* loads station data */
+   load_bc405_precomputed_data( );             /* shared by all children */
+   memset( &addr, 0, sizeof( addr));
+   addr.sun_family = AF_UNIX;
+   strlcpy_error( addr.sun_path, socket_name);
+   unlink( socket_name);
+   listen_fd = socket( AF_UNIX, SOCK_STREAM, 0);
+   if( listen_fd < 0 || bind( listen_fd, (struct sockaddr *)&addr, sizeof( addr))
+                     || listen( listen_fd, SOMAXCONN))
+      {
+      perror( socket_name);
+      return( -1);
+      }
+   fprintf( stderr, "Listening on '%s',  %d requests at once\n",
+                     socket_name, max_children);
+   memset( &action, 0, sizeof( action));
+   action.sa_handler = reap_children;     /* no SA_RESTART,  so accept() */
+   sigemptyset( &action.sa_mask);         /* returns EINTR on SIGCHLD    */
+   sigaction( SIGCHLD, &action, NULL);
+   sigemptyset( &sigchld_only);
+   sigaddset( &sigchld_only, SIGCHLD);
+   sigprocmask( SIG_BLOCK, &sigchld_only, &unblocked);
+   for( ;;)
+      {
+      int conn_fd;
+      pid_t child_pid;
+
+      while( n_children >= max_children)    /* wait for a child to finish */
+         sigsuspend( &unblocked);
+      sigprocmask( SIG_SETMASK, &unblocked, NULL);
+      conn_fd = accept( listen_fd, NULL, NULL);
+      sigprocmask( SIG_BLOCK, &sigchld_only, NULL);
+      if( conn_fd < 0)
+         {
+         if( errno == EINTR)
+            continue;
+         perror( "accept");
+         break;
+         }
+      fflush( stdout);
+      child_pid = fork( );
+      if( !child_pid)
+         {
+         action.sa_handler = SIG_DFL;
+         sigaction( SIGCHLD, &action, NULL);
+         sigprocmask( SIG_SETMASK, &unblocked, NULL);
+         close( listen_fd);
+         exit( handle_connection( conn_fd) ? 1 : 0);
+         }
+      if( child_pid < 0)
+         perror( "fork");
+      else
+         n_children++;
+      close( conn_fd);
+      }
+   close( listen_fd);
+   unlink( socket_name);
+   return( -1);
+}
+#endif         /* _WIN32 */
+
+int main( const int argc, const char **argv)
+{
+   int n_args = argc, rval;
+
+   reset_astrometry_filename( &n_args, argv);
+#ifndef _WIN32
+   if( argc > 2 && !strcmp( argv[1], "-s"))
+      {
+      const int max_children = (argc > 4 && !strcmp( argv[3], "-n") ?
+                                    atoi( argv[4]) : 4);
+
+      return( run_server( argv[2], (max_children > 0 ? max_children : 1)));
+      }
+   if( *get_environment_ptr( "FO_SERVE_SOCKET")
+            && !relay_request_to_server( get_environment_ptr( "FO_SERVE_SOCKET")))
+      return( 0);
+#endif
+   rval = process_request( false);
+   clean_up_find_orb_memory( );
+   return( rval);
+}
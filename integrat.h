@@ -0,0 +1,186 @@
+/* integrat.h: state used in numerically integrating orbits
+
+Copyright (C) 2026, Project Pluto
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+02110-1301, USA.    */
+
+/* Integrating an orbit used to depend on a pile of globals and function
+statics :  which perturbers are in use,  which planet we're closest to,
+whether we hit a planet,  the cache of planetary positions,  the asteroid
+positions used in finding asteroid perturbers,  and so on.  That meant
+only one orbit could be integrated at a time.
+
+   All of that now lives in an INTEGRATION_CONTEXT.  The 'usual' functions
+(integrate_orbit(),  calc_derivatives(),  planet_posn(),  etc.) use the
+default context,  which is kept in sync with the old globals (perturbers,
+best_fit_planet,  planet_hit,  and so on;  see update_globals_from_context()
+in 'runge.cpp');  so existing code works unchanged.  Code that wants to
+integrate several orbits at once (say,  in separate threads) gives each
+thread its own context,  made with create_integration_context(),  and
+calls the _ctx versions of those functions;  see
+integrate_orbits_in_threads() in 'orb_func.cpp'.  The JPL and BC-405
+ephemeris data are shared,  but each context has its own file handles
+and caches.  Contexts should be created before any threads are started;
+the first context created loads the ephemerides (without any locking).
+
+   The 'planet_cache' and 'asteroid_cache' pointers are NULL for the
+default context,  meaning "use the process-wide caches".  Passing a NULL
+context to the _ctx functions also means "use the default".
+
+   Each context also keeps running totals of the work it has done,  in
+an INTEGRATION_COUNTERS struct :  derivative evaluations,  accepted and
+rejected steps,  planet cache lookups,  asteroid perturbers considered
+and used,  and the time spent in the integrator,  in computing planet
+positions,  and in looking for asteroid perturbers.  These are always
+kept (they cost a few integer adds and a clock read per step),  except
+that the perturber search,  done for every derivative evaluation,  is only
+timed if the counters are to be written out (JSON_COUNTERS_NAME isn't
+'none').  To get the counts for one object,  copy the counters before
+processing it and subtract that copy afterward;  see
+add_integration_counters().
+
+   The integrator itself (calc_derivatives_ctx(),  take_rk_step(),  and
+so on) comes in long double and double versions,  both made from the same
+templated code in 'runge.cpp'.  integrate_orbit_ctx() uses the long double
+version unless DOUBLE_INTEGRATION (see 'environ.def') says otherwise.
+calc_derivatives_batch() and take_rk_step_batch() do the same for many
+orbits in 'lockstep';  see integrate_orbits() in 'orb_func.cpp'.
+
+   'comets.h',  <math.h>,  and <stdint.h> must be #included before this
+file.    */
+
+      /* Used in the templated integrator code in both 'runge.cpp' and */
+      /* 'orb_func.cpp',  so each precision gets its own fabs() :     */
+static inline double fabs_t( const double x)        { return( fabs( x)); }
+static inline long double fabs_t( const long double x) { return( fabsl( x)); }
+
+#define PLANET_CACHE   struct planet_cache
+#define ASTEROID_CACHE struct asteroid_cache
+#define RADAU_STATE    struct radau_state
+
+PLANET_CACHE;
+ASTEROID_CACHE;
+RADAU_STATE;
+
+typedef struct
+{
+   long n_derivs, n_steps, n_rejects;
+   long cache_hits, cache_misses, cache_probes, max_probes, cache_evictions;
+   long perturber_candidates, perturbers_used;
+   int64_t integration_ns, planet_ns, perturber_ns;
+   } INTEGRATION_COUNTERS;
+
+typedef struct
+{
+            /* Set from the globals of the same names when the context */
+            /* is created,  and then used by the integrator :          */
+   unsigned perturbers, excluded_perturbers;
+   int n_orbit_params;
+   bool fail_on_hitting_planet;
+            /* Set as a side effect of integrating/computing derivatives : */
+   unsigned perturbers_automatically_found;
+   int best_fit_planet, planet_hit;
+   double best_fit_planet_dist;
+            /* See runge.cpp for the following : */
+   int n_variational_eqns;
+   PLANET_CACHE *planet_cache;
+   ASTEROID_CACHE *asteroid_cache;
+   int orientation_planet;       /* see calc_approx_planet_orientation() */
+   double orientation_jde, orientation_matrix[9];
+   RADAU_STATE *radau_state;     /* see take_radau_step() */
+   INTEGRATION_COUNTERS counters;
+   } INTEGRATION_CONTEXT;
+
+INTEGRATION_CONTEXT *create_integration_context( void);  /* runge.cpp */
+void free_integration_context( INTEGRATION_CONTEXT *ctx);  /* runge.cpp */
+INTEGRATION_CONTEXT *default_integration_context( void);  /* runge.cpp */
+INTEGRATION_COUNTERS *default_integration_counters( void); /* runge.cpp */
+void update_globals_from_context( const INTEGRATION_CONTEXT *ctx);
+void add_integration_counters( INTEGRATION_COUNTERS *sum,
+            const INTEGRATION_COUNTERS *counters,
+            const int sign);                            /* runge.cpp */
+int write_integration_counters_json( FILE *ofile,
+            const INTEGRATION_COUNTERS *counters,
+            const double elapsed_seconds);              /* runge.cpp */
+
+int integrate_orbit_ctx( INTEGRATION_CONTEXT *ctx, long double *orbit,
+            const long double t0, const long double t1, const int n_times,
+            const double *times, double *ostates,
+            const int n_partials);                      /* orb_func.cpp */
+int calc_derivatives_ctx( INTEGRATION_CONTEXT *ctx, const long double jd,
+            const long double *ival, long double *oval,
+            const int reference_planet);                /* runge.cpp */
+int calc_derivatives_ctx( INTEGRATION_CONTEXT *ctx, const double jd,
+            const double *ival, double *oval,
+            const int reference_planet);                /* runge.cpp */
+long double take_rk_step( INTEGRATION_CONTEXT *ctx, const long double jd,
+            ELEMENTS *ref_orbit, const long double *ival,
+            long double *ovals, const int n_vals, const long double step,
+            const long double *initial_derivs);         /* runge.cpp */
+double take_rk_step( INTEGRATION_CONTEXT *ctx, const double jd,
+            ELEMENTS *ref_orbit, const double *ival,
+            double *ovals, const int n_vals, const double step,
+            const double *initial_derivs);              /* runge.cpp */
+long double take_pd89_step( INTEGRATION_CONTEXT *ctx, const long double jd,
+            ELEMENTS *ref_orbit, const long double *ival,
+            long double *ovals, const int n_vals, const long double step,
+            const long double *initial_derivs);         /* runge.cpp */
+double take_pd89_step( INTEGRATION_CONTEXT *ctx, const double jd,
+            ELEMENTS *ref_orbit, const double *ival,
+            double *ovals, const int n_vals, const double step,
+            const double *initial_derivs);              /* runge.cpp */
+long double take_radau_step( INTEGRATION_CONTEXT *ctx, const long double jd,
+            ELEMENTS *ref_orbit, const long double *ival,
+            long double *ovals, const int n_vals, const long double step,
+            const long double *initial_derivs);         /* runge.cpp */
+double take_radau_step( INTEGRATION_CONTEXT *ctx, const double jd,
+            ELEMENTS *ref_orbit, const double *ival,
+            double *ovals, const int n_vals, const double step,
+            const double *initial_derivs);              /* runge.cpp */
+void dense_output_interpolate( INTEGRATION_CONTEXT *ctx,
+            ELEMENTS *ref_orbit, const long double jd0,
+            const long double *state0, const long double *derivs0,
+            const long double *state1, const long double *derivs1,
+            const long double step, const long double jd,
+            long double *ostate, const int n_partials); /* runge.cpp */
+void dense_output_interpolate( INTEGRATION_CONTEXT *ctx,
+            ELEMENTS *ref_orbit, const double jd0,
+            const double *state0, const double *derivs0,
+            const double *state1, const double *derivs1,
+            const double step, const double jd,
+            double *ostate, const int n_partials);      /* runge.cpp */
+int calc_derivatives_batch( INTEGRATION_CONTEXT *ctx, const double jd,
+            const int n_orbits, const double *ivals,
+            double *ovals);                             /* runge.cpp */
+double take_rk_step_batch( INTEGRATION_CONTEXT *ctx, const double jd,
+            const int n_orbits, const double *ival, double *ovals,
+            const double step);                         /* runge.cpp */
+int find_relative_orbit_ctx( INTEGRATION_CONTEXT *ctx, const double jd,
+            const double *ivect, ELEMENTS *elements,
+            const int ref_planet);                      /* runge.cpp */
+int planet_posn_ctx( INTEGRATION_CONTEXT *ctx, const int planet_no,
+            const double jd, double *vect_2000);        /* pl_cache.cpp */
+int perturber_posns_ctx( INTEGRATION_CONTEXT *ctx, const unsigned mask,
+            const double jd, double *posns);            /* pl_cache.cpp */
+int detect_perturbers_ctx( INTEGRATION_CONTEXT *ctx, const double jd,
+            const double *xyz, double *accel);          /* bc405.cpp */
+int asteroid_position_ctx( INTEGRATION_CONTEXT *ctx, const int astnum,
+            const double jd, double *posn, double *vel); /* bc405.cpp */
+
+PLANET_CACHE *alloc_planet_cache( void);                  /* pl_cache.cpp */
+void free_planet_cache( PLANET_CACHE *cache);             /* pl_cache.cpp */
+ASTEROID_CACHE *alloc_asteroid_cache( void);              /* bc405.cpp */
+void free_asteroid_cache( ASTEROID_CACHE *cache);         /* bc405.cpp */
@@ -28,9 +28,19 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
 #include <math.h>
 #include <time.h>
 #include <stdbool.h>
+#include <sys/stat.h>
 #ifdef _WIN32
 #include <windows.h>
 #endif
+#if defined( __linux) || defined( __unix__) || defined( __APPLE__)
+   #define PARALLEL_SCAN
+   #define THREAD_SAFE_ENVIRONMENT     /* see get_environment_snapshot( ) */
+   #include <unistd.h>
+   #include <sys/types.h>
+   #include <sys/wait.h>
+   #include <sys/mman.h>   /* see scan_file_in_parallel( ) */
+   #include <pthread.h>    /* see get_environment_snapshot( ) */
+#endif
 #include <stdarg.h>
 #include <assert.h>
 #include <errno.h>
@@ -64,6 +74,8 @@ int parallax_to_lat_alt( const double rho_cos_phi, const double rho_sin_phi,
        double *lat, double *ht_in_meters, const int planet_idx); /* ephem0.c */
 void set_obs_vect( OBSERVE FAR *obs);        /* mpc_obs.h */
 void remove_trailing_cr_lf( char *buff);            /* ephem0.cpp */
+uint64_t fnv1a_hash( uint64_t hash, const char *buff,
+                                   size_t n_bytes);         /* mpc_obs.cpp */
 void format_dist_in_buff( char *buff, const double dist_in_au); /* ephem0.c */
 double current_jd( void);                       /* elem_out.cpp */
 void remove_insignificant_digits( char *tbuff);          /* monte0.c */
@@ -683,6 +695,76 @@ static int get_rover_index( const char *obscode)
    return( rval);
 }
 
+/* Station lines used to be found by binary search through the sorted
+lines,  then parsed (get_mpc_code_info() and scaling to AU) for each
+observation.  Instead,  each line is now parsed just once,  when the
+stations are loaded,  and the results are put into an open-addressed hash
+table keyed on the three- or four-character code (a blank fourth
+character is treated as "no fourth character",  as in mpc_code_cmp()).
+Lookups are then O(1),  with no re-parsing.  The table is built the first
+time a station is looked up,  which happens before find_objects_in_file()
+forks any processes;  child processes therefore share it (read-only,
+copy-on-write) without rebuilding it.   */
+
+typedef struct
+{
+   const char *line;
+   mpc_code_t cinfo;
+   int planet_idx;
+} station_t;
+
+static inline uint32_t station_code_hash( const char *code)
+{
+   uint32_t rval = 0;
+   size_t i;
+
+   for( i = 0; i < 4 && code[i]; i++)
+      if( i < 3 || code[i] != ' ')
+         rval = rval * 31 + (unsigned char)code[i];
+   return( rval * 2654435761u);
+}
+
+static station_t *build_station_table( char **station_data,
+                         const int n_stations, size_t *table_size)
+{
+   size_t i, size = 64;
+   station_t *table;
+
+   while( size < 2 * (size_t)n_stations)
+      size <<= 1;
+   table = (station_t *)calloc( size, sizeof( station_t));
+   assert( table);
+   for( i = 0; i < (size_t)n_stations; i++)
+      {
+      size_t loc = station_code_hash( station_data[i]) & (size - 1);
+
+      while( table[loc].line && mpc_code_cmp( table[loc].line, station_data[i]))
+         loc = (loc + 1) & (size - 1);
+      if( !table[loc].line)      /* duplicates were resolved when sorting */
+         {
+         table[loc].line = station_data[i];
+         table[loc].planet_idx = extract_mpc_station_data( station_data[i],
+                                          &table[loc].cinfo);
+         }
+      }
+   *table_size = size;
+   return( table);
+}
+
+static const station_t *find_station( const station_t *table,
+                         const size_t table_size, const char *mpc_code)
+{
+   size_t loc = station_code_hash( mpc_code) & (table_size - 1);
+
+   while( table[loc].line)
+      {
+      if( !mpc_code_cmp( table[loc].line, mpc_code))
+         return( table + loc);
+      loc = (loc + 1) & (table_size - 1);
+      }
+   return( NULL);
+}
+
 /* The following function paws through the ObsCodes.htm or ObsCodes.html
    file,  looking for the observer code in question.  If found,  the
    line is simply copied into 'buff'.  If lon_in_radians and the
@@ -714,8 +796,10 @@ int n_obs_actually_loaded, n_rovers = 0;
 
 int get_observer_data( const char FAR *mpc_code, char *buff, mpc_code_t *cinfo)
 {
-   static char *curr_station = NULL;
+   static const station_t *curr_station = NULL;
    static char **station_data = NULL;
+   static station_t *station_table = NULL;
+   static size_t station_table_size = 0;
    static int n_stations = 0;
    const char *blank_line = "!!!   0.0000 0.000000 0.000000Unknown Station Code";
    int rval = -1, rover_idx;
@@ -728,7 +812,9 @@ int get_observer_data( const char FAR *mpc_code, char *buff, mpc_code_t *cinfo)
    if( !mpc_code)    /* freeing up resources */
       {
       free( station_data);
+      free( station_table);
       station_data = NULL;
+      station_table = NULL;
       curr_station = NULL;
       n_stations = 0;
       xref_designation( NULL);
@@ -757,6 +843,9 @@ int get_observer_data( const char FAR *mpc_code, char *buff, mpc_code_t *cinfo)
             else
                station_data[i] = station_data[i - 1];
             }
+      free( station_table);
+      station_table = build_station_table( station_data, n_stations,
+                                                &station_table_size);
       }
    if( !cinfo)   /* attempting to look up an MPC code from the station name */
       {
@@ -854,22 +943,9 @@ int get_observer_data( const char FAR *mpc_code, char *buff, mpc_code_t *cinfo)
       return( rval);
       }
 
-   if( !curr_station || mpc_code_cmp( curr_station, mpc_code))
-      {
-      int step, loc = -1, loc1;
-
-      curr_station = NULL;
-      for( step = 0x8000; step; step >>= 1)
-         if( (loc1 = loc + step) < n_stations)
-            {
-            const int compare = mpc_code_cmp( station_data[loc1], mpc_code);
-
-            if( compare <= 0)
-               loc = loc1;
-            if( !compare)
-               curr_station = station_data[loc];
-            }
-      }
+   if( !curr_station || mpc_code_cmp( curr_station->line, mpc_code))
+      curr_station = find_station( station_table, station_table_size,
+                                   mpc_code);
    if( !curr_station)
       {
       const char *envar = "UPDATE_OBSCODES_HTML";
@@ -903,8 +979,9 @@ int get_observer_data( const char FAR *mpc_code, char *buff, mpc_code_t *cinfo)
    else
       {
       if( buff)
-         strcpy( buff, curr_station);
-      rval = extract_mpc_station_data( curr_station, cinfo);
+         strcpy( buff, curr_station->line);
+      *cinfo = curr_station->cinfo;
+      rval = curr_station->planet_idx;
       }
    return( rval);
 }
@@ -3538,6 +3615,284 @@ bool use_sigmas = true;
 extern int is_interstellar;
 static double _overall_obj_alt_limit, _overall_sun_alt_limit;
 
+/* Appends 'text' to a block of lines,  with a 'tag' character in front.
+Used to keep the cross-designations and names found while reading a file
+for the object index (see below),  and observation details lines for
+the observation cache. */
+
+static void add_tagged_line( char **lines, const char tag,
+                                 const char *text)
+{
+   const size_t len = (*lines ? strlen( *lines) : 0);
+
+   *lines = (char *)realloc( *lines, len + strlen( text) + 3);
+   (*lines)[len] = tag;
+   strcpy( *lines + len + 1, text);
+   strcat( *lines + len, "\n");
+}
+
+/* If OBS_CACHE_DIR is set in 'environ.dat',  load_observations( ) saves
+the fully set-up array of observations for each object in that directory,
+and reads it back the next time that object is loaded with the same
+settings.  All the parsing,  observer positions,  sigma and bias look-ups,
+and checks for duplicates are then skipped.
+
+   The cache file name is a hash of the object's packed designation,  the
+number of observations,  where in the file we started reading,  and the
+settings that affect how observations are set up (sigmas,  debiasing,
+date range,  the JPL ephemeris version and range,  and the sizes and times
+of 'sigma.txt',  'ObsCodes.html',  the JPL ephemeris file and the like).
+The file records the range of bytes of astrometry that was read,  and a
+hash of those bytes.  If they've changed,  the cache isn't
+used.  Reading those bytes again is far cheaper than parsing them.
+
+   Objects with private,  roving,  or radar observations,  or with lines
+that change global settings (such as '#toffset' or '#sun_alt_limit'),
+aren't cached.  Warnings about duplicates and such are shown only when the
+observations are actually parsed.  */
+
+#define OBS_CACHE_HEADER "Find_Orb observation cache 4"
+#define OBS_CACHE_SETTINGS_SIZE 500
+
+static void append_file_stamp( char *buff, const size_t max_len,
+                               const char *filename)
+{
+   char path[PATH_MAX];
+   struct stat st;
+
+   make_config_dir_name( path, filename);
+   if( !stat( path, &st) || !stat( filename, &st))
+      snprintf_append( buff, max_len, " %ld:%ld",
+                              (long)st.st_size, (long)st.st_mtime);
+   else
+      snprintf_append( buff, max_len, " -");
+}
+
+static bool get_obs_cache_name( char *cache_name, const size_t max_len,
+            char *settings, const char *packed_desig, const int n_obs,
+            const long start)
+{
+   const char *cache_dir = get_environment_ptr( "OBS_CACHE_DIR");
+   const char *stamp_files[] = { "sigma.txt", "ObsCodes.html",
+            "ObsCodes.htm", "rovers.txt", "xdesig.txt", "odd_name.txt",
+            "jpl_eph.txt", NULL };
+#if defined (_WIN32) || defined( __WATCOMC__)
+   const char *jpl_filename = get_environment_ptr( "JPL_FILENAME");
+#else
+   const char *jpl_filename = get_environment_ptr( "LINUX_JPL_FILENAME");
+#endif
+   extern const char *fcct14_bias_file_name;
+   int i, de_version;
+   double jd_start, jd_end;
+
+   if( !*cache_dir || start < 0)
+      return( false);
+               /* observer positions depend on the JPL ephemeris in use */
+   get_jpl_ephemeris_info( &de_version, &jd_start, &jd_end);
+   snprintf_err( settings, OBS_CACHE_SETTINGS_SIZE,
+            "%s %d %ld %d %d %d %d %d %.6f %.6f %.3f %.3f %.3f %.9f %d %s"
+            " DE%d %.1f %.1f",
+            packed_desig, n_obs, start, (int)use_sigmas, apply_debiasing,
+            sanity_check_observations,
+            (*get_environment_ptr( "FIX_OBSERVATIONS") != '\0'),
+            (combine_all_observations != NULL),
+            minimum_observation_jd, maximum_observation_jd,
+            maximum_observation_span,
+            _overall_sun_alt_limit, _overall_obj_alt_limit,
+            observation_time_offset, (int)strict_sat_xyz_format,
+            (fcct14_bias_file_name ? fcct14_bias_file_name : "-"),
+            de_version, jd_start, jd_end);
+   for( i = 0; stamp_files[i]; i++)
+      append_file_stamp( settings, OBS_CACHE_SETTINGS_SIZE, stamp_files[i]);
+   if( *jpl_filename)
+      append_file_stamp( settings, OBS_CACHE_SETTINGS_SIZE, jpl_filename);
+   else
+      snprintf_append( settings, OBS_CACHE_SETTINGS_SIZE, " -");
+   if( fcct14_bias_file_name)
+      append_file_stamp( settings, OBS_CACHE_SETTINGS_SIZE,
+                                    fcct14_bias_file_name);
+   snprintf_err( cache_name, max_len, "%s/%016llx.obs", cache_dir,
+            (unsigned long long)fnv1a_hash( (uint64_t)0xcbf29ce484222325,
+                                            settings, strlen( settings)));
+   return( true);
+}
+
+static uint64_t hash_file_range( FILE *ifile, const long start,
+                                 const long end)
+{
+   uint64_t hash = (uint64_t)0xcbf29ce484222325;
+   const size_t buffsize = 65536;
+   char *buff = (char *)malloc( buffsize);
+   long remains = end - start;
+   size_t n_read = 1;
+
+   fseek( ifile, start, SEEK_SET);
+   while( remains > 0 && n_read)
+      {
+      n_read = fread( buff, 1, (remains < (long)buffsize ?
+                                (size_t)remains : buffsize), ifile);
+      hash = fnv1a_hash( hash, buff, n_read);
+      remains -= (long)n_read;
+      }
+   free( buff);
+   return( remains ? 0 : hash);
+}
+
+/* Several processes (fo with forking,  or fo_serve children) may write
+the same file at once.  Each writes to a temporary file with its own
+process ID in the name,  then renames it into place.  */
+
+static char *temp_file_name( char *temp_name, const size_t max_len,
+                             const char *filename)
+{
+#if defined( __linux) || defined( __unix__) || defined( __APPLE__)
+   snprintf_err( temp_name, max_len, "%s.%d.tmp", filename, (int)getpid( ));
+#else
+   snprintf_err( temp_name, max_len, "%s.tmp", filename);
+#endif
+   return( temp_name);
+}
+
+static void save_cached_observations( const char *cache_name,
+            const char *settings, FILE *ifile, const long start,
+            const long end, const OBSERVE *obs, const int n_loaded,
+            const char *details_lines)
+{
+   char temp_name[PATH_MAX + 20];
+   const uint64_t hash = hash_file_range( ifile, start, end);
+   FILE *ofile;
+   int i, err;
+
+   fseek( ifile, end, SEEK_SET);
+   ofile = fopen( temp_file_name( temp_name, sizeof( temp_name), cache_name),
+                                                   "wb");
+   if( !ofile)
+      return;
+   fprintf( ofile, "%s %d\n%s\n%ld %ld %016llx %d %d %d %.9f\n",
+            OBS_CACHE_HEADER, (int)sizeof( OBSERVE), settings,
+            start, end, (unsigned long long)hash, n_loaded,
+            is_interstellar, object_type, input_coordinate_epoch);
+   for( i = 0; i < n_loaded; i++)
+      {
+      OBSERVE tobs = obs[i];
+
+      tobs.second_line = tobs.ades_ids = NULL;
+      tobs.obs_details = NULL;
+      fwrite( &tobs, sizeof( OBSERVE), 1, ofile);
+      }
+   for( i = 0; i < n_loaded; i++)
+      {
+      if( obs[i].second_line)
+         fprintf( ofile, "S %d %s\n", i, obs[i].second_line);
+      if( obs[i].ades_ids)
+         fprintf( ofile, "A %d %s\n", i, obs[i].ades_ids);
+      }
+   fprintf( ofile, "%send\n", (details_lines ? details_lines : ""));
+   err = ferror( ofile);
+   if( fclose( ofile) || err)
+      remove( temp_name);
+   else
+      {
+#ifdef _WIN32
+      remove( cache_name);       /* Windows won't rename over a file */
+#endif
+      if( rename( temp_name, cache_name))
+         remove( temp_name);
+      }
+}
+
+/* Reads cached observations into 'obs' (allocated for at least 'n_obs'
+observations).  If that works,  'ifile' is left just past the astrometry
+the cache was made from,  as if it had been read,  and we return the
+number of observations.  Otherwise,  'ifile' is left where it was and
+we return -1.  */
+
+static int load_cached_observations( const char *cache_name,
+            const char *settings, FILE *ifile, const long start,
+            OBSERVE *obs, const int n_obs)
+{
+   FILE *cache_file = fopen( cache_name, "rb");
+   char buff[700], header[80];
+   int i, n_loaded = -1, interstellar, obj_type;
+   long cached_start, end;
+   unsigned long long hash;
+   double coord_epoch;
+   bool got_end = false;
+
+   if( !cache_file)
+      return( -1);
+   snprintf_err( header, sizeof( header), "%s %d\n", OBS_CACHE_HEADER,
+                                  (int)sizeof( OBSERVE));
+   if( fgets( buff, sizeof( buff), cache_file) && !strcmp( buff, header)
+         && fgets( buff, sizeof( buff), cache_file)
+         && !memcmp( buff, settings, strlen( settings))
+         && buff[strlen( settings)] == '\n'
+         && fgets( buff, sizeof( buff), cache_file)
+         && 7 == sscanf( buff, "%ld %ld %llx %d %d %d %lf", &cached_start,
+                  &end, &hash, &n_loaded, &interstellar, &obj_type,
+                  &coord_epoch)
+         && cached_start == start && n_loaded >= 0 && n_loaded <= n_obs
+         && fread( obs, sizeof( OBSERVE), n_loaded, cache_file)
+                                                == (size_t)n_loaded)
+      {
+      void *details = init_observation_details( );
+
+      while( !got_end && fgets( buff, sizeof( buff), cache_file))
+         {
+         remove_trailing_cr_lf( buff);
+         i = atoi( buff + 2);
+         if( !strcmp( buff, "end"))
+            got_end = true;
+         else if( *buff == 'D')
+            add_line_to_observation_details( details, buff + 1);
+         else if( (*buff == 'S' || *buff == 'A') && i >= 0 && i < n_loaded)
+            {
+            const char *text = strchr( buff + 2, ' ');
+            char *tptr;
+
+            if( !text)
+               break;
+            text++;
+            if( *buff == 'S')
+               {
+               tptr = obs[i].second_line = (char *)malloc( 81);
+               strlcpy( tptr, text, 81);
+               }
+            else
+               {
+               if( !_ades_ids_stack)
+                  _ades_ids_stack = create_stack( 2000);
+               tptr = obs[i].ades_ids = (char *)stack_alloc(
+                           _ades_ids_stack, strlen( text) + 1);
+               strcpy( tptr, text);
+               }
+            }
+         }
+      if( got_end && (uint64_t)hash == hash_file_range( ifile, start, end))
+         {
+         free_observation_details( obs_details);
+         obs_details = details;
+         for( i = 0; i < n_loaded; i++)
+            obs[i].obs_details = get_code_details( obs_details, obs[i].mpc_code);
+         is_interstellar = interstellar;
+         object_type = obj_type;
+         input_coordinate_epoch = coord_epoch;
+         }
+      else
+         {
+         free_observation_details( details);
+         for( i = 0; i < n_loaded; i++)
+            if( obs[i].second_line)
+               free( obs[i].second_line);
+         memset( obs, 0, n_loaded * sizeof( OBSERVE));
+         got_end = false;
+         }
+      }
+   fclose( cache_file);
+   fseek( ifile, (got_end ? end : start), SEEK_SET);
+   return( got_end ? n_loaded : -1);
+}
+
 OBSERVE FAR *load_observations( FILE *ifile, const char *packed_desig,
                            const int n_obs)
 {
@@ -3572,6 +3927,11 @@ OBSERVE FAR *load_observations( FILE *ifile, const char *packed_desig,
    int spacecraft_offset_reference = 399;    /* default is geocenter */
    double spacecraft_vel[3];
    static int suppress_private_obs = -1;
+   const long load_start = ftell( ifile);
+   long load_end;
+   char cache_name[PATH_MAX + 20], cache_settings[OBS_CACHE_SETTINGS_SIZE];
+   char *details_lines = NULL;
+   bool use_cache, cacheable = true;
 
    move_add_nstr( 1, 2, "Loading observations", -1);
    refresh_console( );
@@ -3601,6 +3961,23 @@ OBSERVE FAR *load_observations( FILE *ifile, const char *packed_desig,
    *curr_ades_ids = '\0';
    for( i = 0; i < 3; i++)
       spacecraft_vel[i] = 0.;
+   use_cache = get_obs_cache_name( cache_name, sizeof( cache_name),
+                  cache_settings, packed_desig, n_obs, load_start);
+   if( use_cache && (i = load_cached_observations( cache_name,
+                  cache_settings, ifile, load_start, rval, n_obs)) >= 0)
+      {
+      free_ades2mpc_context( ades_context);
+      n_obs_actually_loaded = i;
+      monte_carlo_object_count = 0;
+      n_monte_carlo_impactors = 0;
+      if( n_obs > 1)
+         apply_excluded_observations_file( rval, n_obs_actually_loaded);
+      snprintf_err( buff, sizeof( buff), "%d observations loaded from cache",
+                     n_obs_actually_loaded);
+      move_add_nstr( 1, 2, buff, -1);
+      refresh_console( );
+      return( rval);
+      }
    i = 0;
    while( fgets_with_ades_xlation( buff, sizeof( buff), ades_context, ifile)
                   && i != n_obs)
@@ -3634,7 +4011,10 @@ OBSERVE FAR *load_observations( FILE *ifile, const char *packed_desig,
       original_packed_desig[12] = '\0';
       memcpy( original_packed_desig, buff, 12);
       xref_designation( buff);
-      add_line_to_observation_details( obs_details, buff);
+      if( OBS_DETAILS_HEADER_LINE ==
+                     add_line_to_observation_details( obs_details, buff)
+                     && use_cache)
+         add_tagged_line( &details_lines, 'D', buff);
       jd = observation_jd( buff);
       if( is_in_range( jd) && !compare_desigs( packed_desig, buff))
          {
@@ -3774,6 +4154,10 @@ OBSERVE FAR *load_observations( FILE *ifile, const char *packed_desig,
                      suppress_private_obs = 1;
                   }
                }
+            if( rval[i].reference[0] == '!')
+               cacheable = false;
+            if( buff[14] == 'R' || buff[14] == 'V')
+               cacheable = false;      /* radar & roving obs aren't cached */
             if( rval[i].reference[0] == '!' && suppress_private_obs)
                observation_is_good = false;
             if( observation_is_good)
@@ -3965,17 +4349,32 @@ OBSERVE FAR *load_observations( FILE *ifile, const char *packed_desig,
          else if( !memcmp( buff, "#suppress_obs", 13))
             including_obs = false;
          else if( !memcmp( buff, "#sun_alt_limit ", 15))
+            {
             _overall_sun_alt_limit = atof( buff + 15);
+            cacheable = false;
+            }
          else if( !memcmp( buff, "#reset_debug ", 13))
-             debug_level = atoi( buff + 13);
+            {
+            debug_level = atoi( buff + 13);
+            cacheable = false;
+            }
          else if( !memcmp( buff, "#obj_alt_limit ", 15))
+            {
             _overall_obj_alt_limit = atof( buff + 15);
+            cacheable = false;
+            }
          else if( !memcmp( buff, "#include_obs", 12))
             including_obs = true;
          else if( !memcmp( buff, "#toffset", 7))
+            {
             observation_time_offset = atof( buff + 8) / seconds_per_day;
+            cacheable = false;
+            }
          else if( !memcmp( buff, "#relax_xyz", 10))
+            {
             strict_sat_xyz_format = false;
+            cacheable = false;
+            }
          else if( !memcmp( buff, "#interstellar", 12))
             is_interstellar = 1;
          else if( !memcmp( buff, "#time ", 6))
@@ -4003,6 +4402,7 @@ OBSERVE FAR *load_observations( FILE *ifile, const char *packed_desig,
          }
       }
    free_ades2mpc_context( ades_context);
+   load_end = ftell( ifile);
    n_obs_actually_loaded = i;
    if( debug_level)
       debug_printf( "%u obs found in file\n",  n_obs_actually_loaded);
@@ -4193,8 +4593,16 @@ OBSERVE FAR *load_observations( FILE *ifile, const char *packed_desig,
                }
             }
       reset_object_type( rval, n_obs_actually_loaded);
-      apply_excluded_observations_file( rval, n_obs_actually_loaded);
       }
+               /* The cache holds observations before the excluded obs */
+               /* file is applied,  since that file may have changed.   */
+   if( use_cache && cacheable && !n_rovers)
+      save_cached_observations( cache_name, cache_settings, ifile,
+                  load_start, load_end, rval, n_obs_actually_loaded,
+                  details_lines);
+   free( details_lines);
+   if( n_obs > 1)
+      apply_excluded_observations_file( rval, n_obs_actually_loaded);
    snprintf_err( buff, sizeof( buff), "%d observations actually loaded", n_obs_actually_loaded);
    move_add_nstr( 1, 2, buff, -1);
    refresh_console( );
@@ -4316,6 +4724,519 @@ static bool fullname_pattern_matched( const char *full_name, const char *pattern
    return( false);
 }
 
+/* Once the hash table used in find_objects_in_file( ) is 75% full,  a
+new table,  double in size,  is allocated;  everything is moved from the
+old table to the new one,  and the old one is freed.  */
+
+static void grow_object_table( OBJECT_INFO **table, int *n_alloced)
+{
+   const unsigned new_size = *n_alloced * 2 - 1;
+   OBJECT_INFO *new_rval = (OBJECT_INFO *)calloc(
+                                 new_size, sizeof( OBJECT_INFO));
+   int i;
+
+   for( i = 0; i < *n_alloced; i++)
+      if( (*table)[i].packed_desig[0])
+         {
+         const unsigned new_loc = find_in_hash_table( new_rval,
+                                   (*table)[i].packed_desig, new_size);
+
+         new_rval[new_loc] = (*table)[i];
+         }
+   free( *table);
+   *table = new_rval;
+   *n_alloced = (int)new_size;
+}
+
+/* Adds the observation in 'buff',  made at 'jd',  to the hash table of
+objects.  'line_offset' is where the line started in the file,  or -1 for
+NEOCP data (for which we need to start at the beginning of the file). */
+
+static void add_obs_to_object_table( OBJECT_INFO **table, int *n_alloced,
+            int *n, int *prev_loc, char *buff, const double jd,
+            const long line_offset)
+{
+   OBJECT_INFO *rval = *table;
+   int i, loc;
+   char *tptr;
+
+   if( *buff == '#')
+      *buff = ' ';           /* handle remarked-out lines,  too */
+   xref_designation( buff);
+   if( *prev_loc >= 0 &&
+                 !compare_desigs( rval[*prev_loc].packed_desig, buff))
+      loc = *prev_loc;
+   else
+      loc = find_in_hash_table( rval, buff, *n_alloced);
+   *prev_loc = loc;
+   buff[46] = '\0';
+   if( combine_all_observations && *n)
+      loc = 0;
+   else if( !rval[loc].packed_desig[0])   /* it's a new one */
+      {
+      memset( rval + loc, 0, sizeof( OBJECT_INFO));
+      memcpy( rval[loc].packed_desig, buff, 12);
+      rval[loc].jd_start = rval[loc].jd_end = jd;
+      rval[loc].jd_updated = jd;    /* at minimum */
+      if( line_offset >= 0)
+         {
+         rval[loc].file_offset = line_offset - 100;
+         if( (long)rval[loc].file_offset < 0)
+            rval[loc].file_offset = 0;
+         }
+      (*n)++;
+      }
+   rval[loc].n_obs++;
+   if( buff[14] == 'x' || buff[14] == 'X')   /* deleted observation */
+      rval[loc].solution_exists++;     /* ..flagged via soln exists */
+   if( rval[loc].jd_start > jd)
+      rval[loc].jd_start = jd;
+   if( rval[loc].jd_end < jd)
+      rval[loc].jd_end = jd;
+   if( rval[loc].jd_updated < jd)
+      rval[loc].jd_updated = jd;
+   i = 0;
+   tptr = rval[loc].mpc_codes;
+   while( tptr[i] && memcmp( tptr + i, buff + 77, 3))
+      i += 3;
+   if( i < 15)     /* new obscode for this object */
+      memcpy( tptr + i, buff + 77, 3);
+   if( !memcmp( buff + 72, "NEOCP", 5))
+      {
+      const double jd_u = get_neocp_update_jd( buff);
+
+      if( rval[loc].jd_updated < jd_u)
+         rval[loc].jd_updated = jd_u;
+      }
+   if( *n == *n_alloced - *n_alloced / 4)  /* table is 75% full */
+      {
+      grow_object_table( table, n_alloced);
+      *prev_loc = -1;
+      }
+}
+
+#ifdef PARALLEL_SCAN
+
+/* On *nix,  large files are split at line boundaries into pieces,  one
+per process (see SCAN_PROCESSES in 'environ.def').  Each piece is read
+by a forked process,  as is done in 'fo.cpp';  the cross-designation
+tables and such are thereby simply copied to each process.  Each writes
+its table of objects to a temporary file,  and those tables are merged in
+the order in which the pieces appear in the file.  So the file offset,
+and the first five MPC codes,  come from the first piece in which an object
+appears,  and we get exactly what we'd get reading straight through.
+
+   Some lines change how later lines are read :  "COM = " and "COM
+fullname" cross-designations,  '#Combine all',  '#ignore obs',  NEOCP
+ephemerides,  ADES and HTML.  Those are rare in the huge files where this
+matters.  If any turn up,  the parallel scan is abandoned and the file
+is read straight through,  as before.  */
+
+#define MIN_PARALLEL_SCAN_SIZE (64L << 20)
+#define MAX_SCAN_PROCESSES 64
+
+static bool needs_sequential_scan( const char *buff)
+{
+   if( *buff == '<' || strchr( buff, '|') || strstr( buff, "the geocenter")
+                    || strstr( buff, " observatory code "))
+      return( true);
+   if( *buff == '#')
+      {
+      size_t i = 1;            /* CSS-style artsat cross-desig */
+
+      while( isdigit( buff[i]))
+         i++;
+      if( i > 1 && i < 7 && !memcmp( buff + i, "U = ", 4))
+         return( true);
+      if( !memcmp( buff, "#= ", 3) || !memcmp( buff, "#fullname ", 10)
+                  || !memcmp( buff, "# version", 9)
+                  || !strcmp( buff, "#Combine all")
+                  || !strcmp( buff, "#ignore obs"))
+         return( true);
+      }
+   return( false);
+}
+
+/* Reads the lines from data[start] up to data[end] into the hash table
+of objects,  just as the loop in find_objects_in_file( ) would.  Returns
+the number of objects found,  or -1 if a line requiring a sequential scan
+was found. */
+
+static int scan_file_piece( const char *data, const size_t start,
+            const size_t end, const char *station, const int fixing,
+            OBJECT_INFO **table, int *n_alloced)
+{
+   char buff[550], mpc_code_from_neocp[4], desig_from_neocp[15];
+   size_t pos = start;
+   int n = 0, prev_loc = -1;
+
+   strcpy( mpc_code_from_neocp, "500");
+   *desig_from_neocp = '\0';
+   while( pos < end)
+      {
+      const char *eol = (const char *)memchr( data + pos, '\n', end - pos);
+      const size_t next_pos = (eol ? (size_t)( eol - data) + 1 : end);
+      size_t iline_len = next_pos - pos;
+      double jd = 0.;
+
+      while( iline_len && (data[pos + iline_len - 1] == '\n'
+                        || data[pos + iline_len - 1] == '\r'))
+         iline_len--;
+      if( iline_len >= sizeof( buff) - 1
+                        || memchr( data + pos, '\0', iline_len))
+         return( -1);
+      memcpy( buff, data + pos, iline_len);
+      buff[iline_len] = '\0';
+      convert_com_to_pound_sign( buff);
+      if( needs_sequential_scan( buff)
+               || get_neocp_data( buff, desig_from_neocp, mpc_code_from_neocp)
+               || *desig_from_neocp)
+         return( -1);
+      if( iline_len > MINIMUM_RWO_LENGTH)
+         rwo_to_mpc( buff, NULL, NULL, NULL, NULL, NULL);
+      if( fixing)
+         fix_up_mpc_observation( buff, &jd);
+      if( !jd)
+         jd = observation_jd( buff);
+      if( is_in_range( jd) && !is_second_line( buff))
+         if( !station || !memcmp( buff + 76, station, 3))
+            add_obs_to_object_table( table, n_alloced, &n, &prev_loc, buff,
+                                  jd, (long)pos);
+      pos = next_pos;
+      }
+   return( n);
+}
+
+/* Merges an object found in one piece of the file into the table. */
+
+static void merge_object_info( OBJECT_INFO **table, int *n_alloced, int *n,
+                               const OBJECT_INFO *obj)
+{
+   OBJECT_INFO *rval = *table;
+   const unsigned loc = find_in_hash_table( rval, obj->packed_desig,
+                                            (unsigned)*n_alloced);
+
+   if( !rval[loc].packed_desig[0])   /* it's a new one */
+      {
+      rval[loc] = *obj;
+      (*n)++;
+      if( *n == *n_alloced - *n_alloced / 4)  /* table is 75% full */
+         grow_object_table( table, n_alloced);
+      }
+   else
+      {
+      size_t i, j;
+      char *tptr = rval[loc].mpc_codes;
+
+      rval[loc].n_obs += obj->n_obs;
+      rval[loc].solution_exists += obj->solution_exists;
+      if( rval[loc].jd_start > obj->jd_start)
+         rval[loc].jd_start = obj->jd_start;
+      if( rval[loc].jd_end < obj->jd_end)
+         rval[loc].jd_end = obj->jd_end;
+      if( rval[loc].jd_updated < obj->jd_updated)
+         rval[loc].jd_updated = obj->jd_updated;
+      for( j = 0; obj->mpc_codes[j]; j += 3)
+         {
+         i = 0;
+         while( tptr[i] && memcmp( tptr + i, obj->mpc_codes + j, 3))
+            i += 3;
+         if( i < 15)     /* new obscode for this object */
+            memcpy( tptr + i, obj->mpc_codes + j, 3);
+         }
+      }
+}
+
+/* Returns the number of objects found,  or -1 if the file should be read
+sequentially (it's too small,  or has lines that must be read in order,
+or something went wrong).  In the latter case,  '*table' is left empty. */
+
+static int scan_file_in_parallel( FILE *ifile, const long filesize,
+            const char *station, const int fixing,
+            OBJECT_INFO **table, int *n_alloced)
+{
+   int n_processes = atoi( get_environment_ptr( "SCAN_PROCESSES"));
+   int i, n = 0, rval = 0;
+   const char *data;
+   size_t *starts;
+   pid_t *pids;
+   FILE **piece_files;
+   char buff[90];
+
+   if( n_processes <= 0)
+      n_processes = (int)sysconf( _SC_NPROCESSORS_ONLN);
+   if( n_processes > MAX_SCAN_PROCESSES)
+      n_processes = MAX_SCAN_PROCESSES;
+   if( n_processes < 2 || filesize < MIN_PARALLEL_SCAN_SIZE
+                       || combine_all_observations)
+      return( -1);
+   data = (const char *)mmap( NULL, (size_t)filesize, PROT_READ,
+                              MAP_PRIVATE, fileno( ifile), 0);
+   if( data == (const char *)MAP_FAILED)
+      return( -1);
+   starts = (size_t *)calloc( n_processes + 1, sizeof( size_t));
+   pids = (pid_t *)calloc( n_processes, sizeof( pid_t));
+   piece_files = (FILE **)calloc( n_processes, sizeof( FILE *));
+   starts[n_processes] = (size_t)filesize;
+   for( i = 1; i < n_processes; i++)
+      {                    /* break pieces at the start of a line */
+      size_t pos = (size_t)filesize / (size_t)n_processes * (size_t)i;
+      const char *eol;
+
+      if( pos < starts[i - 1])
+         pos = starts[i - 1];
+      eol = (const char *)memchr( data + pos, '\n', (size_t)filesize - pos);
+      starts[i] = (eol ? (size_t)( eol - data) + 1 : (size_t)filesize);
+      }
+   snprintf_err( buff, sizeof( buff), "Reading %.0f MBytes using %d processes",
+                  (double)filesize / 1048576., n_processes);
+   move_add_nstr( 3, 3, buff, -1);
+   refresh_console( );
+   memset( buff, ' ', 80);          /* ensure the cross-designation table */
+   buff[80] = '\0';                 /* is loaded before forking,  so each */
+   xref_designation( buff);         /* process doesn't load its own copy  */
+   for( i = 1; i < n_processes && !rval; i++)
+      {
+      piece_files[i] = tmpfile( );
+      pids[i] = (piece_files[i] ? fork( ) : -1);
+      if( pids[i] == -1)
+         {
+         perror( "fork");
+         rval = -1;
+         }
+      else if( !pids[i])     /* we're a child process */
+         {
+         int n_piece_alloced = 20, j;
+         OBJECT_INFO *piece = (OBJECT_INFO *)calloc( n_piece_alloced + 1,
+                                                     sizeof( OBJECT_INFO));
+         const int n_piece = scan_file_piece( data, starts[i], starts[i + 1],
+                                 station, fixing, &piece, &n_piece_alloced);
+
+         fwrite( &n_piece, sizeof( int), 1, piece_files[i]);
+         for( j = 0; n_piece > 0 && j < n_piece_alloced; j++)
+            if( piece[j].packed_desig[0])
+               fwrite( piece + j, sizeof( OBJECT_INFO), 1, piece_files[i]);
+         _exit( fclose( piece_files[i]) ? 1 : 0);
+         }
+      }
+   if( !rval)        /* the parent reads the first piece itself */
+      n = scan_file_piece( data, starts[0], starts[1], station, fixing,
+                                 table, n_alloced);
+   if( n < 0)
+      rval = -1;
+   for( i = 1; i < n_processes; i++)
+      if( pids[i] > 0)
+         {
+         int child_status, n_piece;
+
+         if( waitpid( pids[i], &child_status, 0) != pids[i]
+                  || !WIFEXITED( child_status) || WEXITSTATUS( child_status))
+            rval = -1;
+         rewind( piece_files[i]);
+         if( rval || fread( &n_piece, sizeof( int), 1, piece_files[i]) != 1
+                  || n_piece < 0)
+            rval = -1;
+         while( !rval && n_piece--)
+            {
+            OBJECT_INFO obj;
+
+            if( fread( &obj, sizeof( OBJECT_INFO), 1, piece_files[i]) != 1)
+               rval = -1;
+            else
+               merge_object_info( table, n_alloced, &n, &obj);
+            }
+         }
+   for( i = 1; i < n_processes; i++)
+      if( piece_files[i])
+         fclose( piece_files[i]);
+   munmap( (void *)data, (size_t)filesize);
+   free( starts);
+   free( pids);
+   free( piece_files);
+   if( rval)
+      {
+      debug_printf( "Reading file sequentially\n");
+      *n_alloced = 20;
+      free( *table);
+      *table = (OBJECT_INFO *)calloc( *n_alloced + 1, sizeof( OBJECT_INFO));
+      neocp_file_type = NEOCP_FILE_TYPE_UNKNOWN;
+      n = -1;
+      }
+   return( n);
+}
+#endif
+
+/* For large files (see OBJECT_INDEX_MBYTES in 'environ.def'),  the table
+of objects made by find_objects_in_file( ) is saved in a 'sidecar' file,
+named by appending '.fidx' to the file name.  fo,  find_orb,  and fo_serve
+all call find_objects_in_file( ) at startup;  on multi-GByte files,  that
+could take minutes.  On later runs,  the table is just read back.
+
+   The index is used only if its 'key' line matches :  the size and time
+of the file,  a hash of 64-KByte blocks at seventeen places in it (hashing
+all of it would take as long as reading it),  and the settings that affect
+which observations are found (station,  FIX_OBSERVATIONS,  date range,
+whether all observations are combined,  and the sizes and times of
+'xdesig.txt' and 'odd_name.txt',  which can change which observations
+belong to which object).  "COM =" cross-designations and
+"COM fullname" names found while reading the file are saved and re-applied,
+as is '#Combine all'.  The index is written to a temporary file which is
+then renamed,  so that a half-written index is never used.  If it can't be
+written (say,  the directory is read-only),  we just go on without it. */
+
+#define OBJECT_INDEX_HEADER      "Find_Orb object index 3"
+#define OBJECT_INDEX_BLOCK_SIZE  65536
+
+uint64_t fnv1a_hash( uint64_t hash, const char *buff, size_t n_bytes)
+{
+   while( n_bytes--)
+      hash = (hash ^ (uint64_t)(unsigned char)*buff++) * (uint64_t)0x100000001b3;
+   return( hash);
+}
+
+static bool get_object_index_key( char *key, const size_t max_len,
+            FILE *ifile, const char *filename, const long filesize,
+            const char *station, const int fixing)
+{
+   const double min_mbytes = atof( get_environment_ptr( "OBJECT_INDEX_MBYTES"));
+   uint64_t hash = (uint64_t)0xcbf29ce484222325;
+   struct stat st;
+   char *buff;
+   int i;
+
+   if( min_mbytes <= 0. || (double)filesize < min_mbytes * 1048576.
+                        || stat( filename, &st))
+      return( false);
+   buff = (char *)malloc( OBJECT_INDEX_BLOCK_SIZE);
+   for( i = 0; i <= 16; i++)
+      {
+      const long offset = (filesize > OBJECT_INDEX_BLOCK_SIZE ?
+              (long)( (double)( filesize - OBJECT_INDEX_BLOCK_SIZE) * (double)i / 16.) : 0L);
+
+      fseek( ifile, offset, SEEK_SET);
+      hash = fnv1a_hash( hash, buff,
+                    fread( buff, 1, OBJECT_INDEX_BLOCK_SIZE, ifile));
+      }
+   free( buff);
+   fseek( ifile, 0L, SEEK_SET);
+   snprintf_err( key, max_len, "%ld %ld %016llx %s %d %.1f %.1f %d",
+               filesize, (long)st.st_mtime, (unsigned long long)hash,
+               (station ? station : "-"), fixing,
+               minimum_observation_jd, maximum_observation_jd,
+               (combine_all_observations ? 1 : 0));
+   append_file_stamp( key, max_len, "xdesig.txt");
+   append_file_stamp( key, max_len, "odd_name.txt");
+   return( true);
+}
+
+static void save_object_index( const char *filename, const char *key,
+            const OBJECT_INFO *objs, const int n, const char *directives,
+            const bool combine_all)
+{
+   char index_name[PATH_MAX + 10], temp_name[PATH_MAX + 20];
+   FILE *ofile;
+   int i, err;
+
+   snprintf_err( index_name, sizeof( index_name), "%s.fidx", filename);
+   ofile = fopen( temp_file_name( temp_name, sizeof( temp_name), index_name),
+                                                   "wb");
+   if( !ofile)
+      return;
+   fprintf( ofile, "%s %d\n%s\n%d %d\n", OBJECT_INDEX_HEADER,
+                  (int)sizeof( OBJECT_INFO), key, n, combine_all ? 1 : 0);
+   for( i = 0; i < n; i++)
+      {
+      OBJECT_INFO obj = objs[i];
+
+      obj.obj_name = NULL;
+      fwrite( &obj, sizeof( OBJECT_INFO), 1, ofile);
+      }
+   fprintf( ofile, "%send\n", (directives ? directives : ""));
+   err = ferror( ofile);
+   if( fclose( ofile) || err)
+      remove( temp_name);
+   else
+      {
+#ifdef _WIN32
+      remove( index_name);       /* Windows won't rename over a file */
+#endif
+      if( rename( temp_name, index_name))
+         remove( temp_name);
+      }
+}
+
+/* Returns the number of objects read from the index,  or -1 if there's
+no usable index.  In the latter case,  '*table' is left alone.  */
+
+static int load_object_index( const char *filename, const char *key,
+            OBJECT_INFO **table, int *n_alloced)
+{
+   char index_name[PATH_MAX + 10], header[80], buff[200], *directives = NULL;
+   FILE *ifile;
+   OBJECT_INFO *objs = NULL;
+   int n = -1, combine_all;
+   size_t len = 0;
+   bool got_end = false;
+
+   snprintf_err( index_name, sizeof( index_name), "%s.fidx", filename);
+   ifile = fopen( index_name, "rb");
+   if( !ifile)
+      return( -1);
+   snprintf_err( header, sizeof( header), "%s %d\n", OBJECT_INDEX_HEADER,
+                                  (int)sizeof( OBJECT_INFO));
+   if( fgets( buff, sizeof( buff), ifile) && !strcmp( buff, header)
+            && fgets( buff, sizeof( buff), ifile)
+            && !memcmp( buff, key, strlen( key)) && buff[strlen( key)] == '\n'
+            && fgets( buff, sizeof( buff), ifile)
+            && 2 == sscanf( buff, "%d %d", &n, &combine_all) && n >= 0)
+      {
+      objs = (OBJECT_INFO *)calloc( n + 1, sizeof( OBJECT_INFO));
+      if( !objs || fread( objs, sizeof( OBJECT_INFO), n, ifile) != (size_t)n)
+         n = -1;
+      }
+   else
+      n = -1;
+   while( n >= 0 && !got_end && fgets( buff, sizeof( buff), ifile))
+      if( !strcmp( buff, "end\n"))
+         got_end = true;
+      else
+         {
+         const size_t new_len = strlen( buff);
+
+         directives = (char *)realloc( directives, len + new_len + 1);
+         strcpy( directives + len, buff);
+         len += new_len;
+         }
+   fclose( ifile);
+   if( !got_end)        /* truncated or otherwise unusable */
+      {
+      free( objs);
+      free( directives);
+      return( -1);
+      }
+   if( directives)
+      {
+      char *line = directives, *next;
+
+      while( (next = strchr( line, '\n')) != NULL)
+         {
+         *next = '\0';
+         if( *line == 'X')
+            xref_designation( line + 1);
+         else if( *line == 'N')
+            get_object_name( line + 1, NULL);
+         line = next + 1;
+         }
+      free( directives);
+      }
+   if( combine_all)
+      combine_all_observations = "";
+   free( *table);
+   *table = objs;
+   *n_alloced = n;
+   return( n);
+}
+
 /* find_objects_in_file( ) reads through the file of MPC astrometric data
    specified by 'filename',  and figures out which objects appear in that
    file.  Those objects can then be listed on the console (findorb) or
@@ -4330,7 +5251,11 @@ static bool fullname_pattern_matched( const char *full_name, const char *pattern
    to the new one,  and the old one is freed.
 
    When we're done,  the new table is sorted by name (this puts any blank
-   entries at the end of the table).   */
+   entries at the end of the table).
+
+   On *nix,  large files are instead read in pieces by several processes
+   at once;  see scan_file_in_parallel( ).  And if the file was read before,
+   the table may simply be read from an index;  see load_object_index( ). */
 
 
 OBJECT_INFO *find_objects_in_file( const char *filename,
@@ -4347,7 +5272,10 @@ OBJECT_INFO *find_objects_in_file( const char *filename,
    void *ades_context;
    const clock_t t0 = clock( );
    int next_output = 2000, n_obs_read = 0;
-   long filesize;
+   long filesize, line_start = 0L;
+   char index_key[200], *index_directives = NULL;
+   bool use_index, index_loaded;
+   const bool combining_at_start = (combine_all_observations != NULL);
 
    if( obj_name_stack)
       {
@@ -4377,7 +5305,23 @@ OBJECT_INFO *find_objects_in_file( const char *filename,
    if( debug_level > 8)
       debug_printf( "About to read input\n");
    ades_context = init_ades2mpc( );
-   while( fgets_with_ades_xlation( buff, sizeof( buff), ades_context, ifile))
+   use_index = get_object_index_key( index_key, sizeof( index_key), ifile,
+                  filename, filesize, station,
+                  fixing_trailing_and_leading_spaces);
+   n = (use_index ? load_object_index( filename, index_key,
+                                       &rval, &n_alloced) : -1);
+   index_loaded = (n >= 0);
+#ifdef PARALLEL_SCAN
+   if( n < 0)
+      n = scan_file_in_parallel( ifile, filesize, station,
+                  fixing_trailing_and_leading_spaces, &rval, &n_alloced);
+#endif
+   if( n >= 0)     /* file was read in parallel,  or we got it from the */
+      fseek( ifile, 0L, SEEK_END);   /* index;  skip the sequential loop */
+   else
+      n = 0;
+   while( (line_start = ftell( ifile)) >= 0L && fgets_with_ades_xlation(
+                              buff, sizeof( buff), ades_context, ifile))
       {
       size_t iline_len = strlen( buff);
       bool is_neocp = false;
@@ -4411,6 +5355,8 @@ OBJECT_INFO *find_objects_in_file( const char *filename,
             new_xdesig[i] = ' ';
          strcpy( new_xdesig + 26, new_xdesig_indicator);
          xref_designation( new_xdesig);
+         if( use_index)
+            add_tagged_line( &index_directives, 'X', new_xdesig);
          *new_xdesig = '\0';
          }
       if( jd && *new_name)    /* 'odd name' sort of xdesig */
@@ -4418,81 +5364,15 @@ OBJECT_INFO *find_objects_in_file( const char *filename,
          memcpy( new_name, buff, 12);
          new_name[12] = ' ';
          get_object_name( new_name, NULL);
+         if( use_index)
+            add_tagged_line( &index_directives, 'N', new_name);
          *new_name = '\0';
          }
       if( is_in_range( jd) && !is_second_line( buff))
          if( !station || !memcmp( buff + 76, station, 3))
             {
-            int loc;
-            char *tptr;
-
-            if( *buff == '#')
-               *buff = ' ';           /* handle remarked-out lines,  too */
-            xref_designation( buff);
-            if( prev_loc >= 0 &&
-                          !compare_desigs( rval[prev_loc].packed_desig, buff))
-               loc = prev_loc;
-            else
-               loc = find_in_hash_table( rval, buff, n_alloced);
-            prev_loc = loc;
-            buff[46] = '\0';
-            if( combine_all_observations && n)
-               loc = 0;
-            else if( !rval[loc].packed_desig[0])   /* it's a new one */
-               {
-               memset( rval + loc, 0, sizeof( OBJECT_INFO));
-               memcpy( rval[loc].packed_desig, buff, 12);
-               rval[loc].jd_start = rval[loc].jd_end = jd;
-               rval[loc].jd_updated = jd;    /* at minimum */
-               if( !is_neocp)   /* for NEOCP obs,  we need to start at the */
-                  {                             /* beginning of the file  */
-                  rval[loc].file_offset = ftell( ifile) - (long)iline_len
-                                       - 100;
-                  if( (long)rval[loc].file_offset < 0)
-                     rval[loc].file_offset = 0;
-                  }
-               n++;
-               }
-            rval[loc].n_obs++;
-            if( buff[14] == 'x' || buff[14] == 'X')   /* deleted observation */
-               rval[loc].solution_exists++;     /* ..flagged via soln exists */
-            if( rval[loc].jd_start > jd)
-               rval[loc].jd_start = jd;
-            if( rval[loc].jd_end < jd)
-               rval[loc].jd_end = jd;
-            if( rval[loc].jd_updated < jd)
-               rval[loc].jd_updated = jd;
-            i = 0;
-            tptr = rval[loc].mpc_codes;
-            while( tptr[i] && memcmp( tptr + i, buff + 77, 3))
-               i += 3;
-            if( i < 15)     /* new obscode for this object */
-               memcpy( tptr + i, buff + 77, 3);
-            if( !memcmp( buff + 72, "NEOCP", 5))
-               {
-               const double jd_u = get_neocp_update_jd( buff);
-
-               if( rval[loc].jd_updated < jd_u)
-                  rval[loc].jd_updated = jd_u;
-               }
-            if( n == n_alloced - n_alloced / 4)  /* table is 75% full; */
-               {                       /* reallocate & move everything */
-               const unsigned new_size = n_alloced * 2 - 1;
-               OBJECT_INFO *new_rval = (OBJECT_INFO *)calloc(
-                                 new_size, sizeof( OBJECT_INFO));
-
-               for( i = 0; i < n_alloced; i++)
-                  if( rval[i].packed_desig[0])
-                     {
-                     const unsigned new_loc = find_in_hash_table( new_rval,
-                                   rval[i].packed_desig, new_size);
-                     new_rval[new_loc] = rval[i];
-                     }
-               free( rval);
-               rval = new_rval;
-               n_alloced = new_size;
-               prev_loc = -1;
-               }
+            add_obs_to_object_table( &rval, &n_alloced, &n, &prev_loc, buff,
+                     jd, (is_neocp ? -1L : line_start));
             n_obs_read++;
             if( n_obs_read == next_output)
                {
@@ -4559,6 +5439,10 @@ OBJECT_INFO *find_objects_in_file( const char *filename,
       if( rval[i].packed_desig[0])
          rval[n++] = rval[i];
    assert( n == *n_found);
+   if( use_index && !index_loaded)
+      save_object_index( filename, index_key, rval, n, index_directives,
+                  combine_all_observations && !combining_at_start);
+   free( index_directives);
    if( desig_pattern)
       {
       i = 0;
@@ -4648,6 +5532,14 @@ static char **edata = NULL;
 static size_t n_lines = 0, n_lines_allocated = 0;
 static bool is_default_environment = false;
 
+/* Incremented whenever the environment settings change (or are freed,
+and may therefore be reloaded with new values).  Code that caches values
+derived from settings can compare this to the value it saw when it built
+the cache,  instead of looking up and parsing the settings every time;
+see detect_perturbers() in 'bc405.cpp'.   */
+
+unsigned environment_generation = 1;
+
 int write_environment_pointers( void)
 {
    FILE *ofile = fopen_ext( "env.txt", "fcw");
@@ -4704,6 +5596,7 @@ const char *get_environment_ptr( const char *env_ptr)
          free( edata);
          }
       edata = NULL;
+      environment_generation++;
       return( NULL);
       }
    if( !edata)
@@ -4738,6 +5631,85 @@ void set_environment_ptr( const char *env_ptr, const char *new_value)
    strcpy( edata[idx], env_ptr);
    strcat( edata[idx], "=");
    strcat( edata[idx], new_value);
+   environment_generation++;
+}
+
+/* Returns the settings from 'environ.dat' that are used on 'hot paths',
+already parsed (see 'mpc_obs.h').  If the settings have changed since the
+snapshot was last made,  a new one is made in the other of two buffers,
+and then made current;  so a pointer to a snapshot stays valid (and
+unchanging) until the settings change twice.  Once made,  a snapshot is
+only read,  so worker threads can share it (see integrate_orbits_in_threads()
+in 'orb_func.cpp').  Making a new snapshot is done under a lock,  so that
+two threads asking for the first one at once don't both build it.  The
+settings themselves should still only be changed while no threads run.
+THREAD_SAFE_ENVIRONMENT is defined on the same platforms as
+INTEGRATE_IN_THREADS in 'orb_func.cpp'.   */
+
+#ifdef THREAD_SAFE_ENVIRONMENT
+   static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+   #define LOAD_SNAPSHOT_PTR( p)      __atomic_load_n( &p, __ATOMIC_ACQUIRE)
+   #define STORE_SNAPSHOT_PTR( p, v)  __atomic_store_n( &p, v, __ATOMIC_RELEASE)
+   #define LOCK_SNAPSHOT( )           pthread_mutex_lock( &snapshot_mutex)
+   #define UNLOCK_SNAPSHOT( )         pthread_mutex_unlock( &snapshot_mutex)
+#else          /* no threads on other platforms */
+   #define LOAD_SNAPSHOT_PTR( p)      (p)
+   #define STORE_SNAPSHOT_PTR( p, v)  p = v
+   #define LOCK_SNAPSHOT( )
+   #define UNLOCK_SNAPSHOT( )
+#endif
+
+const environment_snapshot_t *get_environment_snapshot( void)
+{
+   static environment_snapshot_t snapshots[2];
+   static const environment_snapshot_t *curr = NULL;
+   const environment_snapshot_t *rval = LOAD_SNAPSHOT_PTR( curr);
+
+   if( rval && rval->generation == environment_generation)
+      return( rval);
+   LOCK_SNAPSHOT( );
+   if( !curr || curr->generation != environment_generation)
+      {
+      environment_snapshot_t *snap = snapshots + (curr == snapshots ? 1 : 0);
+
+      snap->encke = atoi( get_environment_ptr( "ENCKE"));
+      snap->dense_output = atoi( get_environment_ptr( "DENSE_OUTPUT"));
+      snap->double_integration = atoi( get_environment_ptr( "DOUBLE_INTEGRATION"));
+      snap->batch_integration = atoi( get_environment_ptr( "BATCH_INTEGRATION"));
+      snap->geo_terms = atoi( get_environment_ptr( "GEO_TERMS"));
+      if( !snap->geo_terms)
+         snap->geo_terms = 3;
+      snap->fixed_stepsize = atof( get_environment_ptr( "FIXED_STEPSIZE"));
+      snap->min_stepsize = atof( get_environment_ptr( "MIN_STEPSIZE"))
+                                             / seconds_per_day;
+      if( !snap->min_stepsize)
+         snap->min_stepsize = 1e-5;   /* 1e-5 day = 0.864 seconds */
+      snap->sigma_multiplier = atof( get_environment_ptr( "SIGMA_MULTIPLIER"));
+      snap->galactic_addendum = atof( get_environment_ptr( "GALACTIC_ADDENDUM"));
+      snap->exposure_time = atof( get_environment_ptr( "EXPTIME"));
+      snap->target_snr = atof( get_environment_ptr( "SNR"));
+      snap->drag_shutoff = (*get_environment_ptr( "DRAG_SHUTOFF") == '1');
+      snap->disable_light_bending =
+                        (*get_environment_ptr( "DISABLE_LIGHT_BENDING") != '\0');
+      snap->no_lunar_eclipses =
+                        (*get_environment_ptr( "NO_LUNAR_ECLIPSES") != '\0');
+      snap->geometric_ground_track =
+                        (*get_environment_ptr( "GEOMETRIC_GROUND_TRACK") == '1');
+#ifdef _WIN32
+      snap->counters_wanted =
+                  strcmp( get_environment_ptr( "WIN_JSON_COUNTERS_NAME"), "none");
+#else
+      snap->counters_wanted =
+                  strcmp( get_environment_ptr( "JSON_COUNTERS_NAME"), "none");
+#endif
+               /* Loading the environment (on the first lookup) bumps the */
+               /* generation,  so we record it only after the lookups :   */
+      snap->generation = environment_generation;
+      STORE_SNAPSHOT_PTR( curr, snap);
+      }
+   rval = curr;
+   UNLOCK_SNAPSHOT( );
+   return( rval);
 }
 
 static int load_json_environment_file( const char *buff)
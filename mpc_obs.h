@@ -17,24 +17,31 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
 
 #define OBSERVE struct observe
 
+/* The fields used on every pass through the observations while fitting
+orbits (set_locs( ),  residuals,  weights,  n_nearby_obs( )) come first,
+so that for each observation,  they're in about three cache lines;  the
+text and other fields used mostly in loading and output come after them.
+(Several functions rely on 'ra' and 'dec' being adjacent,  as a DPT.)  */
+
 OBSERVE
    {
-   double jd, obs_posn[3], obs_vel[3], vect[3], ra, dec, obs_mag;
-   double r,  obj_posn[3], obj_vel[3], solar_r, computed_ra, computed_dec;
+   double jd, ra, dec, computed_ra, computed_dec;
    double posn_sigma_1, posn_sigma_2;         /* in arcseconds */
             /* Usually, posn_sigma_1 = RA sigma, posn_sigma_2 = dec sigma. */
    double posn_sigma_theta;   /* tilt angle of uncertainty ellipse */
-   double mag_sigma;
    double time_sigma;         /* in days */
-   double computed_mag;
-   double ra_bias, dec_bias;     /* in arcseconds */
-   char *second_line;
+   double obs_posn[3], vect[3], obj_posn[3], obj_vel[3], r, solar_r;
    int flags, is_included;
+   char mpc_code[4], note1, note2;
+            /* ...end of the 'hot' fields */
+   double obs_vel[3], obs_mag, computed_mag, mag_sigma;
+   double ra_bias, dec_bias;     /* in arcseconds */
    int ref_center;       /* 399 = geocenter, 10 = heliocenter, 0 = SSB... */
    int time_precision, ra_precision, dec_precision, mag_precision;
-   char mpc_code[4], packed_id[13], reference[6];
+   char packed_id[13], reference[6];
    char columns_57_to_65[10];
-   char mag_band, astrometric_net_code, discovery_asterisk, note1, note2, satellite_obs;
+   char mag_band, astrometric_net_code, discovery_asterisk, satellite_obs;
+   char *second_line;
    const char **obs_details;
    char *ades_ids;
    };
@@ -96,6 +103,12 @@ orbit;  i.e.,  we could have a 12x12 covariance matrix. */
 
 #define MAX_N_NONGRAV_PARAMS 6
 #define MAX_N_PARAMS 12
+
+/* When integrating the variational equations along with the orbit,  we
+carry the orbital parameters plus six partial derivatives (of position
+and velocity) for each parameter;  see 'runge.cpp'.  */
+
+#define MAX_N_INTEGRATED_VALS (MAX_N_PARAMS * 7)
 #define ORBIT_CENTER_AUTO  -2
 
 typedef uint64_t ephem_option_t;
@@ -260,6 +273,8 @@ int ephemeris_in_a_file_from_mpc_code( const char *filename,
 int find_best_fit_planet( const double jd, const double *ivect,
                      double *rel_vect);     /* runge.cpp */
 int integrate_orbit( double *orbit, const double t0, const double t1);
+int integrate_orbits( double *orbits, const int n_orbits, const double t0,
+                                  const double t1);
 int generate_obs_text( const OBSERVE FAR *obs, const int n_obs, char *buff,
                                           const size_t buffsize);
 double convenient_gauss( const OBSERVE FAR *obs, int n_obs, double *orbit,
@@ -489,6 +504,25 @@ bool is_inverse_square_force_model( void);
 
 const char *find_orb_version_jd( double *jd);
 
+/* Settings used on 'hot paths' (in the integrator,  or for each line of an
+ephemeris) are parsed from the environment into the following,  so those
+paths needn't look up and parse strings each time.  The snapshot is rebuilt
+when settings change (see get_environment_snapshot() in 'mpc_obs.cpp'). */
+
+typedef struct
+{
+   unsigned generation;
+   int encke, dense_output, geo_terms, double_integration;
+   int batch_integration;
+   double fixed_stepsize, min_stepsize;         /* both in days */
+   double sigma_multiplier, galactic_addendum;
+   double exposure_time, target_snr;
+   bool drag_shutoff, disable_light_bending, no_lunar_eclipses;
+   bool geometric_ground_track, counters_wanted;
+} environment_snapshot_t;
+
+const environment_snapshot_t *get_environment_snapshot( void);
+
       /* In the console version of Find_Orb,  the following two functions */
       /* get remapped to Curses functions.  In the non-interactive one,   */
       /* they're mapped to 'do-nothings'.  See fo.cpp & find_orb.cpp.     */
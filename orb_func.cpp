@@ -23,6 +23,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
 #include <stdbool.h>
 #include <assert.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <time.h>
 #include "watdefs.h"
 #include "stringex.h"
@@ -35,11 +36,17 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
 #include "monte0.h"
 #include "pl_cache.h"
 #include "constant.h"
+#include "integrat.h"
 
 #ifndef _WIN32
    #include <unistd.h>
 #endif
 
+#if defined( __linux) || defined( __unix__) || defined( __APPLE__)
+   #define INTEGRATE_IN_THREADS
+   #include <pthread.h>
+#endif
+
 /* MS only got around to adding 'isfinite' in VS2013 : */
 
 #if defined( _MSC_VER) && (_MSC_VER < 1800)
@@ -94,6 +101,7 @@ int set_locs( const double *orbit, double t0, OBSERVE FAR *obs, int n_obs);
 int find_best_fit_planet( const double jd, const double *ivect,
                                  double *rel_vect);         /* runge.cpp */
 const char *get_environment_ptr( const char *env_ptr);     /* mpc_obs.cpp */
+void set_environment_ptr( const char *env_ptr, const char *new_value);
 static int evaluate_limited_orbit( const double *orbit,
                     const int planet_orbiting, const double epoch,
                     const char *limited_orbit, double *constraints);
@@ -139,6 +147,9 @@ void rotate_state_vector_to_current_frame( double *state_vect,
                   char *body_frame_note);               /* elem_out.cpp */
 const char *get_find_orb_text( const int index);      /* elem_out.cpp */
 void set_obs_vect( OBSERVE FAR *obs);        /* mpc_obs.h */
+int64_t nanoseconds_since_1970( void);                      /* nanosecs.c */
+int earth_lunar_posn( const double jd, double FAR *earth_loc,
+                                 double FAR *lunar_loc);   /* mpc_obs.cpp */
 double improve_along_lov( double *orbit, const double epoch, const double *lov,
           const unsigned n_params, unsigned n_obs, OBSERVE *obs);
 void adjust_error_ellipse_for_timing_error( double *sigma_a, double *sigma_b,
@@ -310,16 +321,12 @@ int find_parabolic_orbit( OBSERVE FAR *obs, const int n_obs,
 
 int calc_derivatives( const double jd, const double *ival, double *oval,
                            const int reference_planet);
-long double take_rk_stepl( const long double jd, ELEMENTS *ref_orbit,
-                 const long double *ival, long double *ovals,
-                 const int n_vals, const long double step);     /* runge.cpp */
-long double take_pd89_step( const long double jd, ELEMENTS *ref_orbit,
-                 const long double *ival, long double *ovals,
-                 const int n_vals, const long double step);    /* runge.cpp */
+int calc_derivativesl( const long double jd, const long double *ival,
+                 long double *oval, const int reference_planet);
 int symplectic_6( double jd, ELEMENTS *ref_orbit, double *vect,
                                           const double dt);
 static int is_unreasonable_orbit( const double *orbit);     /* orb_func.cpp */
-static int is_unreasonable_orbitl( const long double *orbit);
+static int is_unreasonable_orbit( const long double *orbit);
 
 double integration_tolerance = 1.e-12;
 double minimum_jd = 77432.5;      /* 1 Jan -4500 */
@@ -331,7 +338,8 @@ int show_runtime_messages = 1;
 static unsigned perturbers_automatically_found;
 extern unsigned always_included_perturbers;
 
-static int reset_auto_perturbers( const double jd, const double *orbit)
+static int reset_auto_perturbers_ctx( INTEGRATION_CONTEXT *ctx,
+                     const double jd, const double *orbit)
 {
    extern int forced_central_body;     /* and include asteroid perts   */
    unsigned mask;
@@ -346,15 +354,27 @@ static int reset_auto_perturbers( const double jd, const double *orbit)
    if( forced_central_body == 100)
       mask |= (1 << 20);
    if( perturbing_planet)
-      perturbers_automatically_found |= mask;
+      ctx->perturbers_automatically_found |= mask;
    if( forced_central_body == 100)
-      perturbers_automatically_found |= (1 << 20);
-   if( perturbers & AUTOMATIC_PERTURBERS)
-      perturbers = mask | AUTOMATIC_PERTURBERS;
-   perturbers |= always_included_perturbers;
+      ctx->perturbers_automatically_found |= (1 << 20);
+   if( ctx->perturbers & AUTOMATIC_PERTURBERS)
+      ctx->perturbers = mask | AUTOMATIC_PERTURBERS;
+   ctx->perturbers |= always_included_perturbers;
    return( perturbing_planet);
 }
 
+static int reset_auto_perturbers( const double jd, const double *orbit)
+{
+   INTEGRATION_CONTEXT *ctx = default_integration_context( );
+   int rval;
+
+   ctx->perturbers_automatically_found = 0;
+   rval = reset_auto_perturbers_ctx( ctx, jd, orbit);
+   perturbers = ctx->perturbers;
+   perturbers_automatically_found |= ctx->perturbers_automatically_found;
+   return( rval);
+}
+
 clock_t integration_timeout = (clock_t)0;
 
 #define STEP_INCREMENT 2
@@ -375,29 +395,92 @@ static void ldouble_to_double( double *ovals, const long double *ivals,
       *ovals++ = (double)*ivals++;
 }
 
-int integrate_orbitl( long double *orbit, const long double t0, const long double t1)
+template <typename T1, typename T2>
+static void copy_state( T1 *ovals, const T2 *ivals, size_t n)
 {
-   long double stepsize = 2.;
-   static long double fixed_stepsize = -1.;
-   const long double chicken = .9;
+   while( n--)
+      *ovals++ = (T1)*ivals++;
+}
+
+static inline double ceil_t( const double x)        { return( ceil( x)); }
+static inline long double ceil_t( const long double x) { return( ceill( x)); }
+
+/* integration_method = 0 uses Runge-Kutta-Fehlberg steps,  1 uses PD89
+(eighth-order Prince-Dormand),  and 2 Gauss-Radau (see take_radau_step() in
+'runge.cpp').  In each case,  we get an error estimate for the step,  which
+is proportional to the step size raised to the following power.  So if
+the error is less than the tolerance divided by 2^(that power),  we can
+double the step size.
+
+   The Gauss-Radau integrator is meant for long arcs and close approaches.
+Its error estimate is a good predictor of what step size would work.  So
+when a step is rejected,  we cut the step size by as many factors of two
+(up to four) as that estimate says are needed,  instead of halving it
+and trying again.  That saves a lot of rejected steps (each of which costs
+fifteen or so derivative evaluations) when an object is entering a
+planet's sphere of influence.        */
+
+static double error_order( const int method)
+{
+   const double orders[3] = { 5., 9., 8. };
+
+   return( method >= 0 && method <= 2 ? orders[method] : 5.);
+}
+
+/* integrate_orbit_ctx() integrates 'orbit' from t0 to t1.  If n_times
+is non-zero,  it also computes state vectors (position and velocity only)
+for each of the n_times times[],  storing them at ostates[0...5],
+ostates[6...11],  etc.  The times[] must lie between t0 and t1,  ordered in
+the direction of integration.  These intermediate states are interpolated
+within the steps the integrator takes anyway;  see the comments about
+'dense output' in runge.cpp.
+
+   If n_partials is non-zero,  the variational equations for the first
+n_partials parameters are integrated as well.  In that case,  'orbit'
+has the n_orbit_params parameters followed by six partials (of position
+and velocity) for each parameter,  and the caller must initialize the
+latter.  Each output state then has those 6 * n_partials values after
+its position and velocity.
+
+   Everything the integration changes (perturbers found along the way,
+planet_hit,  the planet position cache,  etc.) is kept in 'ctx',  so
+several orbits can be integrated at once in different threads,  each
+with its own context.  Only the default context shows progress on the
+console.   */
+
+template <typename T>
+static int integrate_orbit_t( INTEGRATION_CONTEXT *ctx, T *orbit,
+            const T t0, const T t1, const int n_times,
+            const double *times, double *ostates, const int n_partials)
+{
+   T stepsize = 2.;
+   const environment_snapshot_t *settings = get_environment_snapshot( );
+   const T fixed_stepsize = (T)settings->fixed_stepsize;
+   const T chicken = .9;
    int reset_of_elements_needed = 1;
-   const long double step_increase = chicken * integration_tolerance
-                 / powl( STEP_INCREMENT, (integration_method ? 9. : 5.));
-   static int use_encke = -1;
-   long double t = t0;
+   const T step_increase = chicken * integration_tolerance
+                 / powl( STEP_INCREMENT, error_order( integration_method));
+   const int use_encke = settings->encke;
+   T t = t0;
    static time_t real_time = (time_t)0;
-   long double prev_t = t, last_err = 0.;
+   T prev_t = t, last_err = 0.;
    int n_rejects = 0, rval;
-   unsigned saved_perturbers = perturbers;
+   unsigned saved_perturbers = ctx->perturbers;
    int n_steps = 0, prev_n_steps = 0;
    int going_backward = (t1 < t0);
    static int n_changes;
    ELEMENTS ref_orbit;
-
-   assert( fabsl( t0) < 1e+9);
-   assert( fabsl( t1) < 1e+9);
-   if( use_encke == -1)
-      use_encke = atoi( get_environment_ptr( "ENCKE"));
+   T derivs0[MAX_N_INTEGRATED_VALS], derivs1[MAX_N_INTEGRATED_VALS];
+   int derivs_central_obj = -2, n_times_done = 0;
+   unsigned derivs_perturbers = 0;
+   const int n_vals = (n_partials ? ctx->n_orbit_params + 6 * n_partials
+                                  : 6);
+   const int ostate_size = 6 + 6 * n_partials;
+   const bool show_progress = (show_runtime_messages && !ctx->planet_cache);
+   int64_t t_start;
+
+   assert( fabs_t( t0) < 1e+9);
+   assert( fabs_t( t1) < 1e+9);
    if( t0 > maximum_jd || t1 > maximum_jd
                        || t0 < minimum_jd || t0 < minimum_jd)
       {
@@ -410,53 +493,58 @@ int integrate_orbitl( long double *orbit, const long double t0, const long doubl
       }
    if( debug_level > 7)
       debug_printf( "Integrating %f to %f\n", (double)t0, (double)t1);
-   rval = is_unreasonable_orbitl( orbit);
+   rval = is_unreasonable_orbit( orbit);
    if( rval)
       {
       debug_printf( "Unreasonable %d\n", rval);
       return( -1);
       }
+   t_start = nanoseconds_since_1970( );
    ref_orbit.central_obj = -1;
-   if( fixed_stepsize < 0.)
-      fixed_stepsize = (long double)atof( get_environment_ptr( "FIXED_STEPSIZE"));
    if( fixed_stepsize > 0.)
       stepsize = fixed_stepsize;
    if( going_backward)
       stepsize = -stepsize;
+   while( n_times_done < n_times && times[n_times_done] == t0)
+      {
+      double *optr = ostates + ostate_size * n_times_done;
+
+      copy_state( optr, orbit, 6);
+      copy_state( optr + 6, orbit + ctx->n_orbit_params,
+                                                6 * n_partials);
+      n_times_done++;
+      }
+   ctx->n_variational_eqns = n_partials;
    while( t != t1 && !rval)
       {
-      long double delta_t, new_t = ceill( (t - .5) / stepsize + .5) * stepsize + .5;
+      T delta_t, new_t = ceil_t( (t - .5) / stepsize + .5) * stepsize + .5;
       double dorbit[MAX_N_PARAMS];
       bool step_taken = true;
 
-      ldouble_to_double( dorbit, orbit, n_orbit_params);
-      reset_auto_perturbers( t, dorbit);
+      copy_state( dorbit, orbit, ctx->n_orbit_params);
+      reset_auto_perturbers_ctx( ctx, t, dorbit);
       if( reset_of_elements_needed || !(n_steps % 50))
          if( use_encke)
             {
-            extern int best_fit_planet;
-
-            find_relative_orbit( t, dorbit, &ref_orbit, best_fit_planet);
+            find_relative_orbit_ctx( ctx, t, dorbit, &ref_orbit,
+                                          ctx->best_fit_planet);
             reset_of_elements_needed = 0;
             }
       n_steps++;
-      if( !(n_steps % 500) && show_runtime_messages && time( NULL) != real_time)
+      if( !(n_steps % 500) && show_progress && time( NULL) != real_time)
          {
          char buff[80];
-         extern int best_fit_planet, n_posns_cached;
-         extern int64_t planet_ns;
-         extern double best_fit_planet_dist;
-#ifdef TEST_PLANET_CACHING_HASH_FUNCTION
-         extern long total_n_searches, total_n_probes, max_probes_required;
-#endif
+         extern int n_posns_cached;
+         const INTEGRATION_COUNTERS *counters = &ctx->counters;
+         const int64_t planet_ns = counters->planet_ns;
 
          if( runtime_message)
             move_add_nstr( 9, 10, runtime_message, -1);
          snprintf_err( buff, sizeof( buff), "t = %.5f; %.5f to %.5f; step ",
                  (double)JD_TO_YEAR( t), (double)JD_TO_YEAR( t0), (double)JD_TO_YEAR( t1));
-         if( fabsl( stepsize) > .1)
+         if( fabs_t( stepsize) > .1)
             snprintf_append( buff, sizeof( buff), "%.3f   ", (double)stepsize);
-         else if( fabsl( stepsize) > .91)
+         else if( fabs_t( stepsize) > .91)
             snprintf_append( buff, sizeof( buff), "%.3fm   ",
                                           (double)stepsize * minutes_per_day);
          else
@@ -476,11 +564,12 @@ int integrate_orbitl( long double *orbit, const long double t0, const long doubl
          prev_t = t;
          move_add_nstr( 11, 10, buff, -1);
          snprintf_err( buff, sizeof( buff), "%d steps; %d rejected", n_steps, n_rejects);
-         if( best_fit_planet_dist)
+         if( ctx->best_fit_planet_dist)
             {
             snprintf_append( buff, sizeof( buff), "; center %d, ",
-                            best_fit_planet);
-            format_dist_in_buff( buff + strlen( buff), best_fit_planet_dist);
+                            ctx->best_fit_planet);
+            format_dist_in_buff( buff + strlen( buff),
+                            ctx->best_fit_planet_dist);
             }
          if( planet_ns)
             snprintf_append( buff, sizeof( buff), "  tp:%ld.%09ld",
@@ -504,16 +593,16 @@ int integrate_orbitl( long double *orbit, const long double t0, const long doubl
          snprintf_err( buff, sizeof( buff), "Vel: %11.6f %11.6f %11.6f",
                      dorbit[3], dorbit[4], dorbit[5]);
          move_add_nstr( 15, 10, buff, -1);
-#ifdef TEST_PLANET_CACHING_HASH_FUNCTION
-         if( total_n_searches)
+         if( counters->cache_hits + counters->cache_misses)
             {
+            const long n_searches = counters->cache_hits + counters->cache_misses;
+
             snprintf_err( buff, sizeof( buff), "%ld searches; avg %.2f max %ld     ",
-                            total_n_searches,
-                            (double)total_n_probes / (double)total_n_searches,
-                            max_probes_required);
+                            n_searches,
+                            (double)counters->cache_probes / (double)n_searches,
+                            counters->max_probes);
             move_add_nstr( 16, 10, buff, -1);
             }
-#endif
          refresh_console( );
          }
 
@@ -533,29 +622,66 @@ int integrate_orbitl( long double *orbit, const long double t0, const long doubl
          case 0:
          default:
             {
-            long double new_vals[MAX_N_PARAMS];
-            static long double min_stepsize;
-            const double err = (integration_method ?
-                   take_pd89_step( t, &ref_orbit, orbit, new_vals, 6, delta_t) :
-                   take_rk_stepl( t, &ref_orbit, orbit, new_vals, 6, delta_t));
-
-            if( !min_stepsize)
-               {
-               min_stepsize = (long double)atof( get_environment_ptr( "MIN_STEPSIZE"))
-                                             / seconds_per_day;
-               if( !min_stepsize)
-                  min_stepsize = 1e-5;   /* 1e-5 day = 0.864 seconds */
+            T new_vals[MAX_N_INTEGRATED_VALS];
+            const T min_stepsize = (T)settings->min_stepsize;
+            const T *initial_derivs = NULL;
+            double err;
+
+            if( n_times)         /* derivs at start of step are needed for */
+               {                 /* interpolation;  they may be left over  */
+                                 /* from the end of the previous step      */
+               if( derivs_central_obj != ref_orbit.central_obj
+                           || derivs_perturbers != ctx->perturbers)
+                  {
+                  calc_derivatives_ctx( ctx, t, orbit, derivs0,
+                                             ref_orbit.central_obj);
+                  derivs_central_obj = ref_orbit.central_obj;
+                  derivs_perturbers = ctx->perturbers;
+                  }
+               initial_derivs = derivs0;
                }
+            if( integration_method == 2)
+               err = (double)take_radau_step( ctx, t, &ref_orbit, orbit,
+                                 new_vals, n_vals, delta_t, initial_derivs);
+            else
+               err = (double)( integration_method ?
+                   take_pd89_step( ctx, t, &ref_orbit, orbit, new_vals,
+                                          n_vals, delta_t, initial_derivs) :
+                   take_rk_step( ctx, t, &ref_orbit, orbit, new_vals,
+                                          n_vals, delta_t, initial_derivs));
+
             if( !stepsize)
                exit( -6);
             if( err < integration_tolerance || fixed_stepsize > 0.
                         || fabs( stepsize) < min_stepsize)  /* it's good! */
                {
-               memcpy( orbit, new_vals, n_orbit_params * sizeof( long double));
+               if( n_times)
+                  {
+                  calc_derivatives_ctx( ctx, new_t, new_vals, derivs1,
+                                             ref_orbit.central_obj);
+                  while( n_times_done < n_times
+                           && (times[n_times_done] - new_t) * delta_t <= 0.)
+                     {
+                     T tstate[6 + 6 * MAX_N_PARAMS];
+
+                     dense_output_interpolate( ctx, &ref_orbit, t, orbit, derivs0,
+                              new_vals, derivs1, delta_t,
+                              (T)times[n_times_done], tstate,
+                              n_partials);
+                     copy_state( ostates + ostate_size * n_times_done,
+                              tstate, ostate_size);
+                     n_times_done++;
+                     }
+                  memcpy( derivs0, derivs1, n_vals * sizeof( T));
+                  }
+               memcpy( orbit, new_vals,
+                        (n_partials ? n_vals : ctx->n_orbit_params)
+                                             * sizeof( T));
                if( err < step_increase && !fixed_stepsize)
-                  if( fabsl( delta_t - stepsize) < fabsl( stepsize * .01))
+                  if( fabs_t( delta_t - stepsize) < fabs_t( stepsize * .01))
                      {
-                     n_changes++;
+                     if( show_progress)
+                        n_changes++;
                      stepsize *= STEP_INCREMENT;
                      }
                }
@@ -565,6 +691,18 @@ int integrate_orbitl( long double *orbit, const long double t0, const long doubl
                step_taken = false;
                new_t = t;
                stepsize /= STEP_INCREMENT;
+               if( integration_method == 2)   /* see below */
+                  {
+                  double excess = err / integration_tolerance;
+                  int n_halvings = 1;
+
+                  while( n_halvings < 4 && (excess /= pow( STEP_INCREMENT,
+                                 error_order( integration_method))) > 1.)
+                     {
+                     n_halvings++;
+                     stepsize /= STEP_INCREMENT;
+                     }
+                  }
                reset_of_elements_needed = 1;
                }
             last_err = err;
@@ -572,7 +710,7 @@ int integrate_orbitl( long double *orbit, const long double t0, const long doubl
             break;
          }
       t = new_t;
-      rval = is_unreasonable_orbitl( orbit);
+      rval = is_unreasonable_orbit( orbit);
       if( rval)
          {
          debug_printf( "Unreasonable %d at %.5g (%.5f to %.5f)\n",
@@ -586,13 +724,9 @@ int integrate_orbitl( long double *orbit, const long double t0, const long doubl
       else if( integration_timeout && !(n_steps % 100))
          if( clock( ) > integration_timeout)
             rval = INTEGRATION_TIMED_OUT;
-      if( step_taken && fail_on_hitting_planet)
-         {
-         extern int planet_hit;
-
-         if( planet_hit != -1)
+      if( step_taken && ctx->fail_on_hitting_planet)
+         if( ctx->planet_hit != -1)
             rval = HIT_A_PLANET;
-         }
 #ifdef PROBABLY_UNNEEDED
       if( debug_level && n_steps % 10000 == 0)
          {
@@ -609,10 +743,84 @@ int integrate_orbitl( long double *orbit, const long double t0, const long doubl
       }
    if( debug_level > 7)
       debug_printf( "Integration done: %d\n", rval);
-   perturbers = saved_perturbers;
+   ctx->perturbers = saved_perturbers;
+   ctx->n_variational_eqns = 0;
+   ctx->counters.n_steps += n_steps;
+   ctx->counters.n_rejects += n_rejects;
+   ctx->counters.integration_ns += nanoseconds_since_1970( ) - t_start;
+   return( rval);
+}
+
+/* Setting DOUBLE_INTEGRATION=1 in 'environ.dat' makes integrate_orbit_ctx()
+do its arithmetic in double instead of long double.  On x86-64,  long double
+means x87 arithmetic with no vectorization,  and on some platforms it's a
+128-bit software type and far slower still.  For Monte Carlo and statistical
+ranging,  the extra precision isn't needed.  DOUBLE_INTEGRATION=2 uses double
+only when the arc is under a century and the tolerance no tighter than 1e-13,
+where rounding errors in double ought to stay well below the integrator's
+own error.  That hasn't been checked over a regression set yet,  so the
+default (0) always uses long double;  'fo -B' (see benchmark_integrators())
+compares the two on whatever orbits you give it.  */
+
+static bool use_double_integration( const long double t0, const long double t1)
+{
+   switch( get_environment_snapshot( )->double_integration)
+      {
+      case 1:
+         return( true);
+      case 2:
+         return( fabsl( t1 - t0) < 36525. && integration_tolerance >= 1e-13);
+      default:
+         return( false);
+      }
+}
+
+int integrate_orbit_ctx( INTEGRATION_CONTEXT *ctx, long double *orbit,
+            const long double t0, const long double t1, const int n_times,
+            const double *times, double *ostates, const int n_partials)
+{
+   int rval;
+
+   if( sizeof( long double) > sizeof( double)
+                     && use_double_integration( t0, t1))
+      {
+      const size_t n_vals = ctx->n_orbit_params + 6 * n_partials;
+      double dorbit[MAX_N_INTEGRATED_VALS];
+
+      copy_state( dorbit, orbit, n_vals);
+      rval = integrate_orbit_t( ctx, dorbit, (double)t0, (double)t1,
+                              n_times, times, ostates, n_partials);
+      copy_state( orbit, dorbit, n_vals);
+      }
+   else
+      rval = integrate_orbit_t( ctx, orbit, t0, t1,
+                              n_times, times, ostates, n_partials);
    return( rval);
 }
 
+/* Integrates using the default context,  i.e.,  the globals :  */
+
+static int integrate_orbitl_dense( long double *orbit, const long double t0,
+            const long double t1, const int n_times, const double *times,
+            double *ostates, const int n_partials)
+{
+   INTEGRATION_CONTEXT *ctx = default_integration_context( );
+   int rval;
+
+   ctx->fail_on_hitting_planet = fail_on_hitting_planet;
+   ctx->perturbers_automatically_found = 0;
+   rval = integrate_orbit_ctx( ctx, orbit, t0, t1, n_times, times,
+                               ostates, n_partials);
+   perturbers_automatically_found |= ctx->perturbers_automatically_found;
+   update_globals_from_context( ctx);
+   return( rval);
+}
+
+int integrate_orbitl( long double *orbit, const long double t0, const long double t1)
+{
+   return( integrate_orbitl_dense( orbit, t0, t1, 0, NULL, NULL, 0));
+}
+
 int integrate_orbit( double *orbit, const double t0, const double t1)
 {
    long double tarray[MAX_N_PARAMS];
@@ -624,6 +832,315 @@ int integrate_orbit( double *orbit, const double t0, const double t1)
    return( rval);
 }
 
+/* Integrates n_orbits orbits,  stored one after another (n_orbit_params
+values each),  from t0 to t1.  With BATCH_INTEGRATION=1 (see 'environ.def'),
+they're integrated in 'lockstep' :  all take the same steps,  with the step
+size set by whichever orbit has the largest error,  and the derivatives for
+all of them are computed at once by calc_derivatives_batch().  The
+perturbers used are those any of the orbits would use.  If anything goes
+amiss (an 'unreasonable' orbit,  hitting a planet,  or a timeout),  the
+orbits are restored and integrated one at a time,  so the globals
+(planet_hit and such) are set just as they would be for one orbit.
+
+   Otherwise (or if there are non-gravs,  or the PD89 integrator is in use),
+this just calls integrate_orbit() for each one.  Returns zero,  or the last
+non-zero value integrate_orbit() returned.  */
+
+#ifdef INTEGRATE_IN_THREADS
+
+/* With INTEGRATION_THREADS=n (see 'environ.def'),  orbits that are
+integrated one at a time are split among n threads,  each with its own
+integration context (see 'integrat.h').  Thread k integrates orbits k,
+k + n,  k + 2n,  ...  The contexts are made here,  before the threads
+start,  and their counters are added to those of the default context
+afterward.  The globals (planet_hit and such) are set from the context
+that integrated the last orbit,  just as they would have been had the
+orbits been integrated in order.   */
+
+#define MAX_INTEGRATION_THREADS 64
+
+typedef struct
+{
+   INTEGRATION_CONTEXT *ctx;
+   double *orbits, t0, t1;
+   int n_orbits, thread_no, n_threads;
+   int rval, rval_idx;
+} integration_thread_t;
+
+int load_bc405_precomputed_data( void);                     /* bc405.cpp */
+double comet_g_func( const long double r);                  /* runge.cpp */
+
+static void *integration_thread( void *arg)
+{
+   integration_thread_t *it = (integration_thread_t *)arg;
+   const int n_params = it->ctx->n_orbit_params;
+   int i;
+
+   it->rval = 0;
+   for( i = it->thread_no; i < it->n_orbits; i += it->n_threads)
+      {
+      long double tarray[MAX_N_PARAMS];
+      double *orbit = it->orbits + i * n_params;
+      int err;
+
+      double_to_ldouble( tarray, orbit, n_params);
+      err = integrate_orbit_ctx( it->ctx, tarray, (long double)it->t0,
+                                 (long double)it->t1, 0, NULL, NULL, 0);
+      ldouble_to_double( orbit, tarray, n_params);
+      if( err)
+         {
+         it->rval = err;
+         it->rval_idx = i;
+         }
+      }
+   return( NULL);
+}
+
+static int n_integration_threads( const int n_orbits)
+{
+   int rval = atoi( get_environment_ptr( "INTEGRATION_THREADS"));
+
+   if( rval > MAX_INTEGRATION_THREADS)
+      rval = MAX_INTEGRATION_THREADS;
+   if( rval > n_orbits / 2)      /* not worth it for just a few orbits */
+      rval = n_orbits / 2;
+   return( rval);
+}
+
+static int integrate_orbits_in_threads( double *orbits, const int n_orbits,
+                              const double t0, const double t1,
+                              const int n_threads)
+{
+   static bool first_time = true;
+   integration_thread_t it[MAX_INTEGRATION_THREADS];
+   pthread_t threads[MAX_INTEGRATION_THREADS];
+   int i, n_started = 0, rval = 0, rval_idx = -1, last_thread;
+
+   if( first_time)      /* make sure shared data is loaded before */
+      {                 /* any threads start */
+      load_bc405_precomputed_data( );
+      comet_g_func( 1.);
+      first_time = false;
+      }
+   for( i = 0; i < n_threads; i++)
+      {
+      it[i].ctx = create_integration_context( );
+      it[i].ctx->fail_on_hitting_planet = fail_on_hitting_planet;
+      it[i].ctx->perturbers_automatically_found = 0;
+      it[i].orbits = orbits;
+      it[i].t0 = t0;
+      it[i].t1 = t1;
+      it[i].n_orbits = n_orbits;
+      it[i].thread_no = i;
+      it[i].n_threads = n_threads;
+      }
+   while( n_started < n_threads - 1 && !pthread_create(
+                  threads + n_started + 1, NULL, integration_thread,
+                  it + n_started + 1))
+      n_started++;
+   integration_thread( it);
+   for( i = n_started + 1; i < n_threads; i++)  /* threads that couldn't */
+      integration_thread( it + i);              /* be started */
+   for( i = 1; i <= n_started; i++)
+      pthread_join( threads[i], NULL);
+   last_thread = (n_orbits - 1) % n_threads;
+   for( i = 0; i < n_threads; i++)
+      {
+      if( it[i].rval && it[i].rval_idx > rval_idx)
+         {
+         rval = it[i].rval;
+         rval_idx = it[i].rval_idx;
+         }
+      perturbers_automatically_found |=
+                              it[i].ctx->perturbers_automatically_found;
+      add_integration_counters( default_integration_counters( ),
+                              &it[i].ctx->counters, 1);
+      if( i == last_thread)
+         update_globals_from_context( it[i].ctx);
+      free_integration_context( it[i].ctx);
+      }
+   return( rval);
+}
+#endif
+
+static int integrate_orbits_singly( double *orbits, const int n_orbits,
+                              const double t0, const double t1)
+{
+   int i, rval = 0;
+#ifdef INTEGRATE_IN_THREADS
+   const int n_threads = n_integration_threads( n_orbits);
+
+   if( n_threads > 1)
+      return( integrate_orbits_in_threads( orbits, n_orbits, t0, t1,
+                                                n_threads));
+#endif
+
+   for( i = 0; i < n_orbits; i++)
+      {
+      const int err = integrate_orbit( orbits + i * n_orbit_params, t0, t1);
+
+      if( err)
+         rval = err;
+      }
+   return( rval);
+}
+
+int integrate_orbits( double *orbits, const int n_orbits, const double t0,
+                                  const double t1)
+{
+   const environment_snapshot_t *settings = get_environment_snapshot( );
+   const double fixed_stepsize = settings->fixed_stepsize;
+   const double step_increase = .9 * integration_tolerance
+                                    / pow( STEP_INCREMENT, 5.);
+   const bool going_backward = (t1 < t0);
+   const size_t n_vals = 6 * (size_t)n_orbits;
+   INTEGRATION_CONTEXT *ctx;
+   double stepsize = 2., t = t0, *saved_orbits, *new_vals;
+   unsigned saved_perturbers;
+   int i, rval = 0, n_steps = 0, n_rejects = 0;
+   int64_t t_start;
+
+   if( n_orbits < 2 || !settings->batch_integration || n_orbit_params != 6
+                  || integration_method || t0 == t1)
+      return( integrate_orbits_singly( orbits, n_orbits, t0, t1));
+   assert( fabs( t0) < 1e+9);
+   assert( fabs( t1) < 1e+9);
+   for( i = 0; i < n_orbits; i++)
+      if( is_unreasonable_orbit( orbits + i * 6))
+         return( integrate_orbits_singly( orbits, n_orbits, t0, t1));
+   saved_orbits = (double *)malloc( 2 * n_vals * sizeof( double));
+   assert( saved_orbits);
+   new_vals = saved_orbits + n_vals;
+   memcpy( saved_orbits, orbits, n_vals * sizeof( double));
+   ctx = default_integration_context( );
+   ctx->fail_on_hitting_planet = fail_on_hitting_planet;
+   ctx->perturbers_automatically_found = 0;
+   saved_perturbers = ctx->perturbers;
+   t_start = nanoseconds_since_1970( );
+   if( fixed_stepsize > 0.)
+      stepsize = fixed_stepsize;
+   if( going_backward)
+      stepsize = -stepsize;
+   while( t != t1 && !rval)
+      {
+      double delta_t, err;
+      double new_t = ceil( (t - .5) / stepsize + .5) * stepsize + .5;
+      unsigned mask = 0;
+
+      for( i = 0; i < n_orbits; i++)
+         {
+         reset_auto_perturbers_ctx( ctx, t, orbits + i * 6);
+         mask |= ctx->perturbers;
+         }
+      ctx->perturbers = mask;
+      n_steps++;
+      if( (!going_backward && new_t > t1) || (going_backward && new_t < t1))
+         new_t = t1;
+      delta_t = new_t - t;
+      err = take_rk_step_batch( ctx, t, n_orbits, orbits, new_vals, delta_t);
+      if( err < integration_tolerance || fixed_stepsize > 0.
+                  || fabs( stepsize) < settings->min_stepsize)
+         {
+         memcpy( orbits, new_vals, n_vals * sizeof( double));
+         if( err < step_increase && !fixed_stepsize)
+            if( fabs( delta_t - stepsize) < fabs( stepsize * .01))
+               stepsize *= STEP_INCREMENT;
+         if( ctx->fail_on_hitting_planet && ctx->planet_hit != -1)
+            rval = HIT_A_PLANET;
+         }
+      else           /* failed:  try again with a smaller step */
+         {
+         n_rejects++;
+         new_t = t;
+         stepsize /= STEP_INCREMENT;
+         }
+      t = new_t;
+      for( i = 0; i < n_orbits && !rval; i++)
+         rval = is_unreasonable_orbit( orbits + i * 6);
+      if( !rval && integration_timeout && !(n_steps % 100))
+         if( clock( ) > integration_timeout)
+            rval = INTEGRATION_TIMED_OUT;
+      }
+   ctx->perturbers = saved_perturbers;
+   ctx->counters.n_steps += n_steps;
+   ctx->counters.n_rejects += n_rejects;
+   ctx->counters.integration_ns += nanoseconds_since_1970( ) - t_start;
+   perturbers_automatically_found |= ctx->perturbers_automatically_found;
+   update_globals_from_context( ctx);
+   if( rval)
+      {
+      debug_printf( "Batch integration failed (%d);  integrating singly\n",
+                                    rval);
+      memcpy( orbits, saved_orbits, n_vals * sizeof( double));
+      rval = integrate_orbits_singly( orbits, n_orbits, t0, t1);
+      }
+   free( saved_orbits);
+   return( rval);
+}
+
+/* Integrates 'orbit' from its epoch to the first observation,  then
+to the last,  with each integration method,  and reports (on one line
+per method) the number of derivative evaluations and steps each took,
+the time spent,  and how far each ended up from a reference integration.
+The reference is done with Gauss-Radau,  in long double,  at a tolerance
+1000 times tighter than usual.  Each method is then run in long double and
+again in double (as with DOUBLE_INTEGRATION=1),  so the cost and accuracy
+of the double-precision integrator can be checked against the long double
+one.  'fo -B (filename)' does this for each object it processes,  so the
+methods can be compared on a given set of orbits.  */
+
+int benchmark_integrators( FILE *ofile, const char *obj_name,
+            const double *orbit, const double epoch,
+            const OBSERVE *obs, const int n_obs)
+{
+   const int saved_method = integration_method;
+   const double saved_tolerance = integration_tolerance;
+   const double jd1 = obs[0].jd, jd2 = obs[n_obs - 1].jd;
+   const char *method_names[6] = { "RKF", "PD89", "Radau",
+                                   "RKF/d", "PD89/d", "Radau/d" };
+   char saved_double_integration[20];
+   double reference[MAX_N_PARAMS];
+   int method;
+
+   strlcpy_error( saved_double_integration,
+                              get_environment_ptr( "DOUBLE_INTEGRATION"));
+   for( method = -1; method < 6; method++)
+      {
+      const INTEGRATION_COUNTERS counters0 = *default_integration_counters( );
+      const int64_t t_start = nanoseconds_since_1970( );
+      const INTEGRATION_COUNTERS *counters;
+      double torbit[MAX_N_PARAMS], dist = 0.;
+      int i, rval;
+
+      memcpy( torbit, orbit, n_orbit_params * sizeof( double));
+      integration_method = (method < 0 ? 2 : method % 3);
+      set_environment_ptr( "DOUBLE_INTEGRATION", (method >= 3 ? "1" : "0"));
+      integration_tolerance = saved_tolerance * (method < 0 ? .001 : 1.);
+      rval = integrate_orbit( torbit, epoch, jd1);
+      if( !rval)
+         rval = integrate_orbit( torbit, jd1, jd2);
+      if( method < 0)
+         memcpy( reference, torbit, n_orbit_params * sizeof( double));
+      else
+         {
+         counters = default_integration_counters( );
+         for( i = 0; i < 3; i++)
+            dist += (torbit[i] - reference[i]) * (torbit[i] - reference[i]);
+         fprintf( ofile, "%-20s %-7s %8ld derivs %7ld steps %6ld rejects %9.4f s %10.3g km%s\n",
+                  obj_name, method_names[method],
+                  counters->n_derivs - counters0.n_derivs,
+                  counters->n_steps - counters0.n_steps,
+                  counters->n_rejects - counters0.n_rejects,
+                  (double)( nanoseconds_since_1970( ) - t_start) * 1e-9,
+                  sqrt( dist) * AU_IN_KM, (rval ? " (failed)" : ""));
+         }
+      }
+   integration_method = saved_method;
+   integration_tolerance = saved_tolerance;
+   set_environment_ptr( "DOUBLE_INTEGRATION", saved_double_integration);
+   return( 0);
+}
+
 /* At times,  the orbits generated by 'full steps' or Herget or other methods
    are completely unreasonable.  The exact definition of 'unreasonable'
    is pretty darn fuzzy.  The following function says that if at the epoch,
@@ -672,7 +1189,7 @@ static int is_unreasonable_orbit( const double *orbit)
    return( rval);
 }
 
-static int is_unreasonable_orbitl( const long double *orbit)
+static int is_unreasonable_orbit( const long double *orbit)
 {
    double tarray[6];
 
@@ -801,15 +1318,25 @@ otherwise be the case.
    If we don't actually need a state vector for a second epoch,  then
 we can set orbit2 = NULL.  Or use plain ol' set_locs(),  which -- as
 you can see below -- basically just calls set_locs_extended() with a
-NULL orbit2.                          */
+NULL orbit2.
+
+   If n_partials is non-zero,  the variational equations are integrated as
+well,  and 'partials' is filled with the partial derivatives of each
+observation's (light-time-lagged) position and velocity with respect to
+the first n_partials parameters of 'orbit':  6 * n_partials values per
+observation,  followed by 6 * n_partials for the state vector at epoch2. */
 
 #define is_between( t1, t2, t3)  ((t2 - t1) * (t3 - t2) >= 0.)
 
+static void set_computed_ra_decs( OBSERVE FAR *obs, const int n_obs);
+
 static int set_locs_extended( const double *orbit, const double epoch_jd,
                        OBSERVE FAR *obs, const int n_obs,
-                       const double epoch2, double *orbit2)
+                       const double epoch2, double *orbit2,
+                       const int n_partials, double *partials)
 {
    int i, pass, rval = is_unreasonable_orbit( orbit);
+   const int use_dense_output = get_environment_snapshot( )->dense_output;
 
    if( rval)
       {
@@ -823,7 +1350,84 @@ static int set_locs_extended( const double *orbit, const double epoch_jd,
       ;
 
                /* set obs[0...i-1] on pass=0, obs[i...n_obs-1] on pass=1: */
-   for( pass = 0; pass < 2; pass++)
+   for( pass = 0; pass < 2 && (use_dense_output || n_partials); pass++)
+      {
+      const int n_to_set = (pass ? n_obs - i : i);
+      const bool set_orbit2 = (orbit2 && (pass ? epoch2 >= epoch_jd
+                                               : epoch2 <= epoch_jd));
+      const int n_times = n_to_set + (set_orbit2 ? 1 : 0);
+      const int state_size = 6 + 6 * n_partials;
+      const double dir = (pass ? 1. : -1.);
+      long double curr_orbit[MAX_N_INTEGRATED_VALS];
+      double *times, *states;
+      int j, k, orbit2_idx = -1;
+
+      if( !n_times)
+         continue;
+      times = (double *)malloc( n_times * (state_size + 1) * sizeof( double));
+      assert( times);
+      states = times + n_times;
+      for( j = k = 0; j < n_to_set; j++)
+         {
+         const double jd = obs[pass ? i + j : i - 1 - j].jd;
+
+         if( set_orbit2 && orbit2_idx < 0 && (jd - epoch2) * dir > 0.)
+            times[orbit2_idx = k++] = epoch2;
+         times[k++] = jd;
+         }
+      if( set_orbit2 && orbit2_idx < 0)
+         times[orbit2_idx = k++] = epoch2;
+      assert( k == n_times);
+      double_to_ldouble( curr_orbit, orbit, n_orbit_params);
+      for( j = 0; j < 6 * n_partials; j++)     /* partials start out as */
+         curr_orbit[n_orbit_params + j] =      /* an identity matrix    */
+                     (j == 7 * (j / 6) ? 1. : 0.);
+      rval = integrate_orbitl_dense( curr_orbit, epoch_jd, times[n_times - 1],
+                                  n_times, times, states, n_partials);
+      for( j = k = 0; !rval && k < n_times; k++)
+         {
+         const double *state = states + state_size * k;
+
+         if( k == orbit2_idx)
+            {
+            memcpy( orbit2, orbit, n_orbit_params * sizeof( double));
+            memcpy( orbit2, state, 6 * sizeof( double));
+            if( n_partials)
+               memcpy( partials + n_obs * 6 * n_partials, state + 6,
+                                    6 * n_partials * sizeof( double));
+            }
+         else
+            {
+            double light_lagged_orbit[6];
+            const int idx = (pass ? i + j : i - 1 - j);
+            OBSERVE FAR *optr = obs + idx;
+
+            light_time_lag( optr->jd, state, optr->obs_posn,
+                           light_lagged_orbit, optr->note2 == 'R');
+            FMEMCPY( optr->obj_posn, light_lagged_orbit, 3 * sizeof( double));
+            FMEMCPY( optr->obj_vel, light_lagged_orbit + 3, 3 * sizeof( double));
+            if( n_partials)
+               {            /* to first order,  the lagged position moves */
+                            /* by d(posn)/dp - lag * d(vel)/dp :          */
+               const double lag = vector3_dist( light_lagged_orbit,
+                                 optr->obs_posn) / AU_PER_DAY;
+               const double *iptr = state + 6;
+               double *optr_partials = partials + idx * 6 * n_partials;
+               int m;
+
+               for( m = 0; m < 6 * n_partials; m++)
+                  optr_partials[m] = iptr[m]
+                           - (m % 6 < 3 ? lag * iptr[m + 3] : 0.);
+               }
+            j++;
+            }
+         }
+      free( times);
+      if( rval)
+         return( rval);
+      }
+
+   for( pass = 0; pass < 2 && !use_dense_output && !n_partials; pass++)
       {
       int j = (pass ? i : i - 1);
       long double curr_orbit[MAX_N_PARAMS];
@@ -869,6 +1473,14 @@ static int set_locs_extended( const double *orbit, const double epoch_jd,
             /* time.  Now let's go back and find observer-centric */
             /* computed RA/decs and distances to the object at those */
             /* times. */
+   set_computed_ra_decs( obs, n_obs);
+   return( 0);
+}
+
+static void set_computed_ra_decs( OBSERVE FAR *obs, const int n_obs)
+{
+   int i;
+
    for( i = 0; i < n_obs; i++)
       {
       double loc[3], ra, dec, r = 0.;
@@ -898,13 +1510,12 @@ static int set_locs_extended( const double *orbit, const double epoch_jd,
       obs[i].computed_dec = dec;
       set_solar_r( obs + i);
       }
-   return( 0);
 }
 
 int set_locs( const double *orbit, const double t0, OBSERVE FAR *obs,
                        const int n_obs)
 {
-   return( set_locs_extended( orbit, t0, obs, n_obs, t0, NULL));
+   return( set_locs_extended( orbit, t0, obs, n_obs, t0, NULL, 0, NULL));
 }
 
 double observation_rms( const OBSERVE FAR *obs)
@@ -1256,7 +1867,8 @@ int extended_orbit_fit( double *orbit, OBSERVE *obs, int n_obs,
          params[i] = -delta_val;
       rval = find_parameterized_orbit( orbit, params, obs1, obs2,
                      fit_type, 0);
-      set_locs_extended( orbit, obs1.jd, obs, n_obs, epoch, orbit_at_epoch);
+      set_locs_extended( orbit, obs1.jd, obs, n_obs, epoch, orbit_at_epoch,
+                                       0, NULL);
       for( j = 0; j < n_obs; j++)
          if( obs[j].is_included)
             {
@@ -1307,7 +1919,8 @@ int extended_orbit_fit( double *orbit, OBSERVE *obs, int n_obs,
       }
    rval = find_parameterized_orbit( orbit, params, obs1, obs2,
                      fit_type, 0);
-   set_locs_extended( orbit, obs1.jd, obs, n_obs, epoch, orbit_at_epoch);
+   set_locs_extended( orbit, obs1.jd, obs, n_obs, epoch, orbit_at_epoch,
+                                       0, NULL);
             /* Except we really want to return the orbit at epoch : */
    memcpy( orbit_at_epoch, orbit, n_orbit_params * sizeof( double));
    integrate_orbit( orbit, obs1.jd, epoch);
@@ -1729,26 +2342,29 @@ static inline void compute_sr_sigmas( const double *sr_orbits,
    unsigned i;
    double monte_data[MONTE_DATA_SIZE];
    double sigmas[MONTE_N_ENTRIES];
+   double *orbits = (double *)calloc( n_orbits * n_orbit_params, sizeof( double));
    FILE *monte_file;
    char filename[100];
    const int planet_orbiting = 0;      /* heliocentric only,  at least for now */
    ELEMENTS elem0;
 
+   assert( orbits);
+   for( i = 0; i < n_orbits; i++)
+      memcpy( orbits + i * n_orbit_params, sr_orbits + 6 * i, 6 * sizeof( double));
+   integrate_orbits( orbits, (int)n_orbits, epoch, epoch_shown);
    elem0.major_axis = elem0.ecc = 0.;     /* just to avoid uninitialized  */
    for( i = 0; i < n_orbits; i++)         /* variable warnings            */
       {
-      double orbit[6];
       ELEMENTS elem;
 
       memset( &elem, 0, sizeof( ELEMENTS));
       elem.gm = SOLAR_GM;
-      memcpy( orbit, sr_orbits + 6 * i, 6 * sizeof( double));
-      integrate_orbit( orbit, epoch, epoch_shown);
-      calc_classical_elements( &elem, orbit, epoch_shown, 1);
+      calc_classical_elements( &elem, orbits + i * n_orbit_params, epoch_shown, 1);
       add_monte_orbit( monte_data, &elem, i);
       if( !i)
          elem0 = elem;
       }
+   free( orbits);
    monte_file = fopen_ext( get_file_name( filename, "monte.txt"), "tfcwb");
 
    fprintf( monte_file, "Computed from %u SR orbits\n", n_orbits);
@@ -2376,8 +2992,7 @@ double n_nearby_obs( const OBSERVE FAR *obs, const unsigned n_obs,
       i--;
    while( i < n_obs && dt < span_limit)
       {
-      const double dt = (obs[i].jd - obs[idx].jd) / time_span;
-
+      dt = (obs[i].jd - obs[idx].jd) / time_span;
       if( obs[i].is_included && i != idx
               && !strcmp( obs[i].mpc_code, obs[idx].mpc_code))
          rval += exp( -dt * dt / 2.);
@@ -2618,6 +3233,88 @@ const char *monte_label[MONTE_N_ENTRIES] = {
                            "Tp", "e", "q", "Q", "1/a", "i", "M",
                            "omega", "Omega", "MOID", "H" };
 
+/* By default,  full_improvement() gets the partial derivatives of the
+observations with respect to the state vector (and most non-gravitational
+parameters) by integrating the variational equations along with the orbit
+(see 'runge.cpp').  The following returns the number of parameters,
+counting from the first,  for which that can be done.  The remaining ones
+(asteroid mass,  comet 'DT') are still found by integrating tweaked orbits
+and differencing the results.  VARIATIONAL_PARTIALS=1 in 'environ.dat'
+turns this on;  by default,  all partials are numerical,  as they used
+to be.
+
+   The variational equations only include point-mass gravity (see
+set_variational_derivs() in 'runge.cpp').  Near the earth,  J2 and higher
+terms,  drag,  and the moon matter a great deal more,  and the partials
+(and therefore the covariance,  sigmas,  and Monte Carlo/SR variants)
+would be wrong.  So if the object is within VARIATIONAL_MIN_DIST of the
+earth at the epoch or at any included observation (geocentric objects,
+artsats,  close approaches),  we fall back to numerical partials.   */
+
+#define VARIATIONAL_MIN_DIST .05
+
+static bool near_the_earth( const OBSERVE *obs, const int n_obs,
+                            const double *orbit, const double epoch)
+{
+   double earth_loc[3];
+   int i;
+
+   for( i = 0; i < n_obs; i++)
+      if( obs[i].is_included && obs[i].r < VARIATIONAL_MIN_DIST)
+         return( true);
+   earth_lunar_posn( epoch, earth_loc, NULL);
+   for( i = 0; i < 3; i++)
+      earth_loc[i] -= orbit[i];
+   return( vector3_length( earth_loc) < VARIATIONAL_MIN_DIST);
+}
+
+static int n_variational_partials( const int n_params,
+                                   const bool solving_for_mass,
+                                   const OBSERVE *obs, const int n_obs,
+                                   const double *orbit, const double epoch)
+{
+   int rval = 6;
+
+   if( !atoi( get_environment_ptr( "VARIATIONAL_PARTIALS")))
+      return( 0);
+   if( near_the_earth( obs, n_obs, orbit, epoch))
+      return( 0);
+   if( !solving_for_mass)     /* mass partials are always numerical */
+      {
+      if( force_model == FORCE_MODEL_SRP
+                     || force_model == FORCE_MODEL_YARKO_A2)
+         rval = 7;
+      else if( n_orbit_params >= 8 && n_orbit_params <= 10)
+         rval = 9;                     /* A1, A2, A3,  but not DT */
+      }
+   return( rval < n_params ? rval : n_params);
+}
+
+/* With partials from the variational equations,  we needn't integrate a
+tweaked orbit to find out how the observations would change.  This sets
+the positions in obs[] to what they'd be (to first order) if parameter
+'param' were changed by 'delta'.   */
+
+static void set_linearized_locs( OBSERVE FAR *obs,
+            const OBSERVE FAR *orig_obs, const int n_obs,
+            const double *partials, const int n_partials,
+            const int param, const double delta)
+{
+   int i, j;
+
+   for( i = 0; i < n_obs; i++)
+      {
+      const double *dp = partials + (i * n_partials + param) * 6;
+
+      for( j = 0; j < 3; j++)
+         {
+         obs[i].obj_posn[j] = orig_obs[i].obj_posn[j] + delta * dp[j];
+         obs[i].obj_vel[j] = orig_obs[i].obj_vel[j] + delta * dp[j + 3];
+         }
+      }
+   set_computed_ra_decs( obs, n_obs);
+}
+
 /* Describing what 'full_improvement()' does requires an entire separate
 file of commentary: see 'full.txt'.  Note,  though,  that this should be
 given an orbit that is somewhere within the arc of observations,  for
@@ -2669,8 +3366,9 @@ int full_improvement( OBSERVE FAR *obs, int n_obs, double *orbit,
    const int showing_deltas_in_debug_file =
                       atoi( get_environment_ptr( "DEBUG_DELTAS"));
    const double r_mult = 1e+2;
-   double orbit2[MAX_N_PARAMS];
-   int set_locs_rval;
+   double orbit2[MAX_N_PARAMS], orbit2_helio[MAX_N_PARAMS];
+   double *partials = NULL;
+   int set_locs_rval, n_partials;
    const bool saved_fail_on_hitting_planet =
                                      fail_on_hitting_planet;
 
@@ -2751,8 +3449,17 @@ int full_improvement( OBSERVE FAR *obs, int n_obs, double *orbit,
       }
 
    snprintf_err( tstr, sizeof( tstr), "fi/setting locs: %f  ", JD_TO_YEAR( epoch));
+   n_partials = n_variational_partials( n_params, asteroid_mass != NULL,
+                                        obs, n_obs, orbit, epoch);
+   if( n_partials)
+      {
+      partials = (double *)malloc( (n_obs + 1) * 6 * n_partials
+                                             * sizeof( double));
+      assert( partials);
+      }
    fail_on_hitting_planet = true;
-   set_locs_rval = set_locs_extended( orbit, epoch, obs, n_obs, epoch2, orbit2);
+   set_locs_rval = set_locs_extended( orbit, epoch, obs, n_obs, epoch2, orbit2,
+                                    n_partials, partials);
    fail_on_hitting_planet = saved_fail_on_hitting_planet;
    if( set_locs_rval)
       {
@@ -2761,8 +3468,10 @@ int full_improvement( OBSERVE FAR *obs, int n_obs, double *orbit,
       debug_printf( "Hit planet %d in full_improvement : %d\n",
                       planet_hit, set_locs_rval);
       runtime_message = NULL;
+      free( partials);
       return( -4);
       }
+   memcpy( orbit2_helio, orbit2, n_orbit_params * sizeof( double));
 
    if( planet_orbiting == ORBIT_CENTER_AUTO)    /* select 'best' orbit center */
       planet_orbiting = find_best_fit_planet( epoch2, orbit2, tvect);
@@ -2863,8 +3572,20 @@ int full_improvement( OBSERVE FAR *obs, int n_obs, double *orbit,
             if( debug_level > 4)
                debug_printf( "About to set locs #2: delta_val %f\n", delta_val);
             fail_on_hitting_planet = true;
-            set_locs_rval = set_locs_extended( tweaked_orbit, epoch, obs,
-                       n_obs, epoch2, rel_orbit);
+            if( i < n_partials)
+               {
+               const double *dp = partials + (n_obs * n_partials + i) * 6;
+
+               set_linearized_locs( obs, orig_obs, n_obs, partials,
+                                    n_partials, i, -delta_val);
+               memcpy( rel_orbit, tweaked_orbit, n_orbit_params * sizeof( double));
+               for( j = 0; j < 6; j++)
+                  rel_orbit[j] = orbit2_helio[j] - delta_val * dp[j];
+               set_locs_rval = 0;
+               }
+            else
+               set_locs_rval = set_locs_extended( tweaked_orbit, epoch, obs,
+                       n_obs, epoch2, rel_orbit, 0, NULL);
             fail_on_hitting_planet = saved_fail_on_hitting_planet;
             for( j = 0; !set_locs_rval && j < n_obs; j++)
                {
@@ -2880,6 +3601,7 @@ int full_improvement( OBSERVE FAR *obs, int n_obs, double *orbit,
                {
                free( xresids);
                free( orig_obs);
+               free( partials);
                memcpy( orbit, original_orbit, n_orbit_params * sizeof( double));
                runtime_message = NULL;
                debug_printf( "Integration timeout\n");
@@ -2900,6 +3622,7 @@ int full_improvement( OBSERVE FAR *obs, int n_obs, double *orbit,
             memcpy( obs, orig_obs, n_obs * sizeof( OBSERVE));
             free( orig_obs);
             free( xresids);
+            free( partials);
             memcpy( orbit, original_orbit, n_orbit_params * sizeof( double));
             return( -8);
             }
@@ -2948,7 +3671,14 @@ int full_improvement( OBSERVE FAR *obs, int n_obs, double *orbit,
                tweaked_orbit[i] += delta_val;
             memcpy( tstr, "Reverse   ", 10);
             fail_on_hitting_planet = true;
-            set_locs_rval = set_locs( tweaked_orbit, epoch, obs, n_obs);
+            if( i < n_partials)
+               {
+               set_linearized_locs( obs, orig_obs, n_obs, partials,
+                                    n_partials, i, delta_val);
+               set_locs_rval = 0;
+               }
+            else
+               set_locs_rval = set_locs( tweaked_orbit, epoch, obs, n_obs);
             if( set_locs_rval)      /* fall back on simple, asymmetric method */
                {
                debug_printf( "Symmetric fail : %d\n", set_locs_rval);
@@ -3025,6 +3755,7 @@ int full_improvement( OBSERVE FAR *obs, int n_obs, double *orbit,
       }
    memcpy( obs, orig_obs, n_obs * sizeof( OBSERVE));
    free( orig_obs);
+   free( partials);
    if( err_code)
       {
       free( xresids);
@@ -4245,7 +4976,6 @@ int orbital_monte_carlo( const double *orbit, OBSERVE *obs, const int n_obs,
       {
       double *torbit = sr_orbits + i * n_orbit_params;
       const double sig_squared = generate_mc_variant_from_covariance( torbit, orbit);
-      const char *format_str = "%+17.6f %+17.6f %+17.6f %+14.12f %+14.12f %+14.12f\n";
 
       if( i < 1000)
          {
@@ -4257,7 +4987,13 @@ int orbital_monte_carlo( const double *orbit, OBSERVE *obs, const int n_obs,
          debug_printf( "Var %4d: %9.6f %.8f\n", i, sig_squared,
                         rms * rms * n_resids);
          }
-      integrate_orbit( torbit, curr_epoch, epoch_shown);
+      }
+   integrate_orbits( sr_orbits, (int)n_sr_orbits, curr_epoch, epoch_shown);
+   for( i = 0; i < n_sr_orbits; i++)
+      {
+      double *torbit = sr_orbits + i * n_orbit_params;
+      const char *format_str = "%+17.6f %+17.6f %+17.6f %+14.12f %+14.12f %+14.12f\n";
+
       write_out_elements_to_file( torbit, epoch_shown, epoch_shown,
            obs, n_obs, "", 6, 1, ELEM_OUT_ALTERNATIVE_FORMAT | ELEM_OUT_NO_COMMENT_DATA);
       append_elements_to_element_file = 1;
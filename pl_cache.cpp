@@ -20,23 +20,20 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
 02110-1301, USA.    */
 
-/* #define TIMING_ON  */
-
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
 #include <math.h>
-#ifdef TIMING_ON
-    #include <time.h>
-#endif
 #include "pl_cache.h"
 #include "watdefs.h"
 #include "stringex.h"
 #include "lunar.h"
 #include "afuncs.h"
 #include "jpleph.h"
+#include "comets.h"
+#include "integrat.h"
 
 const char *get_find_orb_text( const int index);          /* elem_out.cpp */
 const char *get_environment_ptr( const char *env_ptr);     /* mpc_obs.cpp */
@@ -45,10 +42,11 @@ int debug_printf( const char *format, ...)                 /* mpc_obs.cpp */
          __attribute__ (( format( printf, 1, 2)))
 #endif
 ;
+int64_t nanoseconds_since_1970( void);                      /* nanosecs.c */
 extern int debug_level;
 
-int64_t planet_ns;
 static void *jpl_eph = NULL;
+static char jpl_path[255];       /* name of the JPL file we actually opened */
 
 #define J2000 2451545.0
 #define J0 (J2000 - 2000. * 365.25)
@@ -61,19 +59,24 @@ int generic_message_box( const char *message, const char *box_type);
 
 int compute_rough_planet_loc( const double t_cen, const int planet_idx,
                                           double *vect);    /* sm_vsop.cpp */
-int asteroid_position_raw( const int astnum, const double jd,
-                              double *posn, double *vel);      /* bc405.cpp */
 int64_t nanoseconds_since_1970( void);                      /* mpc_obs.c */
 int format_jpl_ephemeris_info( char *buff);                 /* pl_cache.c */
 
-static int planet_posn_raw( int planet_no, const double jd,
-                            double *vect_2000)
+/* If 'eph' is non-NULL,  it's a JPL ephemeris opened for a particular
+integration context (see 'integrat.h');  if it's NULL,  we use (and load,
+if need be) the process-wide JPL ephemeris.  */
+
+static int satellite_posn( INTEGRATION_CONTEXT *ctx, const int idx,
+                           const double jd, double *vect_2000);
+
+static int planet_posn_raw( INTEGRATION_CONTEXT *ctx, void *eph,
+                            int planet_no, const double jd, double *vect_2000)
 {
    const int jpl_center = 11;         /* default to heliocentric */
    int rval = 0;
    static const char *jpl_filename = NULL;
-   const int bc405_start = 100;
-   const int calc_vel = (planet_no > PLANET_POSN_VELOCITY_OFFSET - 2);
+   const int calc_vel = (planet_no > PLANET_POSN_VELOCITY_OFFSET - 2
+                           && !PLANET_POSN_IS_ASTEROID( planet_no));
 
    if( calc_vel)
       planet_no -= PLANET_POSN_VELOCITY_OFFSET;
@@ -89,13 +92,26 @@ static int planet_posn_raw( int planet_no, const double jd,
       return( 0);
       }
 
-   if( planet_no >= bc405_start && planet_no < bc405_start + 300)
+   if( planet_no >= PLANET_POSN_SATELLITE( 11)
+               && planet_no <= PLANET_POSN_SATELLITE( 19))
       {
-      double temp_loc[4];
+      if( calc_vel)
+         return( -1);
+      return( satellite_posn( ctx, planet_no - PLANET_POSN_SATELLITE( 0),
+                                 jd, vect_2000));
+      }
 
-      rval = asteroid_position_raw( planet_no - bc405_start, jd,
-               (calc_vel ? NULL : temp_loc),
-               (calc_vel ? temp_loc : NULL));
+   if( PLANET_POSN_IS_ASTEROID( planet_no))
+      {
+      double temp_loc[4];
+      const int asteroid_idx = (planet_no - PLANET_POSN_ASTEROID_BASE)
+                                    % PLANET_POSN_ASTEROID_VELOCITY;
+      const bool asteroid_vel = (planet_no - PLANET_POSN_ASTEROID_BASE
+                                    >= PLANET_POSN_ASTEROID_VELOCITY);
+
+      rval = asteroid_position_ctx( ctx, asteroid_idx, jd,
+               (asteroid_vel ? NULL : temp_loc),
+               (asteroid_vel ? temp_loc : NULL));
       if( debug_level > 8)
          debug_printf( "JD %f, minor planet %d: (%f %f %f)\n",
                      jd, planet_no, temp_loc[0], temp_loc[1], temp_loc[2]);
@@ -113,7 +129,11 @@ static int planet_posn_raw( int planet_no, const double jd,
       jpl_filename = get_environment_ptr( "LINUX_JPL_FILENAME");
 #endif
       if( *jpl_filename)
+         {
          jpl_eph = jpl_init_ephemeris( jpl_filename, NULL, NULL);
+         if( jpl_eph)
+            strlcpy_error( jpl_path, jpl_filename);
+         }
       if( !jpl_eph)
          if( (ifile = fopen_ext( "jpl_eph.txt", "fcrb")) != NULL)
             {
@@ -123,12 +143,16 @@ static int planet_posn_raw( int planet_no, const double jd,
                if( *buff && *buff != ';')
                   {
                   jpl_eph = jpl_init_ephemeris( buff, NULL, NULL);
-                  if( !jpl_eph)
+                  if( jpl_eph)
+                     strlcpy_error( jpl_path, buff);
+                  else
                      {
                      char tname[255];
 
                      make_config_dir_name( tname, buff);
                      jpl_eph = jpl_init_ephemeris( tname, NULL, NULL);
+                     if( jpl_eph)
+                        strlcpy_error( jpl_path, tname);
                      }
                   }
             if( debug_level)
@@ -152,22 +176,28 @@ static int planet_posn_raw( int planet_no, const double jd,
          }
       }
 
-   if( jpl_eph)
+   if( !eph)
+      eph = jpl_eph;
+   if( eph)
       {
       double state[6];            /* DE gives both posn & velocity */
       int failure_code;
 
       if( planet_no < 0)          /* flag to unload everything */
          {
-         jpl_close_ephemeris( jpl_eph);
-         jpl_eph = NULL;
-         jpl_filename = NULL;
+         if( eph == jpl_eph)
+            {
+            jpl_close_ephemeris( jpl_eph);
+            jpl_eph = NULL;
+            jpl_filename = NULL;
+            *jpl_path = '\0';
+            }
          return( 0);
          }
       else if( planet_no == 10)
-         failure_code = jpl_pleph( jpl_eph, jd, 10, 3, state, calc_vel);
+         failure_code = jpl_pleph( eph, jd, 10, 3, state, calc_vel);
       else
-         failure_code = jpl_pleph( jpl_eph, jd,
+         failure_code = jpl_pleph( eph, jd,
               (planet_no == 3) ? 13 : planet_no, jpl_center, state, calc_vel);
       if( !failure_code)         /* we're done */
          {
@@ -254,7 +284,135 @@ POSN_NODE
    /* If a node reaches splitting_size,  "spill over" to an adjacent  */
    /* node if it's less than half full : */
 #define spillover_size    (node_size / 2)
-int n_posns_cached = 0;
+int n_posns_cached = 0;     /* for the default cache only */
+
+/* Each integration context has its own cache of planetary positions (and
+its own handle to the JPL ephemeris file),  so that several contexts can
+be used at once in different threads.  The 'usual' planet_posn() function
+uses the default cache.  See 'integrat.h'.   */
+
+/* The integrator wants the positions of all the perturbing planets at
+each epoch.  Rather than look each one up in the above table,  the
+perturber_posns() functions keep a small direct-mapped table of 'epoch
+records',  each holding the positions of all planets at one JD;  so
+getting all the planets at an epoch we've seen recently takes one probe.
+The records hold the same (raw) values planet_posn() returns;  missing
+ones are filled in from planet_posn().   */
+
+#define N_EPOCH_RECORDS        64
+#define N_EPOCH_BODIES         11          /* sun through moon */
+#define EARTH_MOON_BARYCENTER_FACTOR 82.300679
+
+typedef struct
+{
+   double jd;
+   unsigned mask;          /* bit n set = posns for body n are computed */
+   double posns[N_EPOCH_BODIES * 3];
+} epoch_record_t;
+
+PLANET_CACHE
+   {
+   POSN_NODE *nodes;
+   int n_nodes, n_nodes_alloced, curr_node, n_posns_cached, max_nodes;
+   void *jpl_eph;
+   epoch_record_t *epochs;
+   double jsat_jd, jsats[15];
+   double precession_jd, obliquity, precession_matrix[10];
+   };
+
+static PLANET_CACHE default_cache;
+
+/* Satellite positions (see 'pl_cache.h') are cached like any other
+'planet'.  Computing one means finding its position relative to the primary
+in ecliptic-of-date coordinates,  then turning that into ecliptic J2000.
+calc_jsat_loc() gets all four Galileans at once,  and the obliquity and
+precession matrix depend only on the JD.  So each cache keeps the last
+Galilean set and the last matrix computed;  all the satellites needed at
+one JD then cost one calc_jsat_loc() call and one setup_precession().  */
+
+#define JUPITER_R (71492. / AU_IN_KM)
+#define IDX_IO        11
+#define IDX_TETHYS    15
+#define IDX_IAPETUS   19
+
+static int satellite_posn( INTEGRATION_CONTEXT *ctx, const int idx,
+                           const double jd, double *vect_2000)
+{
+   PLANET_CACHE *pcache = (ctx && ctx->planet_cache ?
+                                 ctx->planet_cache : &default_cache);
+   double sat_loc[15];
+   size_t i;
+
+   if( idx >= IDX_TETHYS)         /* Saturnian satell */
+      calc_ssat_loc( jd, sat_loc, ((idx == IDX_IAPETUS) ? 7 : idx - 13), 0L);
+   else
+      {
+      if( pcache->jsat_jd != jd)
+         {
+         calc_jsat_loc( jd, pcache->jsats, 15, 0L);
+         pcache->jsat_jd = jd;
+         }
+      memcpy( sat_loc, pcache->jsats + (idx - IDX_IO) * 3, 3 * sizeof( double));
+      }
+   if( pcache->precession_jd != jd)
+      {
+      const double t_years = (jd - J2000) / 365.25;
+
+      pcache->obliquity = mean_obliquity( t_years / 100.);
+      setup_precession( pcache->precession_matrix, 2000. + t_years, 2000.);
+      pcache->precession_jd = jd;
+      }
+                     /* turn ecliptic of date to equatorial: */
+   rotate_vector( sat_loc, pcache->obliquity, 0);
+                     /* then to equatorial J2000: */
+   precess_vector( pcache->precession_matrix, sat_loc, vect_2000);
+                     /* then to ecliptic J2000: */
+   equatorial_to_ecliptic( vect_2000);
+   if( idx < IDX_TETHYS)         /* Galileans are in Jovian radii */
+      for( i = 0; i < 3; i++)
+         vect_2000[i] *= JUPITER_R;
+   return( 0);
+}
+
+PLANET_CACHE *alloc_planet_cache( void)
+{
+   PLANET_CACHE *rval = (PLANET_CACHE *)calloc( 1, sizeof( PLANET_CACHE));
+
+   assert( rval);
+   if( rval && *jpl_path)
+      rval->jpl_eph = jpl_init_ephemeris( jpl_path, NULL, NULL);
+   return( rval);
+}
+
+static void clear_planet_cache( PLANET_CACHE *cache)
+{
+   int i;
+
+   for( i = 0; i < cache->n_nodes; i++)
+      if( cache->nodes[i].data)
+         free( cache->nodes[i].data);
+   if( cache->nodes)
+      free( cache->nodes);
+   if( cache->epochs)
+      free( cache->epochs);
+   cache->epochs = NULL;
+   cache->nodes = NULL;
+   cache->n_posns_cached = cache->max_nodes = 0;
+   cache->n_nodes = cache->n_nodes_alloced = cache->curr_node = 0;
+   if( cache == &default_cache)
+      n_posns_cached = 0;
+}
+
+void free_planet_cache( PLANET_CACHE *cache)
+{
+   if( cache && cache != &default_cache)
+      {
+      clear_planet_cache( cache);
+      if( cache->jpl_eph)
+         jpl_close_ephemeris( cache->jpl_eph);
+      free( cache);
+      }
+}
 
 /* Hash the JD and planet number.  It seems a fair bit of time is
 spent in this function,  so I spent a good bit of time trying to make
@@ -279,7 +437,8 @@ static inline int hash_function( const int planet_no, const double jd)
    int rval;
 
    memcpy( dword_ptr, &jd, sizeof( double));
-   rval = dword_ptr[0] ^ dword_ptr[1] ^ (planet_no << 8);
+   rval = (int)( (uint32_t)dword_ptr[0] ^ (uint32_t)dword_ptr[1]
+                      ^ ((uint32_t)planet_no << 8));
 
    rval &= 0x7fffffff;
    rval %= node_size;
@@ -323,17 +482,12 @@ static void collapse_and_partition( POSN_CACHE *ovals, const POSN_CACHE *ivals)
    shellsort_r( ovals, array_size, sizeof( POSN_CACHE), compare_cached_posns, NULL);
 }
 
-/*   The following three long ints keep track of the number of searches
-and probes done,  and the "worst-case" maximum number of probes required,
-just to check that the hash function is truly random enough.      */
-
-/* #define TEST_PLANET_CACHING_HASH_FUNCTION */
-
-#ifdef TEST_PLANET_CACHING_HASH_FUNCTION
-long total_n_searches = 0, total_n_probes = 0, max_probes_required = 0;
-#endif
+/*   If 'counters' is non-NULL,  the number of probes done and the
+"worst-case" maximum number of probes required are accumulated,  to
+check that the hash function is truly random enough.      */
 
-static int find_within_node( const int planet_no, const double jd, const POSN_CACHE *cache)
+static int find_within_node( const int planet_no, const double jd,
+            const POSN_CACHE *cache, INTEGRATION_COUNTERS *counters)
 {
    int loc = hash_function( planet_no, jd);
    int n_probes = 1;
@@ -350,12 +504,12 @@ static int find_within_node( const int planet_no, const double jd, const POSN_CA
       if( i != loc)
          assert( cache[i].planet_no != planet_no || cache[i].jd != jd);
 #endif
-#ifdef TEST_PLANET_CACHING_HASH_FUNCTION
-   if( max_probes_required < n_probes)
-      max_probes_required = n_probes;
-   total_n_searches++;
-   total_n_probes += n_probes;
-#endif
+   if( counters)
+      {
+      if( counters->max_probes < n_probes)
+         counters->max_probes = n_probes;
+      counters->cache_probes += n_probes;
+      }
    return( loc);
 }
 
@@ -423,16 +577,75 @@ I keyed the tree using the above hash function,  entries to the tree would
 have been nearly random,  and a plain old unbalanced tree would have worked
 Just Fine.)    */
 
+/* Once the cache has 'max_nodes' nodes,  we evict whichever of the first
+or last node (in JD) is farther from the JD being requested;  i.e.,  we
+drop positions from the end of the time span we're not working in,  and
+keep the 'hot' span.  That used to be done by dumping the whole cache,
+which meant that (say) a long back-integration of a comet,  followed by
+forward ephemerides,  would dump and rebuild the cache over and over.
+
+   By default,  the cache is limited to 10000 nodes (about 630 MBytes).
+PLANET_CACHE_MBYTES in 'environ.dat' can set a different limit.  When
+the first node is evicted,  the new first node is extended back to cover
+all earlier times;  positions for those times will be added to it.  */
+
 #define MAX_N_NODES 10000
 
+static int max_cache_nodes( void)
+{
+   const double mbytes = atof( get_environment_ptr( "PLANET_CACHE_MBYTES"));
+   const double node_bytes = (double)( node_size * sizeof( POSN_CACHE));
+   int rval = MAX_N_NODES;
+
+   if( mbytes > 0.)
+      rval = (int)( mbytes * 1024. * 1024. / node_bytes);
+   return( rval < 3 ? 3 : rval);
+}
+
+static void evict_farthest_node( PLANET_CACHE *pcache, const double jd)
+{
+   POSN_NODE *nodes = pcache->nodes;
+   const int n_nodes = pcache->n_nodes;
+   int evicted_node;
+
+   assert( n_nodes > 2);
+   if( jd - nodes[1].min_jd > nodes[n_nodes - 1].min_jd - jd)
+      evicted_node = 0;
+   else
+      evicted_node = n_nodes - 1;
+   pcache->n_posns_cached -= nodes[evicted_node].used;
+   if( pcache == &default_cache)
+      n_posns_cached -= nodes[evicted_node].used;
+   free( nodes[evicted_node].data);
+   if( !evicted_node)
+      {
+      memmove( nodes, nodes + 1, (n_nodes - 1) * sizeof( POSN_NODE));
+      nodes[0].min_jd = -1e+10;
+      }
+   if( pcache->curr_node && pcache->curr_node >= evicted_node)
+      pcache->curr_node--;
+   pcache->n_nodes--;
+   if( debug_level > 5)
+      debug_printf( "Evicted planet cache node %d of %d\n",
+                           evicted_node, n_nodes);
+}
+
 int planet_posn( const int planet_no, const double jd, double *vect_2000)
 {
-   static POSN_NODE *nodes = NULL;
-   static int n_nodes = 0, n_nodes_alloced = 0, curr_node = 0;
+   return( planet_posn_ctx( NULL, planet_no, jd, vect_2000));
+}
+
+int planet_posn_ctx( INTEGRATION_CONTEXT *ctx, const int planet_no,
+                     const double jd, double *vect_2000)
+{
+   PLANET_CACHE *pcache = (ctx && ctx->planet_cache ?
+                                 ctx->planet_cache : &default_cache);
+   INTEGRATION_COUNTERS *counters = (ctx ? &ctx->counters :
+                                 default_integration_counters( ));
+   POSN_NODE *nodes = pcache->nodes;
+   int n_nodes = pcache->n_nodes, curr_node = pcache->curr_node;
    int loc, rval = 0;
-#ifdef TIMING_ON
    int64_t t_start;
-#endif
    POSN_CACHE *cache;
 
    assert( fabs( jd) < 1e+9);
@@ -442,40 +655,33 @@ int planet_posn( const int planet_no, const double jd, double *vect_2000)
       return( 0);
       }
 
-   if( planet_no < 0 || n_nodes >= MAX_N_NODES)
-      {                                  /* flag to unload everything */
-      int i;
-
-      for( i = 0; i < n_nodes; i++)
-         if( nodes[i].data)
-            free( nodes[i].data);
-      if( nodes)
-         free( nodes);
-      nodes = NULL;
-      n_posns_cached = 0;
-      n_nodes = n_nodes_alloced = curr_node = 0;
-      }
-
    if( planet_no < 0)
-      {
-      planet_posn_raw( -1, 0., NULL);
+      {                                  /* flag to unload everything */
+      if( debug_level && counters->cache_hits + counters->cache_misses)
+         debug_printf( "Planet cache: %ld hits, %ld misses, %ld evictions\n",
+                  counters->cache_hits, counters->cache_misses,
+                  counters->cache_evictions);
+      clear_planet_cache( pcache);
+      if( pcache == &default_cache)
+         planet_posn_raw( ctx, NULL, -1, 0., NULL);
       return( 0);
       }
 
-   if( (planet_no % PLANET_POSN_VELOCITY_OFFSET) == PLANET_POSN_EARTH
-             || (planet_no % PLANET_POSN_VELOCITY_OFFSET) == PLANET_POSN_MOON)
+   if( !PLANET_POSN_IS_ASTEROID( planet_no)
+             && ((planet_no % PLANET_POSN_VELOCITY_OFFSET) == PLANET_POSN_EARTH
+             || (planet_no % PLANET_POSN_VELOCITY_OFFSET) == PLANET_POSN_MOON))
       {
       double moon_loc[3];
       const int vel_offset = (planet_no > PLANET_POSN_VELOCITY_OFFSET ?
                   PLANET_POSN_VELOCITY_OFFSET : 0);
 
-      rval = planet_posn( 3 + vel_offset, jd, vect_2000);   /* first,  get Earth-Moon */
-      if( !rval)                               /* barycenter posn,  then */
-         rval = planet_posn( 10 + vel_offset, jd, moon_loc);    /* lunar offset vect  */
+      rval = planet_posn_ctx( ctx, 3 + vel_offset, jd, vect_2000);
+      if( !rval)       /* first,  get Earth-Moon barycenter posn,  then */
+         rval = planet_posn_ctx( ctx, 10 + vel_offset, jd, moon_loc);
+                                         /* lunar offset vect  */
       if( !rval)
          {
          size_t i;
-         const double EARTH_MOON_BARYCENTER_FACTOR = 82.300679;
          const double factor = (planet_no % PLANET_POSN_VELOCITY_OFFSET == PLANET_POSN_EARTH ?
                      -1. / EARTH_MOON_BARYCENTER_FACTOR :
                  1. - 1. / EARTH_MOON_BARYCENTER_FACTOR);
@@ -486,59 +692,71 @@ int planet_posn( const int planet_no, const double jd, double *vect_2000)
       return( rval);
       }
 
-   if( !nodes || n_nodes == n_nodes_alloced - 1)
+   if( !nodes || n_nodes == pcache->n_nodes_alloced - 1)
       {
-      const unsigned new_n_alloced = 100 + 3 * n_nodes_alloced / 2;
+      const unsigned new_n_alloced = 100 + 3 * pcache->n_nodes_alloced / 2;
 
       nodes = (POSN_NODE *)realloc( nodes, new_n_alloced * sizeof( POSN_NODE));
       assert( nodes);
-      if( !n_nodes_alloced)      /* set up first node : */
+      if( !pcache->n_nodes_alloced)      /* set up first node : */
          {
          n_nodes = 1;
          nodes[0].min_jd = -1e+10;
          nodes[0].used = 0;
          nodes[0].data = (POSN_CACHE *)calloc( node_size, sizeof( POSN_CACHE));
          }
-      n_nodes_alloced = new_n_alloced;
+      pcache->n_nodes_alloced = new_n_alloced;
+      pcache->nodes = nodes;
+      pcache->n_nodes = n_nodes;
       }
 
+   if( !pcache->max_nodes)
+      pcache->max_nodes = max_cache_nodes( );
+   if( n_nodes >= pcache->max_nodes)
+      {
+      evict_farthest_node( pcache, jd);
+      counters->cache_evictions++;
+      n_nodes = pcache->n_nodes;
+      curr_node = pcache->curr_node;
+      }
              /* Now,  find the right node in which to find/store this posn: */
    while( curr_node + 1 < n_nodes && nodes[curr_node + 1].min_jd <= jd)
       curr_node++;
    while( curr_node && jd < nodes[curr_node].min_jd)
       curr_node--;
+   pcache->curr_node = curr_node;
    assert( jd >= nodes[curr_node].min_jd);
    assert( curr_node == n_nodes - 1 || jd < nodes[curr_node + 1].min_jd);
 
    cache = nodes[curr_node].data;
-   loc = find_within_node( planet_no, jd, cache);
-
-#ifdef TIMING_ON
-   t_start = nanoseconds_since_1970( );
-#endif
+   loc = find_within_node( planet_no, jd, cache, counters);
 
    if( !cache[loc].planet_no)
       {
       cache[loc].planet_no = planet_no;
       cache[loc].jd = jd;
       nodes[curr_node].used++;
-      rval = planet_posn_raw( planet_no, jd, cache[loc].vect);
-      n_posns_cached++;
+      counters->cache_misses++;
+      t_start = nanoseconds_since_1970( );
+      rval = planet_posn_raw( ctx, pcache->jpl_eph, planet_no, jd,
+                                                   cache[loc].vect);
+      counters->planet_ns += nanoseconds_since_1970( ) - t_start;
+      pcache->n_posns_cached++;
+      if( pcache == &default_cache)
+         n_posns_cached++;
       }
    else
       {
       assert( cache[loc].planet_no == planet_no);
       assert( cache[loc].jd == jd);
+      counters->cache_hits++;
       memcpy( vect_2000, cache[loc].vect, 3 * sizeof( double));
       return( rval);
       }
-#ifdef TIMING_ON
-   planet_ns += nanoseconds_since_1970( ) - t_start;
-#endif
    memcpy( vect_2000, cache[loc].vect, 3 * sizeof( double));
    assert( nodes[curr_node].used <= splitting_size);
 #ifdef CHECK_CACHING_INTEGRITY
-   if( n_posns_cached % 10000 == 0)
+   if( pcache->n_posns_cached % 10000 == 0)
       check_integrity( nodes, n_nodes);
 #endif
    if( nodes[curr_node].used == splitting_size)
@@ -584,7 +802,7 @@ int planet_posn( const int planet_no, const double jd, double *vect_2000)
          const int n = curr_node + (i < size1 ? 0 : 1);
          POSN_CACHE *cptr = nodes[n].data;
          const int new_loc = find_within_node( tcache[i].planet_no,
-                           tcache[i].jd, cptr);
+                           tcache[i].jd, cptr, NULL);
 
          cptr[new_loc] = tcache[i];
          nodes[n].used++;
@@ -594,7 +812,82 @@ int planet_posn( const int planet_no, const double jd, double *vect_2000)
       check_integrity( nodes, n_nodes);
 #endif
       free( tcache);
+      pcache->n_nodes = n_nodes;
+      pcache->curr_node = curr_node;
+      }
+   return( rval);
+}
+
+/* Gets the positions of the perturbing planets whose bits are set in
+'mask' (bit n = planet n,  as in 'perturbers') at the given JD,  putting
+planet n's position at posns[3 * n].  Slots for planets not requested
+are left alone.  If the moon (bit 10) is included,  posns[9..11] gets the
+earth and posns[30..32] the (heliocentric) moon.  Otherwise,  the moon is
+'thrown in' with the earth,  and posns[9..11] gets the Earth-Moon
+barycenter;  this matches what calc_derivatives() does for perturbers. */
+
+int perturber_posns( const unsigned mask, const double jd, double *posns)
+{
+   return( perturber_posns_ctx( NULL, mask, jd, posns));
+}
+
+int perturber_posns_ctx( INTEGRATION_CONTEXT *ctx, const unsigned mask,
+                     const double jd, double *posns)
+{
+   PLANET_CACHE *pcache = (ctx && ctx->planet_cache ?
+                                 ctx->planet_cache : &default_cache);
+   const int emb_idx = 3, moon_idx = 10;
+   const unsigned earth_bit = (1u << emb_idx), moon_bit = (1u << moon_idx);
+   const unsigned requested = mask & 0x7fe;
+   unsigned needed = requested;
+   epoch_record_t *rec;
+   int i, j, rval = 0;
+
+   if( !pcache->epochs)
+      {
+      pcache->epochs = (epoch_record_t *)calloc( N_EPOCH_RECORDS,
+                                          sizeof( epoch_record_t));
+      assert( pcache->epochs);
+      }
+   rec = pcache->epochs + hash_function( 0, jd) % N_EPOCH_RECORDS;
+   if( rec->jd != jd)
+      {
+      rec->jd = jd;
+      rec->mask = 0;
+      }
+   if( needed & moon_bit)        /* need the EMB to get earth & moon */
+      needed |= earth_bit;
+   for( i = 1; i < N_EPOCH_BODIES; i++)
+      if( ((needed & ~rec->mask) >> i) & 1)
+         {
+         const int err = planet_posn_ctx( ctx, i, jd, rec->posns + i * 3);
+
+         if( err)
+            rval = err;
+         else
+            rec->mask |= (1u << i);
+         }
+   for( i = 1; i < N_EPOCH_BODIES; i++)
+      if( (requested >> i) & 1)
+         memcpy( posns + i * 3, rec->posns + i * 3, 3 * sizeof( double));
+   if( requested & moon_bit)
+      {
+      const double *emb = rec->posns + emb_idx * 3;
+      const double *moon = rec->posns + moon_idx * 3;
+      const double earth_factor = -1. / EARTH_MOON_BARYCENTER_FACTOR;
+      const double moon_factor = 1. - 1. / EARTH_MOON_BARYCENTER_FACTOR;
+
+      for( j = 0; j < 3; j++)
+         {
+         const double emb_j = emb[j], moon_j = moon[j];
+
+         if( requested & earth_bit)
+            posns[emb_idx * 3 + j] = emb_j + moon_j * earth_factor;
+         posns[moon_idx * 3 + j] = emb_j + moon_j * moon_factor;
+         }
       }
+   if( rval)                  /* don't trust a partly-failed record */
+      rec->mask = 0;
    return( rval);
 }
 
@@ -606,8 +899,8 @@ int get_jpl_ephemeris_info( int *de_version, double *jd_start, double *jd_end)
 {
    double vect_2000[3];
 
-   planet_posn_raw( 3, J2000, vect_2000);
-   planet_posn_raw( 0, 0., vect_2000);
+   planet_posn_raw( NULL, NULL, 3, J2000, vect_2000);
+   planet_posn_raw( NULL, NULL, 0, 0., vect_2000);
    if( de_version)
       *de_version = (int)vect_2000[0];
    if( jd_start)
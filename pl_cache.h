@@ -21,6 +21,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
 02110-1301, USA.    */
 
 int planet_posn( const int planet_no, const double jd, double *vect_2000);
+int perturber_posns( const unsigned mask, const double jd, double *posns);
 int format_jpl_ephemeris_info( char *buff);           /* pl_cache.cpp */
 int get_jpl_ephemeris_info( int *de_version, double *jd_start, double *jd_end);
 
@@ -34,3 +35,24 @@ these values can be fed to planet_posn() in such cases.   */
 
 #define PLANET_POSN_EARTH        20
 #define PLANET_POSN_MOON         21
+
+/* The Galilean satellites and five of Saturn's (Tethys,  Dione,  Rhea,
+Titan,  Iapetus) are 'planets' PLANET_POSN_SATELLITE( 11) through
+PLANET_POSN_SATELLITE( 19),  using the perturber numbering in 'runge.cpp'.
+These give positions relative to Jupiter or Saturn,  in ecliptic J2000 AU;
+velocities aren't available.  */
+
+#define PLANET_POSN_SATELLITE( idx)    (100 + (idx))
+
+/* Asteroid perturbers (see 'bc405.cpp') are numbered from
+PLANET_POSN_ASTEROID_BASE up,  in the order they're listed in 'mu1.txt' :
+perturber i is 'planet' PLANET_POSN_ASTEROID( i).  That leaves room for
+millions of them without running into the planets,  the above Earth/Moon
+values,  or PLANET_POSN_VELOCITY_OFFSET.  (Asteroids used to be 100 to
+399,  which capped us at 300 perturbers.)  Add PLANET_POSN_ASTEROID_VELOCITY
+to get an asteroid's velocity instead of its position.  */
+
+#define PLANET_POSN_ASTEROID_BASE      0x10000000
+#define PLANET_POSN_ASTEROID_VELOCITY  0x20000000
+#define PLANET_POSN_ASTEROID( idx)     (PLANET_POSN_ASTEROID_BASE + (idx))
+#define PLANET_POSN_IS_ASTEROID( p)    ((p) >= PLANET_POSN_ASTEROID_BASE)
@@ -18,6 +18,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
 02110-1301, USA.    */
 
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
@@ -33,6 +34,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
 #include "afuncs.h"
 #include "mpc_obs.h"
 #include "constant.h"
+#include "pl_cache.h"
+#include "integrat.h"
 
 #define ldouble long double
 
@@ -45,18 +48,24 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
 #define sqrtl sqrt
 #endif
 
-/* perturbers
-   excluded_perturbers = -1;
+/* The integrator core (calc_derivatives_t(),  take_rk_step_t(),  etc.) is
+templated on the floating-point type,  so it can run in long double (the
+default) or double;  see 'integrat.h'.  These (and fabs_t(),  in
+'integrat.h') make sure each version gets math functions of its own
+precision.  */
+
+static inline double sqrt_t( const double x)        { return( sqrt( x)); }
+static inline long double sqrt_t( const long double x) { return( sqrtl( x)); }
+
+/* The state that changes during integration (perturbers,  best_fit_planet,
+planet_hit,  the planet_posn cache,  the approx_planet_orientation cache,
+etc.) is kept in an INTEGRATION_CONTEXT;  see 'integrat.h'.  The following
+are still globals,  but are set before integrating and not changed by it :
    general_relativity_factor
-   n_orbit_params
-   planet_mass[],  sort of
-   best_fit_planet;
-   best_fit_planet_dist;
+   planet_mass[]
    j2_multiplier
    debug_level
-   approx_planet_orientation
    object_mass
-   (implicitly) planet_posn cache
 */
 
 double object_mass = 0.;
@@ -74,12 +83,6 @@ int planet_posn( const int planet_no, const double jd, double *vect_2000);
                                                 /* mpc_obs.cpp */
 int earth_lunar_posn( const double jd, double FAR *earth_loc, double FAR *lunar_loc);
 const char *get_environment_ptr( const char *env_ptr);     /* mpc_obs.cpp */
-ldouble take_rk_stepl( const ldouble jd, ELEMENTS *ref_orbit,
-                 const ldouble *ival, ldouble *ovals,
-                 const int n_vals, const ldouble step);     /* runge.cpp */
-ldouble take_pd89_step( const ldouble jd, ELEMENTS *ref_orbit,
-                 const ldouble *ival, ldouble *ovals,
-                 const int n_vals, const ldouble step);    /* runge.cpp */
 int symplectic_6( double jd, ELEMENTS *ref_orbit, double *vect,
                                           const double dt);
 int get_planet_posn_vel( const double jd, const int planet_no,
@@ -92,8 +95,10 @@ void find_relative_state_vect( const double jd, const double *ivect,
                double *ovect, const int ref_planet);        /* runge.cpp */
 int find_relative_orbit( const double jd, const double *ivect,
                ELEMENTS *elements, const int ref_planet);     /* runge.cpp */
-static void compute_ref_state( ELEMENTS *ref_orbit, double *ref_state,
-                                          const double jd);
+static void compute_ref_state( INTEGRATION_CONTEXT *ctx, ELEMENTS *ref_orbit,
+                                 double *ref_state, const double jd);
+static int get_planet_posn_vel_ctx( INTEGRATION_CONTEXT *ctx, const double jd,
+                  const int planet_no, double *posn, double *vel);
 int parallax_to_lat_alt( const double rho_cos_phi, const double rho_sin_phi,
        double *lat, double *ht_in_meters, const int planet_idx); /* ephem0.c */
 void calc_approx_planet_orientation( const int planet,        /* runge.cpp */
@@ -127,12 +132,14 @@ double comet_g_func( const ldouble r);                   /* runge.cpp */
 #define IDX_IAPETUS   19
 #define IDX_ASTEROIDS 20
 
-static ldouble vector3_lengthl( const ldouble *vect)
+template <typename T>
+static T vector3_lengthl( const T *vect)
 {
-   return( sqrtl( vect[0] * vect[0] + vect[1] * vect[1] + vect[2] * vect[2]));
+   return( sqrt_t( vect[0] * vect[0] + vect[1] * vect[1] + vect[2] * vect[2]));
 }
 
-static void vector_cross_productl( ldouble *xprod, const ldouble *a, const ldouble *b)
+template <typename T>
+static void vector_cross_productl( T *xprod, const T *a, const T *b)
 {
    xprod[0] = a[1] * b[2] - a[2] * b[1];
    xprod[1] = a[2] * b[0] - a[0] * b[2];
@@ -299,14 +306,8 @@ static void numerical_gradient( double *grad, const double *loc,
 
    if( j3 == EARTH_J3)
       {
-      static int n_terms = -9999;
+      const int n_terms = get_environment_snapshot( )->geo_terms;
                                     /* height in units of earth radii */
-      if( n_terms == -9999)
-         {
-         n_terms = atoi( get_environment_ptr( "GEO_TERMS"));
-         if( !n_terms)
-            n_terms = 3;
-         }
       if( n_terms > 0)     /* n_term <= 0 -> use "usual" J2 & J3 & J4 */
          {
          double ht_above_ground = (r / EARTH_RADIUS_IN_AU) - 1.;
@@ -372,24 +373,25 @@ static void numerical_gradient( double *grad, const double *loc,
 
 double general_relativity_factor = 1.;
 
-static void set_relativistic_accel( ldouble *accel, const ldouble *posnvel)
+template <typename T>
+static void set_relativistic_accel( T *accel, const T *posnvel)
 {
    int i;
-   const ldouble c = AU_PER_DAY;           /* speed of light in AU per day */
-   const ldouble r_squared = posnvel[0] * posnvel[0] + posnvel[1] * posnvel[1]
+   const T c = AU_PER_DAY;           /* speed of light in AU per day */
+   const T r_squared = posnvel[0] * posnvel[0] + posnvel[1] * posnvel[1]
                                                      + posnvel[2] * posnvel[2];
-   const ldouble v_squared = posnvel[3] * posnvel[3] + posnvel[4] * posnvel[4]
+   const T v_squared = posnvel[3] * posnvel[3] + posnvel[4] * posnvel[4]
                                                      + posnvel[5] * posnvel[5];
-   const ldouble v_dot_r   = posnvel[0] * posnvel[3] + posnvel[1] * posnvel[4]
+   const T v_dot_r   = posnvel[0] * posnvel[3] + posnvel[1] * posnvel[4]
                                                      + posnvel[2] * posnvel[5];
-   const ldouble r = sqrtl( r_squared), r_cubed_c_squared = r_squared * r * c * c;
+   const T r = sqrt_t( r_squared), r_cubed_c_squared = r_squared * r * c * c;
 #ifndef PREVIOUS_EQUATION
    const double r_component =
                   (4. * SOLAR_GM / r - v_squared) / r_cubed_c_squared;
    const double v_component = 4. * v_dot_r / r_cubed_c_squared;
 #else
-   const ldouble v_component = 3. * v_dot_r / r_cubed_c_squared;
-   const ldouble r_component = 0.;
+   const T v_component = 3. * v_dot_r / r_cubed_c_squared;
+   const T r_component = 0.;
 #endif
 
    for( i = 0; i < 3; i++)
@@ -596,33 +598,39 @@ true forever... at some point,  I may want to add tesseral harmonics for,
 say,  the Moon or Mars.  If that happens,  this code will need revising,
 perhaps with a table of omega values. */
 
-void calc_approx_planet_orientation( const int planet,
-         const int system_number, const double jde, double *matrix)
+static void calc_approx_planet_orientation_ctx( INTEGRATION_CONTEXT *ctx,
+         const int planet, const int system_number, const double jde,
+         double *matrix)
 {
-   static double cached_matrix[9];
-   static double cached_jde = 0.;
-   static int cached_planet = -1;
    const double range = 1.;
    const double new_jde = floor( jde / range + .5) * range;
 
-   if( cached_planet != planet || new_jde != cached_jde)
+   if( ctx->orientation_planet != planet || new_jde != ctx->orientation_jde)
       {
       const double ut = new_jde - td_minus_ut( new_jde) / seconds_per_day;
 
-      calc_planet_orientation( planet, system_number, ut, cached_matrix);
-      cached_planet = planet;
-      cached_jde = new_jde;
+      calc_planet_orientation( planet, system_number, ut,
+                                       ctx->orientation_matrix);
+      ctx->orientation_planet = planet;
+      ctx->orientation_jde = new_jde;
       }
-   memcpy( matrix, cached_matrix, 9 * sizeof( double));
+   memcpy( matrix, ctx->orientation_matrix, 9 * sizeof( double));
    if( planet == 3)        /* rotate matrix */
       {
       const double omega = 360.9856235 * PI / 180.;
-      const double theta = omega * (jde - cached_jde);
+      const double theta = omega * (jde - ctx->orientation_jde);
 
       spin_matrix( matrix, matrix + 3, theta);
       }
 }
 
+void calc_approx_planet_orientation( const int planet,
+         const int system_number, const double jde, double *matrix)
+{
+   calc_approx_planet_orientation_ctx( default_integration_context( ),
+                  planet, system_number, jde, matrix);
+}
+
 /* The idea of the following is as follows.  If our distance from the sun
 is more than 120% of the planet's semimajor axis (given in the 'radii'
 table),  we throw its entire mass into the sun.  (Assuming it's not
@@ -632,13 +640,15 @@ up the mass thrown into the sun linearly.  The reason for this is to avoid
 a discontinuity,  and to instead have a gradual,  linear increase in the
 mass we use for the sun.         */
 
-static ldouble include_thrown_in_planets( const ldouble r)
+template <typename T>
+static T include_thrown_in_planets( const T r,
+                                       const unsigned perturbers)
 {
    const int n_radii = 9;
-   const ldouble radii[9] = { 0., .38709927, .72333566, 1.00000261,
+   const T radii[9] = { 0., .38709927, .72333566, 1.00000261,
                1.52371034, 5.20288799, 9.53667594,  19.18916464,  30.06992276};
-   const ldouble fraction = .2;
-   ldouble rval = 1.;
+   const T fraction = .2;
+   T rval = 1.;
    int i;
 
    for( i = 1; i < n_radii && r > radii[i]; i++)
@@ -748,6 +758,151 @@ static ldouble atmospheric_density( const ldouble ht_in_km)
 unsigned excluded_perturbers = (unsigned)-1;
 int best_fit_planet;
 double best_fit_planet_dist;
+int planet_hit = -1;
+
+/* The default context is what the 'usual' functions (calc_derivativesl(),
+integrate_orbit(),  etc.) use.  Its inputs are copied from the globals each
+time it's requested,  and its outputs are copied back to the globals by
+update_globals_from_context().  See 'integrat.h'.     */
+
+static INTEGRATION_CONTEXT default_ctx;
+
+static void copy_globals_to_context( INTEGRATION_CONTEXT *ctx)
+{
+   ctx->perturbers = perturbers;
+   ctx->excluded_perturbers = excluded_perturbers;
+   ctx->n_orbit_params = n_orbit_params;
+}
+
+INTEGRATION_CONTEXT *default_integration_context( void)
+{
+   if( !default_ctx.n_orbit_params)      /* first call */
+      default_ctx.orientation_planet = -1;
+   copy_globals_to_context( &default_ctx);
+   return( &default_ctx);
+}
+
+/* Unlike default_integration_context(),  this doesn't reset the default
+context's inputs from the globals,  so it's safe to call in the middle of
+an integration using the default context.   */
+
+INTEGRATION_COUNTERS *default_integration_counters( void)
+{
+   return( &default_ctx.counters);
+}
+
+void update_globals_from_context( const INTEGRATION_CONTEXT *ctx)
+{
+   perturbers = ctx->perturbers;
+   best_fit_planet = ctx->best_fit_planet;
+   best_fit_planet_dist = ctx->best_fit_planet_dist;
+   planet_hit = ctx->planet_hit;
+}
+
+/* A new context gets its own planet and asteroid position caches (and
+ephemeris file handles),  but otherwise starts out as a copy of the
+default context.  The call to get_jpl_ephemeris_info() ensures the JPL
+ephemeris is loaded before any threads get started.       */
+
+INTEGRATION_CONTEXT *create_integration_context( void)
+{
+   INTEGRATION_CONTEXT *ctx =
+                 (INTEGRATION_CONTEXT *)calloc( 1, sizeof( INTEGRATION_CONTEXT));
+
+   assert( ctx);
+   if( ctx)
+      {
+      get_jpl_ephemeris_info( NULL, NULL, NULL);
+      get_environment_snapshot( );     /* make sure it exists before */
+      copy_globals_to_context( ctx);   /* any threads are started    */
+      ctx->planet_hit = -1;
+      ctx->orientation_planet = -1;
+      ctx->planet_cache = alloc_planet_cache( );
+      ctx->asteroid_cache = alloc_asteroid_cache( );
+      }
+   return( ctx);
+}
+
+static void free_radau_state( RADAU_STATE *rs);
+
+void free_integration_context( INTEGRATION_CONTEXT *ctx)
+{
+   if( ctx && ctx != &default_ctx)
+      {
+      free_planet_cache( ctx->planet_cache);
+      free_asteroid_cache( ctx->asteroid_cache);
+      free_radau_state( ctx->radau_state);
+      free( ctx);
+      }
+}
+
+/* Adds (sign = 1) or subtracts (sign = -1) one set of counters to/from
+another.  Subtracting the counters as they were before an object was
+processed from those afterward gives the work done on that object;  adding
+those up over several contexts gives the totals.  'max_probes' is a
+maximum,  not a sum,  and is handled accordingly.  */
+
+void add_integration_counters( INTEGRATION_COUNTERS *sum,
+            const INTEGRATION_COUNTERS *counters, const int sign)
+{
+   sum->n_derivs             += sign * counters->n_derivs;
+   sum->n_steps              += sign * counters->n_steps;
+   sum->n_rejects            += sign * counters->n_rejects;
+   sum->cache_hits           += sign * counters->cache_hits;
+   sum->cache_misses         += sign * counters->cache_misses;
+   sum->cache_probes         += sign * counters->cache_probes;
+   sum->cache_evictions      += sign * counters->cache_evictions;
+   sum->perturber_candidates += sign * counters->perturber_candidates;
+   sum->perturbers_used      += sign * counters->perturbers_used;
+   sum->integration_ns       += sign * counters->integration_ns;
+   sum->planet_ns            += sign * counters->planet_ns;
+   sum->perturber_ns         += sign * counters->perturber_ns;
+   if( sign > 0 && sum->max_probes < counters->max_probes)
+      sum->max_probes = counters->max_probes;
+}
+
+/* Writes counters as a JSON object,  with times in seconds.  Note that
+'n_steps' counts every step tried,  including rejected ones.  The times
+overlap :  'planet_posns' includes computing asteroid positions,  and it
+and 'asteroid_perturbers' are both part of 'integration'.  */
+
+int write_integration_counters_json( FILE *ofile,
+            const INTEGRATION_COUNTERS *counters, const double elapsed_seconds)
+{
+   fprintf( ofile, "{\n  \"counters\":\n  {\n");
+   fprintf( ofile, "    \"elapsed\": %.6f,\n", elapsed_seconds);
+   fprintf( ofile, "    \"derivatives\": %ld,\n", counters->n_derivs);
+   fprintf( ofile, "    \"steps_accepted\": %ld,\n",
+                              counters->n_steps - counters->n_rejects);
+   fprintf( ofile, "    \"steps_rejected\": %ld,\n", counters->n_rejects);
+   fprintf( ofile, "    \"planet_cache\": { \"hits\": %ld, \"misses\": %ld, "
+                     "\"probes\": %ld, \"max_probes\": %ld, \"evictions\": %ld },\n",
+                     counters->cache_hits, counters->cache_misses,
+                     counters->cache_probes, counters->max_probes,
+                     counters->cache_evictions);
+   fprintf( ofile, "    \"asteroid_perturbers\": { \"candidates\": %ld, "
+                     "\"used\": %ld },\n",
+                     counters->perturber_candidates, counters->perturbers_used);
+   fprintf( ofile, "    \"seconds\": { \"integration\": %.6f, "
+                     "\"planet_posns\": %.6f, \"asteroid_perturbers\": %.6f }\n",
+                     (double)counters->integration_ns * 1e-9,
+                     (double)counters->planet_ns * 1e-9,
+                     (double)counters->perturber_ns * 1e-9);
+   fprintf( ofile, "  }\n}\n");
+   return( 0);
+}
+
+/* Gets the earth and/or moon positions,  as earth_lunar_posn() does,  but
+through the context's planet position cache.   */
+
+static void earth_lunar_posn_ctx( INTEGRATION_CONTEXT *ctx, const double jd,
+                           double *earth_loc, double *lunar_loc)
+{
+   if( earth_loc)
+      planet_posn_ctx( ctx, PLANET_POSN_EARTH, jd, earth_loc);
+   if( lunar_loc)
+      planet_posn_ctx( ctx, PLANET_POSN_MOON, jd, lunar_loc);
+}
 
 /* The Earth and Moon pose a special problem in the following function.
 The way we want things to work is this:  if the earth's perturbations are
@@ -805,8 +960,9 @@ for real non-gravs to kick in.  Given a 'current' state vector and
 jd,  this computes a two-body approximate distance from the sun as
 of the time jd - lag.        */
 
-static double lagged_dist( const ldouble *state_vect, const ldouble jd,
-                             const ldouble lag)
+template <typename T>
+static double lagged_dist( INTEGRATION_CONTEXT *ctx,
+             const T *state_vect, const T jd, const T lag)
 {
    double svect[6], outvect[9], rval;
    size_t i;
@@ -814,8 +970,8 @@ static double lagged_dist( const ldouble *state_vect, const ldouble jd,
 
    for( i = 0; i < 6; i++)
       svect[i] = (double)state_vect[i];
-   find_relative_orbit( (double)jd, svect, &elem, 0);
-   compute_ref_state( &elem, outvect, (double)( jd - lag));
+   find_relative_orbit_ctx( ctx, (double)jd, svect, &elem, 0);
+   compute_ref_state( ctx, &elem, outvect, (double)( jd - lag));
    rval = vector3_length( outvect);
    return( rval);
 }
@@ -827,64 +983,128 @@ static ldouble planet_radius( const int idx)
    return( planet_radius_in_meters( idx) * FUDGE_FACTOR / AU_IN_METERS);
 }
 
-int planet_hit = -1;
+/* If ctx->n_variational_eqns is non-zero,  calc_derivatives_ctx() gives the
+derivatives for the 'variational equations':  the partial derivatives of
+the position and velocity with respect to each of the first
+n_variational_eqns orbital parameters.  These follow the orbital parameters
+in ival[] and oval[],  six per parameter (three for d(posn)/dp,  three for
+d(vel)/dp).  Integrating them along with the orbit gets us the partials
+needed for least-squares fitting at every observation time,  with one
+integration instead of one (or two) per parameter.
+
+   The rate of change of d(posn)/dp is just d(vel)/dp.  That of d(vel)/dp
+is G * d(posn)/dp,  where G is the gradient of the acceleration with respect
+to position,  plus (for non-gravitational parameters) the direct partial of
+the acceleration with respect to that parameter.  G is computed only for
+point-mass attraction from the sun and planets (and moons,  if included).
+Relativity,  J2 and higher,  drag,  asteroid perturbations,  and the way
+non-gravs depend on position are left out.  Far from the planets,  that
+changes the partials very slightly.  Near the earth,  it doesn't,  and the
+covariance (and sigmas and Monte Carlo variants) would be wrong;  so
+n_variational_partials() in 'orb_func.cpp' falls back to numerical
+partials for such objects.  */
+
+template <typename T>
+static void add_point_mass_gradient( T *grad, const double *delta,
+                     const T accel_factor)
+{
+   const T r2 = delta[0] * delta[0] + delta[1] * delta[1]
+                    + delta[2] * delta[2];
+   size_t i, j;
 
-int calc_derivativesl( const ldouble jd, const ldouble *ival, ldouble *oval,
-                           const int reference_planet)
+   for( i = 0; i < 3; i++)
+      for( j = 0; j < 3; j++)
+         grad[i * 3 + j] += accel_factor * ((i == j ? 1. : 0.)
+                                    - 3. * delta[i] * delta[j] / r2);
+}
+
+template <typename T>
+static void set_variational_derivs( const INTEGRATION_CONTEXT *ctx,
+                     const T *ival, T *oval,
+                     const T *grad, T nongrav_partials[][3])
+{
+   int i, j;
+
+   for( i = 0; i < ctx->n_variational_eqns; i++)
+      {
+      const T *dp = ival + ctx->n_orbit_params + 6 * i;
+      T *odp = oval + ctx->n_orbit_params + 6 * i;
+
+      for( j = 0; j < 3; j++)
+         {
+         odp[j] = dp[j + 3];
+         odp[j + 3] = grad[j * 3] * dp[0] + grad[j * 3 + 1] * dp[1]
+                    + grad[j * 3 + 2] * dp[2] + nongrav_partials[i][j];
+         }
+      }
+}
+
+template <typename T>
+static int calc_derivatives_t( INTEGRATION_CONTEXT *ctx, const T jd,
+            const T *ival, T *oval, const int reference_planet)
 {
-   ldouble r, r2 = 0., solar_accel = 1. + object_mass;
-   ldouble accel_multiplier = 1.;
+   T r, r2 = 0., solar_accel = 1. + object_mass;
+   T accel_multiplier = 1.;
    int i, j;
-   unsigned local_perturbers = perturbers;
-   double lunar_loc[3], jupiter_loc[3], saturn_loc[3];
-   ldouble relativistic_accel[3];
+   unsigned local_perturbers = ctx->perturbers;
+   double jupiter_loc[3], saturn_loc[3], planet_posns[11 * 3];
+   T relativistic_accel[3];
    double fraction_illum = 1., ival_as_double[3];
+   T grad[9], nongrav_partials[MAX_N_PARAMS][3];
    extern int force_model;
    static const double sphere_of_influence_radius[10] = {
             10000., 0.00075, 0.00412, 0.00618,   /* sun, mer, ven, ear */
             0.00386, 0.32229, 0.36466, 0.34606,  /* mar, jup, sat, ura */
             0.57928, 0.02208 };                  /* nep, plu */
 
-   assert( fabsl( jd) < 1e+9);
+   assert( fabs_t( jd) < 1e+9);
+   ctx->counters.n_derivs++;
 #if !defined( _WIN32) && !defined( __APPLE__)
    for( i = 0; i < 6; i++)
-      if( isnanl( ival[i]))
+      if( isnanl( (long double)ival[i]))
          {
-         debug_printf( "Bad derivs; jd %Lf; ref %d\n", jd, reference_planet);
-         debug_printf( "%Lf %Lf %Lf\n", ival[0], ival[1], ival[2]);
-         debug_printf( "%Lf %Lf %Lf\n", ival[3], ival[4], ival[5]);
+         debug_printf( "Bad derivs; jd %f; ref %d\n", (double)jd, reference_planet);
+         debug_printf( "%f %f %f\n", (double)ival[0], (double)ival[1], (double)ival[2]);
+         debug_printf( "%f %f %f\n", (double)ival[3], (double)ival[4], (double)ival[5]);
          assert( 0);
          }
-   assert( !isnanl( ival[0]));
-   assert( !isnanl( ival[1]));
-   assert( !isnanl( ival[2]));
-   assert( !isnanl( ival[3]));
-   assert( !isnanl( ival[4]));
-   assert( !isnanl( ival[5]));
+   assert( !isnanl( (long double)ival[0]));
+   assert( !isnanl( (long double)ival[1]));
+   assert( !isnanl( (long double)ival[2]));
+   assert( !isnanl( (long double)ival[3]));
+   assert( !isnanl( (long double)ival[4]));
+   assert( !isnanl( (long double)ival[5]));
 #endif
    oval[0] = ival[3];
    oval[1] = ival[4];
    oval[2] = ival[5];
+   if( ctx->n_variational_eqns)
+      {
+      memset( oval + 6, 0, (ctx->n_orbit_params - 6
+                     + 6 * ctx->n_variational_eqns) * sizeof( T));
+      memset( grad, 0, sizeof( grad));
+      memset( nongrav_partials, 0, sizeof( nongrav_partials));
+      }
    for( i = 0; i < 3; i++)
       ival_as_double[i] = (double)ival[i];
-   best_fit_planet = 0;
-   planet_hit = -1;
+   ctx->best_fit_planet = 0;
+   ctx->planet_hit = -1;
    for( i = 0; i < 3; i++)
       r2 += ival[i] * ival[i];
-   r = sqrtl( r2);
-   if( n_orbit_params > 6) /* decrease non-gravs when in earth's shadow */
+   r = sqrt_t( r2);
+   if( ctx->n_orbit_params > 6) /* decrease non-gravs when in earth's shadow */
       {
       double earth_loc[3];
 
-      earth_lunar_posn( jd, earth_loc, NULL);
+      earth_lunar_posn_ctx( ctx, jd, earth_loc, NULL);
       fraction_illum = shadow_check( earth_loc, ival_as_double, EARTH_RADIUS_IN_AU);
       }
    if( force_model == FORCE_MODEL_SRP)
       solar_accel -= ival[6] * fraction_illum;
-   if( r < planet_radius( 0))     /* special fudge to keep acceleration from reaching */
+   if( r < (T)planet_radius( 0))  /* special fudge to keep acceleration from reaching */
       {                          /* infinity inside the sun;  see above notes        */
-      accel_multiplier = compute_accel_multiplier( r / planet_radius( 0));
-      planet_hit = 0;
+      accel_multiplier = compute_accel_multiplier( r / (T)planet_radius( 0));
+      ctx->planet_hit = 0;
       if( debug_level)
          debug_printf( "Inside the sun: %f km\n", (double)r * AU_IN_KM);
       if( !accel_multiplier)
@@ -897,17 +1117,26 @@ int calc_derivativesl( const ldouble jd, const ldouble *ival, ldouble *oval,
 
    solar_accel *= -SOLAR_GM / (r2 * r);
 
-   if( perturbers)
+   if( ctx->perturbers)
       set_relativistic_accel( relativistic_accel, ival);
    else                           /* shut off relativity if no perturbers */
       for( i = 0; i < 3; i++)
          relativistic_accel[i] = 0.;
 
-   solar_accel *= include_thrown_in_planets( r);
+   solar_accel *= include_thrown_in_planets( r, ctx->perturbers);
 
    for( i = 0; i < 3; i++)
       oval[i + 3] = solar_accel * ival[i]
                  + SOLAR_GM * relativistic_accel[i];
+   if( ctx->n_variational_eqns)
+      {
+      add_point_mass_gradient( grad, ival_as_double, solar_accel);
+      if( force_model == FORCE_MODEL_SRP)
+         for( i = 0; i < 3; i++)
+            nongrav_partials[6][i] = SOLAR_GM * fraction_illum
+                        * include_thrown_in_planets( r, ctx->perturbers)
+                        * ival[i] / (r2 * r);
+      }
 
    if( (local_perturbers >> IDX_ASTEROIDS) & 1)
       if( r < 11.5 && r > 1.)
@@ -916,21 +1145,23 @@ int calc_derivativesl( const ldouble jd, const ldouble *ival, ldouble *oval,
 
          for( i = 3; i < 6; i++)
             asteroid_accel[i] = 0.;
-         detect_perturbers( jd, ival_as_double, asteroid_accel);        /* bc405.cpp */
+         detect_perturbers_ctx( ctx, jd, ival_as_double, asteroid_accel);
          for( i = 3; i < 6; i++)
             oval[i] += asteroid_accel[i];
          }
 
-   if( (n_orbit_params >= 8 && n_orbit_params <= 10) || force_model == FORCE_MODEL_YARKO_A2)
+   if( (ctx->n_orbit_params >= 8 && ctx->n_orbit_params <= 10)
+                  || force_model == FORCE_MODEL_YARKO_A2)
       {                  /* Marsden & Sekanina comet formula */
-      const ldouble lag = (n_orbit_params == 10 ? ival[9] : 0.);
-      const ldouble g = comet_g_func( lagged_dist( ival, jd, lag)) * fraction_illum;
-      ldouble transverse[3], dot_prod = 0.;
+      const T lag = (ctx->n_orbit_params == 10 ? ival[9] : 0.);
+      const T g = comet_g_func( lagged_dist( ctx, ival, jd, lag))
+                                          * fraction_illum;
+      T transverse[3], dot_prod = 0.;
 
 #if !defined( _WIN32) && !defined( __APPLE__)
-      assert( !isnanl( g));
+      assert( !isnanl( (long double)g));
 #endif
-      memcpy( transverse, ival + 3, 3 * sizeof( ldouble));
+      memcpy( transverse, ival + 3, 3 * sizeof( T));
       for( i = 0; i < 3; i++)
          dot_prod += transverse[i] * ival[i];
       for( i = 0; i < 3; i++)
@@ -938,53 +1169,49 @@ int calc_derivativesl( const ldouble jd, const ldouble *ival, ldouble *oval,
       dot_prod = vector3_lengthl( transverse);
       if( force_model == FORCE_MODEL_YARKO_A2)
          for( i = 0; i < 3; i++)
+            {
             oval[i + 3] += g * (ival[6] * transverse[i] / dot_prod);
+            nongrav_partials[6][i] = g * transverse[i] / dot_prod;
+            }
       else
          for( i = 0; i < 3; i++)
+            {
             oval[i + 3] += g * (ival[6] * ival[i] / r
                      + ival[7] * transverse[i] / dot_prod);
-      if( n_orbit_params >= 9)
+            nongrav_partials[6][i] = g * ival[i] / r;
+            nongrav_partials[7][i] = g * transverse[i] / dot_prod;
+            }
+      if( ctx->n_orbit_params >= 9)
          {
-         ldouble out_of_plane[3];
+         T out_of_plane[3];
 
          vector_cross_productl( out_of_plane, ival, transverse);
          dot_prod = vector3_lengthl( out_of_plane);
          for( i = 0; i < 3; i++)
+            {
             oval[i + 3] += g * ival[8] * out_of_plane[i] / dot_prod;
+            nongrav_partials[8][i] = g * out_of_plane[i] / dot_prod;
+            }
          }
       }
    for( i = 0; i < 3; i++)       /* redundant initialization */
       jupiter_loc[i] = 0.;       /* to avoid gcc-13 warning  */
 
-   if( perturbers)
+   if( ctx->perturbers)          /* get all planets' positions at once */
+      perturber_posns_ctx( ctx, local_perturbers & ~ctx->excluded_perturbers,
+                                    jd, planet_posns);
+   if( ctx->perturbers)
       for( i = 1; i < N_PERTURB + 1; i++)
          if( ((local_perturbers >> i) & 1)
-                   && !((excluded_perturbers >> i) & 1))
+                   && !((ctx->excluded_perturbers >> i) & 1))
             {
             double planet_loc[15], accel[3], mass_to_use = planet_mass[i];
 
             r = r2 = 0.;
             if( i >= IDX_IO)       /* Galileans,  Titan */
                {
-               double matrix[10], sat_loc[15];
-               const double t_years = (jd - J2000) / 365.25;
-
-               if( i >= IDX_TETHYS)         /* Saturnian satell */
-                  calc_ssat_loc( jd, sat_loc,
-                               ((i == IDX_IAPETUS) ? 7 : i - 13), 0L);
-               else
-                  {
-                  calc_jsat_loc( jd, sat_loc, 1 << (i - IDX_IO), 0L);
-                  memmove( sat_loc, sat_loc + (i - IDX_IO) * 3,
-                                                      3 * sizeof( double));
-                  }
-                                 /* turn ecliptic of date to equatorial: */
-               rotate_vector( sat_loc, mean_obliquity( t_years / 100.), 0);
-                                 /* then to equatorial J2000: */
-               setup_precession( matrix, 2000. + t_years, 2000.);
-               precess_vector( matrix, sat_loc, planet_loc + 12);
-                                 /* then to ecliptic J2000: */
-               equatorial_to_ecliptic( planet_loc + 12);
+               planet_posn_ctx( ctx, PLANET_POSN_SATELLITE( i), jd,
+                                               planet_loc + 12);
                for( j = 0; j < 3; j++)
                   {
                   double coord;
@@ -992,26 +1219,16 @@ int calc_derivativesl( const ldouble jd, const ldouble *ival, ldouble *oval,
                   if( i >= IDX_TETHYS)         /* Saturnian */
                      coord = saturn_loc[j] + planet_loc[12 + j];
                   else
-                     coord = jupiter_loc[j] + planet_loc[12 + j] * JUPITER_R;
+                     coord = jupiter_loc[j] + planet_loc[12 + j];
                   r2 += coord * coord;
                   planet_loc[12 + j] = coord;
                   }
                planet_loc[2] = sqrt( r2);
                }
             else
-               {
-               if( local_perturbers & 1024)   /* if the moon is included */
-                  {
-                  if( i == 3)
-                     earth_lunar_posn( jd, planet_loc, lunar_loc);
-                  else if( i == 10)
-                     memcpy( planet_loc, lunar_loc, 3 * sizeof( double));
-                  else
-                     planet_posn( i, jd, planet_loc);
-                  }
-               else
-                  planet_posn( i, jd, planet_loc);
-
+               {        /* if the moon is included,  these are the earth */
+                        /* and moon;  otherwise,  the EMB (see pl_cache.cpp) */
+               memcpy( planet_loc, planet_posns + i * 3, 3 * sizeof( double));
                for( j = 0; j < 3; j++)
                   r2 += planet_loc[j] * planet_loc[j];
                memcpy( planet_loc + 12, planet_loc, 3 * sizeof( double));
@@ -1043,15 +1260,15 @@ int calc_derivativesl( const ldouble jd, const ldouble *ival, ldouble *oval,
                   mass_to_use = MASS_SATURN_SYSTEM;
                }
 
-            if( r < planet_radius( i))
+            if( r < (T)planet_radius( i))
                {
-               accel_multiplier = compute_accel_multiplier( r / planet_radius( i));
-               planet_hit = i;
+               accel_multiplier = compute_accel_multiplier( r / (T)planet_radius( i));
+               ctx->planet_hit = i;
                if( accel_multiplier == 0.)
                   {
                   for( i = 3; i < 6; i++)
                      oval[i] = 0.;
-                  return( planet_hit);
+                  return( ctx->planet_hit);
                   }
                }
             if( i >= IDX_EARTH && i <= IDX_NEPTUNE && r < .015 && j2_multiplier)
@@ -1064,7 +1281,7 @@ int calc_derivativesl( const ldouble jd, const ldouble *ival, ldouble *oval,
                const double j4[6] = { EARTH_J4, MARS_J4, JUPITER_J4,
                         SATURN_J4, URANUS_J4, NEPTUNE_J4 };
 
-               calc_approx_planet_orientation( i, 0, jd, matrix);
+               calc_approx_planet_orientation_ctx( ctx, i, 0, jd, matrix);
                            /* Remembering the 'accels' are 'deltas' now... */
                memcpy( delta_j2000, accel, 3 * sizeof( double));
                            /* Cvt ecliptic to equatorial 2000...: */
@@ -1086,8 +1303,9 @@ int calc_derivativesl( const ldouble jd, const ldouble *ival, ldouble *oval,
                            /* And add 'em to the output acceleration: */
                for( j = 0; j < 3; j++)
                   oval[j + 3] -= j2_multiplier * delta_j2000[j];
-               if( i == IDX_EARTH && r < ATMOSPHERIC_LIMIT && n_orbit_params == 7
-                           && *get_environment_ptr( "DRAG_SHUTOFF") != '1')
+               if( i == IDX_EARTH && r < ATMOSPHERIC_LIMIT
+                           && ctx->n_orbit_params == 7
+                           && !get_environment_snapshot( )->drag_shutoff)
                   {
                   const double SRP1AU = 2.3e-7;   /* kg*AU^3 / (m^2*d^2) */
                   const double amr_drag = ival[6] * SOLAR_GM / SRP1AU;
@@ -1107,7 +1325,7 @@ int calc_derivativesl( const ldouble jd, const ldouble *ival, ldouble *oval,
                   parallax_to_lat_alt( rho_cos_phi, rho_sin_phi, NULL,
                                     &ht_in_meters, i);
                   rho = atmospheric_density( ht_in_meters / meters_per_km);
-                  earth_lunar_posn( jd + dt, earth_loc, NULL);
+                  earth_lunar_posn_ctx( ctx, jd + dt, earth_loc, NULL);
                   for( j = 0; j < 3; j++)
                      {
                                     /* in degrees/day,  sidereal... */
@@ -1140,24 +1358,26 @@ int calc_derivativesl( const ldouble jd, const ldouble *ival, ldouble *oval,
                      /* being included separately,  add the mass of the moon:*/
             if( i == IDX_EARTH)
                if( !((local_perturbers >> IDX_MOON) & 1) ||
-                    ((excluded_perturbers >> IDX_MOON) & 1))
+                    ((ctx->excluded_perturbers >> IDX_MOON) & 1))
                   mass_to_use += planet_mass[IDX_MOON];
 
 
             if( i < 10 && r < sphere_of_influence_radius[i]
                                 && reference_planet != -1)
                {
-               best_fit_planet = i;
-               best_fit_planet_dist = r;
+               ctx->best_fit_planet = i;
+               ctx->best_fit_planet_dist = r;
                }
 
 /*          if( accel_multiplier)  */
                {
-               const ldouble accel_factor =
+               const T accel_factor =
                                -SOLAR_GM * mass_to_use / (r * r * r);
 
                for( j = 0; j < 3; j++)
                   oval[j + 3] += accel_factor * accel[j];
+               if( ctx->n_variational_eqns)
+                  add_point_mass_gradient( grad, accel, accel_factor);
                }
             if( i != reference_planet)
                {
@@ -1165,7 +1385,8 @@ int calc_derivativesl( const ldouble jd, const ldouble *ival, ldouble *oval,
                   {
                   double planet_posn[3];
 
-                  get_planet_posn_vel( jd, reference_planet, planet_posn, NULL);
+                  get_planet_posn_vel_ctx( ctx, jd, reference_planet,
+                                                   planet_posn, NULL);
                   for( j = 0; j < 3; j++)
                      planet_loc[j + 12] -= planet_posn[j];
                   r = vector3_length( planet_loc + 12);
@@ -1186,10 +1407,35 @@ int calc_derivativesl( const ldouble jd, const ldouble *ival, ldouble *oval,
                   oval[j + 3] += r * planet_loc[j + 12];
                }
             }
-   if( planet_hit != -1)
+   if( ctx->planet_hit != -1)
       for( j = 3; j < 6; j++)
          oval[j] *= accel_multiplier;
-   return( planet_hit);
+   if( ctx->n_variational_eqns)
+      set_variational_derivs( ctx, ival, oval, grad, nongrav_partials);
+   return( ctx->planet_hit);
+}
+
+int calc_derivatives_ctx( INTEGRATION_CONTEXT *ctx, const ldouble jd,
+            const ldouble *ival, ldouble *oval, const int reference_planet)
+{
+   return( calc_derivatives_t( ctx, jd, ival, oval, reference_planet));
+}
+
+int calc_derivatives_ctx( INTEGRATION_CONTEXT *ctx, const double jd,
+            const double *ival, double *oval, const int reference_planet)
+{
+   return( calc_derivatives_t( ctx, jd, ival, oval, reference_planet));
+}
+
+int calc_derivativesl( const ldouble jd, const ldouble *ival, ldouble *oval,
+                           const int reference_planet)
+{
+   INTEGRATION_CONTEXT *ctx = default_integration_context( );
+   const int rval = calc_derivatives_ctx( ctx, jd, ival, oval,
+                                                  reference_planet);
+
+   update_globals_from_context( ctx);
+   return( rval);
 }
 
 int calc_derivatives( const double jd, const double *ival, double *oval,
@@ -1209,8 +1455,8 @@ int calc_derivatives( const double jd, const double *ival, double *oval,
    return( rval);
 }
 
-int get_planet_posn_vel( const double jd, const int planet_no,
-                     double *posn, double *vel)
+static int get_planet_posn_vel_ctx( INTEGRATION_CONTEXT *ctx, const double jd,
+                  const int planet_no, double *posn, double *vel)
 {
    assert( fabs( jd) < 1e+9);
    if( posn)
@@ -1218,11 +1464,11 @@ int get_planet_posn_vel( const double jd, const int planet_no,
       if( !planet_no)       /* sun doesn't move in the heliocentric frame */
          memset( posn, 0, 3 * sizeof( double));
       else if( planet_no == 3)
-         earth_lunar_posn( jd, posn, NULL);
+         earth_lunar_posn_ctx( ctx, jd, posn, NULL);
       else if( planet_no == 10)
-         earth_lunar_posn( jd, NULL, posn);
+         earth_lunar_posn_ctx( ctx, jd, NULL, posn);
       else
-         planet_posn( planet_no, jd, posn);
+         planet_posn_ctx( ctx, planet_no, jd, posn);
       }
    if( vel)
       {
@@ -1234,8 +1480,8 @@ int get_planet_posn_vel( const double jd, const int planet_no,
          double loc1[3], loc2[3];
          const double delta = 1. / minutes_per_day;    /* one minute delta... */
 
-         get_planet_posn_vel( jd + delta, planet_no, loc2, NULL);
-         get_planet_posn_vel( jd - delta, planet_no, loc1, NULL);
+         get_planet_posn_vel_ctx( ctx, jd + delta, planet_no, loc2, NULL);
+         get_planet_posn_vel_ctx( ctx, jd - delta, planet_no, loc1, NULL);
          for( i = 0; i < 3; i++)
             vel[i] = (loc2[i] - loc1[i]) / (2. * delta);
          }
@@ -1243,30 +1489,47 @@ int get_planet_posn_vel( const double jd, const int planet_no,
    return( 0);
 }
 
-void find_relative_state_vect( const double jd, const double *ivect,
+int get_planet_posn_vel( const double jd, const int planet_no,
+                     double *posn, double *vel)
+{
+   return( get_planet_posn_vel_ctx( default_integration_context( ), jd,
+                     planet_no, posn, vel));
+}
+
+static void find_relative_state_vect_ctx( INTEGRATION_CONTEXT *ctx,
+               const double jd, const double *ivect,
                double *ovect, const int ref_planet)
 {
    assert( ref_planet >= 0);
-   memcpy( ovect, ivect, n_orbit_params * sizeof( double));
+   memcpy( ovect, ivect, ctx->n_orbit_params * sizeof( double));
    if( ref_planet)
       {
       double planet_state[6];
       size_t i;
 
-      get_planet_posn_vel( jd, ref_planet, planet_state, planet_state + 3);
+      get_planet_posn_vel_ctx( ctx, jd, ref_planet, planet_state,
+                                                planet_state + 3);
       for( i = 0; i < 6; i++)
          ovect[i] -= planet_state[i];
       }
 }
 
-int find_relative_orbit( const double jd, const double *ivect,
-               ELEMENTS *elements, const int ref_planet)
+void find_relative_state_vect( const double jd, const double *ivect,
+               double *ovect, const int ref_planet)
+{
+   find_relative_state_vect_ctx( default_integration_context( ), jd, ivect,
+                                 ovect, ref_planet);
+}
+
+int find_relative_orbit_ctx( INTEGRATION_CONTEXT *ctx, const double jd,
+               const double *ivect, ELEMENTS *elements,
+               const int ref_planet)
 {
    double local_rel_vect[MAX_N_PARAMS];
 
    assert( ref_planet >= 0);
    assert( elements);
-   find_relative_state_vect( jd, ivect, local_rel_vect, ref_planet);
+   find_relative_state_vect_ctx( ctx, jd, ivect, local_rel_vect, ref_planet);
    if( elements)
       {
       elements->gm = SOLAR_GM * planetary_system_mass( ref_planet);
@@ -1277,6 +1540,13 @@ int find_relative_orbit( const double jd, const double *ivect,
    return( 0);
 }
 
+int find_relative_orbit( const double jd, const double *ivect,
+               ELEMENTS *elements, const int ref_planet)
+{
+   return( find_relative_orbit_ctx( default_integration_context( ), jd,
+                  ivect, elements, ref_planet));
+}
+
 int check_for_perturbers( const double t_cen, const double *vect); /* sm_vsop*/
 
 int find_best_fit_planet( const double jd, const double *ivect,
@@ -1320,8 +1590,8 @@ int find_best_fit_planet( const double jd, const double *ivect,
    return( rval);
 }
 
-static void compute_ref_state( ELEMENTS *ref_orbit, double *ref_state,
-                                          const double jd)
+static void compute_ref_state( INTEGRATION_CONTEXT *ctx, ELEMENTS *ref_orbit,
+                                 double *ref_state, const double jd)
 {
    double r2 = 0., accel;
    int i;
@@ -1343,7 +1613,8 @@ static void compute_ref_state( ELEMENTS *ref_orbit, double *ref_state,
       {
       double planet_state[6];
 
-      get_planet_posn_vel( jd, ref_orbit->central_obj, planet_state, planet_state + 3);
+      get_planet_posn_vel_ctx( ctx, jd, ref_orbit->central_obj,
+                                    planet_state, planet_state + 3);
       for( i = 0; i < 6; i++)
          ref_state[i] += planet_state[i];
       }
@@ -1477,13 +1748,15 @@ static void compute_ref_state( ELEMENTS *ref_orbit, double *ref_state,
 #define N_EVALS 13
 #define N_EVALS_PLUS_ONE 14
 
-ldouble take_pd89_step( const ldouble jd, ELEMENTS *ref_orbit,
-                 const ldouble *ival, ldouble *ovals,
-                 const int n_vals, const ldouble step)
+template <typename T>
+static T take_pd89_step_t( INTEGRATION_CONTEXT *ctx, const T jd,
+                 ELEMENTS *ref_orbit, const T *ival, T *ovals,
+                 const int n_vals, const T step,
+                 const T *initial_derivs)
 {
-   ldouble *ivals[N_EVALS_PLUS_ONE], *ivals_p[N_EVALS], rval = 0.;
+   T *ivals[N_EVALS_PLUS_ONE], *ivals_p[N_EVALS], rval = 0.;
    int i, j, k;
-   const ldouble bvals[91] = { B_2_1,
+   const T bvals[91] = { B_2_1,
        B_3_1, B_3_2,
        B_4_1, B_4_2, B_4_3,
        B_5_1, B_5_2, B_5_3, B_5_4,
@@ -1496,11 +1769,11 @@ ldouble take_pd89_step( const ldouble jd, ELEMENTS *ref_orbit,
        B_12_1, B_12_2, B_12_3, B_12_4, B_12_5, B_12_6, B_12_7, B_12_8, B_12_9, B_12_10, B_12_11,
        B_13_1, B_13_2, B_13_3, B_13_4, B_13_5, B_13_6, B_13_7, B_13_8, B_13_9, B_13_10, B_13_11, B_13_12,
        CHAT_1, CHAT_2, CHAT_3, CHAT_4, CHAT_5, CHAT_6, CHAT_7, CHAT_8, CHAT_9, CHAT_10, CHAT_11, CHAT_12, CHAT_13 };
-   const ldouble avals[N_EVALS_PLUS_ONE] = { 0, A_1, A_2, A_3, A_4, A_5,
+   const T avals[N_EVALS_PLUS_ONE] = { 0, A_1, A_2, A_3, A_4, A_5,
              A_6, A_7, A_8, A_9, A_10, A_11, A_12, A_13 };
-   const ldouble *bptr = bvals;
+   const T *bptr = bvals;
 
-   ivals[0] = (ldouble *)calloc( (2 * N_EVALS + 1) * n_vals, sizeof( ldouble));
+   ivals[0] = (T *)calloc( (2 * N_EVALS + 1) * n_vals, sizeof( T));
    assert( ivals[0]);
    if( !ivals[0])
       return( 0.);
@@ -1512,46 +1785,51 @@ ldouble take_pd89_step( const ldouble jd, ELEMENTS *ref_orbit,
 
    for( j = 0; j <= N_EVALS; j++)
       {
-      ldouble ref_state_j[9], state_j[MAX_N_PARAMS];
-      const ldouble jd_j = jd + step * avals[j];
+      T ref_state_j[9], state_j[MAX_N_INTEGRATED_VALS];
+      const T jd_j = jd + step * avals[j];
       double temp_array[9];
 
-      compute_ref_state( ref_orbit, temp_array, jd_j);
+      compute_ref_state( ctx, ref_orbit, temp_array, jd_j);
       for( i = 0; i < 9; i++)
-         ref_state_j[i] = (ldouble)temp_array[i];
+         ref_state_j[i] = (T)temp_array[i];
       if( !j)
          {
-         memcpy( state_j, ival, n_orbit_params * sizeof( ldouble));
+         memcpy( state_j, ival, ctx->n_orbit_params * sizeof( T));
                /* subtract the analytic posn/vel from the numeric: */
          for( i = 0; i < n_vals; i++)
-            ivals[0][i] = ival[i] - ref_state_j[i];
+            ivals[0][i] = ival[i] - (i < 6 ? ref_state_j[i] : 0.);
          }
       else
          for( i = 0; i < n_vals; i++)
             {
-            ldouble tval = 0.;
+            T tval = 0.;
 
             for( k = 0; k < j; k++)
                tval += bptr[k] * ivals_p[k][i];
             ivals[j][i] = tval * step + ivals[0][i];
-            state_j[i] = ivals[j][i] + ref_state_j[i];
+            state_j[i] = ivals[j][i] + (i < 6 ? ref_state_j[i] : 0.);
             }
       bptr += j;
       if( j != N_EVALS)
          {
-         assert( fabsl( jd_j) < 1e+9);
-         calc_derivativesl( jd_j, state_j, ivals_p[j], ref_orbit->central_obj);
+         assert( fabs_t( jd_j) < 1e+9);
+         if( !j && initial_derivs)
+            memcpy( ivals_p[0], initial_derivs, n_vals * sizeof( T));
+         else
+            calc_derivatives_ctx( ctx, jd_j, state_j, ivals_p[j],
+                                             ref_orbit->central_obj);
          for( k = 0; k < 6; k++)
             ivals_p[j][k] -= ref_state_j[k + 3];
          }
       else     /* on last iteration,  we have our answer: */
-         memcpy( ovals, state_j, n_orbit_params * sizeof( ldouble));
+         memcpy( ovals, state_j,
+                  (n_vals > 6 ? n_vals : ctx->n_orbit_params) * sizeof( T));
       }
 
-   for( i = 0; i < n_vals; i++)
+   for( i = 0; i < 6; i++)       /* partials don't affect the stepsize */
       {
-      ldouble tval = 0.;
-      const ldouble err_coeff[N_EVALS] = { CHAT_1 - C_1, CHAT_2 - C_2,
+      T tval = 0.;
+      const T err_coeff[N_EVALS] = { CHAT_1 - C_1, CHAT_2 - C_2,
                CHAT_3  -  C_3, CHAT_4  -  C_4, CHAT_5  -  C_5, CHAT_6 - C_6,
                CHAT_7  -  C_7, CHAT_8  -  C_8, CHAT_9  -  C_9, CHAT_10 - C_10,
                CHAT_11 - C_11, CHAT_12 - C_12, CHAT_13 - C_13 };
@@ -1560,7 +1838,334 @@ ldouble take_pd89_step( const ldouble jd, ELEMENTS *ref_orbit,
          tval += err_coeff[k] * ivals_p[k][i];
       rval += tval * tval;
       }
-   return( sqrtl( rval * step * step));
+   free( ivals[0]);
+   return( sqrt_t( rval * step * step));
+}
+
+ldouble take_pd89_step( INTEGRATION_CONTEXT *ctx, const ldouble jd,
+                 ELEMENTS *ref_orbit, const ldouble *ival, ldouble *ovals,
+                 const int n_vals, const ldouble step,
+                 const ldouble *initial_derivs)
+{
+   return( take_pd89_step_t( ctx, jd, ref_orbit, ival, ovals, n_vals, step,
+                                 initial_derivs));
+}
+
+double take_pd89_step( INTEGRATION_CONTEXT *ctx, const double jd,
+                 ELEMENTS *ref_orbit, const double *ival, double *ovals,
+                 const int n_vals, const double step,
+                 const double *initial_derivs)
+{
+   return( take_pd89_step_t( ctx, jd, ref_orbit, ival, ovals, n_vals, step,
+                                 initial_derivs));
+}
+
+/* Gauss-Radau integration (integration_method = 2),  after Everhart's
+RADAU ("An efficient integrator that uses Gauss-Radau spacings",  1985)
+and Rein & Spiegel's IAS15 (MNRAS 446, 1424,  2015).  Over a step,  the
+derivatives are fitted with a seventh-degree polynomial in tau (the
+fraction of the step completed) :
+
+f(tau) = f0 + b0 * tau + b1 * tau^2 + ... + b6 * tau^7
+
+which is integrated analytically to get the state at any tau.  The b's
+are found by evaluating the derivatives at seven Gauss-Radau spacings
+within the step,  using the current b's to get the state at each,  and
+iterating until b6 stops changing ('predictor-corrector').  With Radau
+spacings,  the result is of order 15.
+
+   As in IAS15,  the b's from the previous step are extrapolated into the
+next step,  so only two or three iterations are usually needed :  about
+fifteen to twenty derivative evaluations per step,  but steps several
+times as long as those of the RKF or PD89 integrators.  This is done for
+the whole state vector,  including any variational equations,  just as
+for take_rk_step().  The b's from the last step are kept in the
+context's RADAU_STATE.  If the step is a retry of a rejected one (same
+start,  shorter step),  the b's are rescaled to the new step instead.
+
+   The returned error estimate is the contribution of the b6 term to the
+position and velocity.  If the iterations don't converge (they won't if
+we're too close to a planet for the step being used),  the error is set
+high enough to cause the step to be rejected;  see integrate_orbit_t()
+for how rejections are handled.      */
+
+#define RADAU_N_NODES         8
+#define RADAU_N_B             7
+#define RADAU_MAX_ITERATIONS 12
+
+RADAU_STATE
+{
+   long double jd, step;      /* start and size of last step taken */
+   int n_vals, central_obj;
+   long double *b;            /* RADAU_N_B * n_vals values,  b0, b1, ... */
+   long double *e;            /* b's as predicted before iterating     */
+};
+
+static const long double radau_nodes[RADAU_N_NODES] = { 0.,
+            .0562625605369221464656521910318L,
+            .180240691736892364987579942780L,
+            .352624717113169637373907769648L,
+            .547153626330555383001448554766L,
+            .734210177215410531523210605558L,
+            .885320946839095768090359771030L,
+            .977520613561287501891174488626L };
+
+static void free_radau_state( RADAU_STATE *rs)
+{
+   if( rs)
+      {
+      free( rs->b);
+      free( rs);
+      }
+}
+
+/* Sets up the b's for a step of size 'step' from 'jd'.  If this step
+follows the last one,  the last step's b's are extrapolated forward;
+if it's a retry of the last one,  they're rescaled;  otherwise,  we
+start from scratch.  (Or if the step size changed by a huge factor,
+in which case the extrapolation wouldn't be much use.)   */
+
+static RADAU_STATE *predict_radau_state( INTEGRATION_CONTEXT *ctx,
+            const long double jd, const long double step, const int n_vals,
+            const int central_obj)
+{
+   RADAU_STATE *rs = ctx->radau_state;
+   const long double ratio = (rs && rs->step ? step / rs->step : 0.);
+   const bool follows_last_step = (rs && fabsl( jd - rs->jd - rs->step)
+                                             < fabsl( step) * 1e-9);
+   int i, j, k;
+
+   if( !rs)
+      {
+      rs = ctx->radau_state = (RADAU_STATE *)calloc( 1, sizeof( RADAU_STATE));
+      assert( rs);
+      }
+   if( rs->n_vals != n_vals)
+      {
+      free( rs->b);
+      rs->b = (long double *)calloc( 2 * RADAU_N_B * n_vals,
+                                       sizeof( long double));
+      assert( rs->b);
+      rs->e = rs->b + RADAU_N_B * n_vals;
+      rs->n_vals = n_vals;
+      rs->step = 0.;
+      }
+   if( !rs->step || rs->central_obj != central_obj
+               || ratio > 20. || ratio <= 0.
+               || (jd != rs->jd && !follows_last_step))
+      memset( rs->b, 0, 2 * RADAU_N_B * n_vals * sizeof( long double));
+   else if( jd == rs->jd)     /* retrying a rejected step */
+      {
+      long double q = 1.;
+
+      for( k = 0; k < RADAU_N_B; k++)
+         {
+         q *= ratio;
+         for( i = 0; i < n_vals; i++)
+            rs->e[k * n_vals + i] = (rs->b[k * n_vals + i] *= q);
+         }
+      }
+   else     /* extrapolate:  b'[m] = q^(m+1) * sum binom(k+1, m+1) * b[k] */
+      {
+      long double binom[RADAU_N_B + 1][RADAU_N_B + 1], q = 1.;
+
+      for( j = 0; j <= RADAU_N_B; j++)
+         for( k = 0; k <= j; k++)
+            binom[j][k] = (!k || k == j ? 1. :
+                              binom[j - 1][k - 1] + binom[j - 1][k]);
+      for( k = 0; k < RADAU_N_B; k++)
+         {
+         q *= ratio;
+         for( i = 0; i < n_vals; i++)
+            {
+            long double pred = 0.;
+            const long double correction =
+                        rs->b[k * n_vals + i] - rs->e[k * n_vals + i];
+
+            for( j = k; j < RADAU_N_B; j++)
+               pred += binom[j + 1][k + 1] * rs->b[j * n_vals + i];
+            rs->e[k * n_vals + i] = q * pred;
+            rs->b[k * n_vals + i] = correction;    /* e is added below */
+            }
+         }
+      for( i = 0; i < RADAU_N_B * n_vals; i++)
+         rs->b[i] += rs->e[i];
+      }
+   rs->jd = jd;
+   rs->step = step;
+   rs->central_obj = central_obj;
+   return( rs);
+}
+
+template <typename T>
+static T take_radau_step_t( INTEGRATION_CONTEXT *ctx, const T jd,
+                 ELEMENTS *ref_orbit, const T *ival, T *ovals,
+                 const int n_vals, const T step,
+                 const T *initial_derivs)
+{
+   RADAU_STATE *rs = predict_radau_state( ctx, (ldouble)jd, (ldouble)step,
+                              n_vals, ref_orbit->central_obj);
+   T c[RADAU_N_B][RADAU_N_B], h[RADAU_N_NODES], ref_state[RADAU_N_NODES + 1][9];
+   T *y0, *f0, *fj, *b, *g, state_j[MAX_N_INTEGRATED_VALS], rval = 0.;
+   T prev_change = 0.;
+   const T pc_limit = (sizeof( T) > sizeof( double) ? 1e-19 : 1e-16);
+   extern double integration_tolerance;
+   bool converged = false;
+   int i, j, k, iter;
+
+   y0 = (T *)calloc( (3 + 2 * RADAU_N_B) * n_vals, sizeof( T));
+   assert( y0);
+   if( !y0)
+      return( 0.);
+   f0 = y0 + n_vals;
+   fj = f0 + n_vals;
+   b = fj + n_vals;
+   g = b + RADAU_N_B * n_vals;
+   for( j = 0; j < RADAU_N_NODES; j++)
+      h[j] = (T)radau_nodes[j];
+               /* c[k][m] = coefficient of tau^(m+1) in the polynomial  */
+               /* tau * (tau - h[1]) * (tau - h[2]) * ... * (tau - h[k]) */
+   for( k = 0; k < RADAU_N_B; k++)
+      for( j = 0; j <= k; j++)
+         c[k][j] = (!k ? 1. : (j ? c[k - 1][j - 1] : 0.)
+                            - (j < k ? h[k] * c[k - 1][j] : 0.));
+   for( j = 0; j <= RADAU_N_NODES; j++)
+      {
+      const T jd_j = jd + step * (j == RADAU_N_NODES ? 1. : h[j]);
+      double temp_array[9];
+
+      compute_ref_state( ctx, ref_orbit, temp_array, (double)jd_j);
+      for( i = 0; i < 9; i++)
+         ref_state[j][i] = (T)temp_array[i];
+      }
+   memcpy( state_j, ival, ctx->n_orbit_params * sizeof( T));
+   if( initial_derivs)
+      memcpy( f0, initial_derivs, n_vals * sizeof( T));
+   else
+      calc_derivatives_ctx( ctx, jd, ival, f0, ref_orbit->central_obj);
+   for( i = 0; i < n_vals; i++)
+      {
+      y0[i] = ival[i] - (i < 6 ? ref_state[0][i] : 0.);
+      if( i < 6)
+         f0[i] -= ref_state[0][i + 3];
+      }
+   for( i = 0; i < RADAU_N_B * n_vals; i++)
+      b[i] = (T)rs->b[i];
+   for( k = RADAU_N_B - 1; k >= 0; k--)     /* get g's from predicted b's */
+      for( i = 0; i < n_vals; i++)
+         {
+         T tval = b[k * n_vals + i];
+
+         for( j = k + 1; j < RADAU_N_B; j++)
+            tval -= c[j][k] * g[j * n_vals + i];
+         g[k * n_vals + i] = tval;
+         }
+
+   for( iter = 0; iter < RADAU_MAX_ITERATIONS && !converged; iter++)
+      {
+      T max_change = 0., max_deriv = 0.;
+
+      for( j = 1; j < RADAU_N_NODES; j++)
+         {
+         for( i = 0; i < n_vals; i++)
+            {
+            T tval = b[(RADAU_N_B - 1) * n_vals + i] / (T)( RADAU_N_B + 1);
+
+            for( k = RADAU_N_B - 2; k >= 0; k--)
+               tval = tval * h[j] + b[k * n_vals + i] / (T)( k + 2);
+            tval = tval * h[j] + f0[i];
+            state_j[i] = y0[i] + step * h[j] * tval
+                               + (i < 6 ? ref_state[j][i] : 0.);
+            }
+         calc_derivatives_ctx( ctx, jd + step * h[j], state_j, fj,
+                                             ref_orbit->central_obj);
+         for( i = 0; i < 6; i++)
+            fj[i] -= ref_state[j][i + 3];
+                     /* Newton divided differences give the new g : */
+         for( i = 0; i < n_vals; i++)
+            {
+            T tval = (fj[i] - f0[i]) / h[j];
+
+            for( k = 0; k < j - 1; k++)
+               tval = (tval - g[k * n_vals + i]) / (h[j] - h[k + 1]);
+            if( j == RADAU_N_NODES - 1 && i < 6)
+               {
+               const T change = fabs_t( tval - g[(j - 1) * n_vals + i]);
+
+               if( max_change < change)
+                  max_change = change;
+               if( max_deriv < fabs_t( fj[i]))
+                  max_deriv = fabs_t( fj[i]);
+               }
+            g[(j - 1) * n_vals + i] = tval;
+            }
+                     /* ...and the b's follow from the g's : */
+         for( k = 0; k < j; k++)
+            for( i = 0; i < n_vals; i++)
+               {
+               T tval = 0.;
+               int m;
+
+               for( m = k; m < RADAU_N_B; m++)
+                  tval += c[m][k] * g[m * n_vals + i];
+               b[k * n_vals + i] = tval;
+               }
+         }
+      if( iter && (max_change <= pc_limit * max_deriv
+            || fabs_t( step) * max_change < integration_tolerance * 1e-3))
+         converged = true;
+               /* If the corrections stop shrinking,  we've probably hit */
+               /* rounding noise;  but only believe that if they're at */
+               /* least close to that level.  Otherwise,  we leave it    */
+               /* unconverged,  and the step gets rejected (see below). */
+      else if( iter > 1 && max_change >= prev_change
+                     && max_change <= 100. * pc_limit * max_deriv)
+         converged = true;
+      prev_change = max_change;
+      }
+
+   for( i = 0; i < n_vals; i++)          /* state at the end of the step */
+      {
+      T tval = f0[i];
+
+      for( k = 0; k < RADAU_N_B; k++)
+         tval += b[k * n_vals + i] / (T)( k + 2);
+      state_j[i] = y0[i] + step * tval
+                     + (i < 6 ? ref_state[RADAU_N_NODES][i] : 0.);
+      }
+   memcpy( ovals, state_j,
+                  (n_vals > 6 ? n_vals : ctx->n_orbit_params) * sizeof( T));
+   for( i = 0; i < 6; i++)       /* partials don't affect the stepsize */
+      {
+      const T tval = b[(RADAU_N_B - 1) * n_vals + i] / (T)( RADAU_N_B + 1);
+
+      rval += tval * tval;
+      }
+   rval = sqrt_t( rval * step * step);
+   if( !converged && rval < 2. * integration_tolerance)
+      rval = 2. * integration_tolerance;
+   for( i = 0; i < RADAU_N_B * n_vals; i++)
+      rs->b[i] = (ldouble)b[i];
+   free( y0);
+   return( rval);
+}
+
+ldouble take_radau_step( INTEGRATION_CONTEXT *ctx, const ldouble jd,
+                 ELEMENTS *ref_orbit, const ldouble *ival, ldouble *ovals,
+                 const int n_vals, const ldouble step,
+                 const ldouble *initial_derivs)
+{
+   return( take_radau_step_t( ctx, jd, ref_orbit, ival, ovals, n_vals, step,
+                                 initial_derivs));
+}
+
+double take_radau_step( INTEGRATION_CONTEXT *ctx, const double jd,
+                 ELEMENTS *ref_orbit, const double *ival, double *ovals,
+                 const int n_vals, const double step,
+                 const double *initial_derivs)
+{
+   return( take_radau_step_t( ctx, jd, ref_orbit, ival, ovals, n_vals, step,
+                                 initial_derivs));
 }
 
 #define ORIGINAL_FEHLBERG_CONSTANTS
@@ -1652,14 +2257,16 @@ A6 | B61 B62 B63 B64 B65
    | C1  C2  C3  C4  C5  C6
    | C^1 C^2 C^3 C^4 C^5 C^6          */
 
-ldouble take_rk_stepl( const ldouble jd, ELEMENTS *ref_orbit,
-                 const ldouble *ival, ldouble *ovals,
-                 const int n_vals, const ldouble step)
+template <typename T>
+static T take_rk_step_t( INTEGRATION_CONTEXT *ctx, const T jd,
+                 ELEMENTS *ref_orbit, const T *ival, T *ovals,
+                 const int n_vals, const T step,
+                 const T *initial_derivs)
 {
-   ldouble *ivals[7], *ivals_p[6], rval = 0.;
+   T *ivals[7], *ivals_p[6], rval = 0.;
    int i, j, k;
             /* Revised values from _Numerical Recipes_: */
-   const ldouble bvals[21] = { RKF_B21,
+   const T bvals[21] = { RKF_B21,
             RKF_B31, RKF_B32,
             RKF_B41, RKF_B42, RKF_B43,
             RKF_B51, RKF_B52, RKF_B53, RKF_B54,
@@ -1667,12 +2274,12 @@ ldouble take_rk_stepl( const ldouble jd, ELEMENTS *ref_orbit,
             RKF_CHAT1, RKF_CHAT2, RKF_CHAT3,
             RKF_CHAT4, RKF_CHAT5, RKF_CHAT6 };
 
-   const ldouble avals[7] = { RKF_A1, RKF_A2, RKF_A3, RKF_A4, RKF_A5, RKF_A6, 1.};
-   const ldouble *bptr = bvals;
-   ldouble temp_ivals[78];
+   const T avals[7] = { RKF_A1, RKF_A2, RKF_A3, RKF_A4, RKF_A5, RKF_A6, 1.};
+   const T *bptr = bvals;
+   T temp_ivals[78];
 
    if( n_vals > 6)
-      ivals[0] = (ldouble *)calloc( 13 * n_vals, sizeof( ldouble));
+      ivals[0] = (T *)calloc( 13 * n_vals, sizeof( T));
    else
       ivals[0] = temp_ivals;
    assert( ivals[0]);
@@ -1686,48 +2293,53 @@ ldouble take_rk_stepl( const ldouble jd, ELEMENTS *ref_orbit,
 
    for( j = 0; j < 7; j++)
       {
-      ldouble ref_state_j[9], state_j[MAX_N_PARAMS];
-      const ldouble jd_j = jd + step * avals[j];
+      T ref_state_j[9], state_j[MAX_N_INTEGRATED_VALS];
+      const T jd_j = jd + step * avals[j];
       double temp_array[9];
 
-      compute_ref_state( ref_orbit, temp_array, (double)jd_j);
+      compute_ref_state( ctx, ref_orbit, temp_array, (double)jd_j);
       for( i = 0; i < 9; i++)
-         ref_state_j[i] = (ldouble)temp_array[i];
+         ref_state_j[i] = (T)temp_array[i];
       if( !j)
          {
-         memcpy( state_j, ival, n_orbit_params * sizeof( ldouble));
+         memcpy( state_j, ival, ctx->n_orbit_params * sizeof( T));
                /* subtract the analytic posn/vel from the numeric: */
          for( i = 0; i < n_vals; i++)
-            ivals[0][i] = ival[i] - ref_state_j[i];
+            ivals[0][i] = ival[i] - (i < 6 ? ref_state_j[i] : 0.);
          }
       else
          for( i = 0; i < n_vals; i++)
             {
-            ldouble tval = 0.;
+            T tval = 0.;
 
             for( k = 0; k < j; k++)
                tval += bptr[k] * ivals_p[k][i];
             ivals[j][i] = tval * step + ivals[0][i];
-            state_j[i] = ivals[j][i] + ref_state_j[i];
+            state_j[i] = ivals[j][i] + (i < 6 ? ref_state_j[i] : 0.);
             }
       bptr += j;
       if( j != 6)
          {
 #ifndef __WATCOMC__
-         assert( fabsl( jd_j) < 1e+9);
+         assert( fabs_t( jd_j) < 1e+9);
 #endif
-         calc_derivativesl( jd_j, state_j, ivals_p[j], ref_orbit->central_obj);
+         if( !j && initial_derivs)
+            memcpy( ivals_p[0], initial_derivs, n_vals * sizeof( T));
+         else
+            calc_derivatives_ctx( ctx, jd_j, state_j, ivals_p[j],
+                                             ref_orbit->central_obj);
          for( k = 0; k < 6; k++)
             ivals_p[j][k] -= ref_state_j[k + 3];
          }
       else     /* on last iteration,  we have our answer: */
-         memcpy( ovals, state_j, n_orbit_params * sizeof( ldouble));
+         memcpy( ovals, state_j,
+                  (n_vals > 6 ? n_vals : ctx->n_orbit_params) * sizeof( T));
       }
 
-   for( i = 0; i < n_vals; i++)
+   for( i = 0; i < 6; i++)       /* partials don't affect the stepsize */
       {
-      ldouble tval = 0.;
-      static const ldouble err_coeffs[6] = {
+      T tval = 0.;
+      static const T err_coeffs[6] = {
             RKF_CHAT1 - RKF_C1, RKF_CHAT2 - RKF_C2, RKF_CHAT3 - RKF_C3,
             RKF_CHAT4 - RKF_C4, RKF_CHAT5 - RKF_C5, RKF_CHAT6 - RKF_C6 };
 
@@ -1738,7 +2350,409 @@ ldouble take_rk_stepl( const ldouble jd, ELEMENTS *ref_orbit,
 
    if( n_vals > 6)
       free( ivals[0]);
-   return( sqrtl( rval * step * step));
+   return( sqrt_t( rval * step * step));
+}
+
+ldouble take_rk_step( INTEGRATION_CONTEXT *ctx, const ldouble jd,
+                 ELEMENTS *ref_orbit, const ldouble *ival, ldouble *ovals,
+                 const int n_vals, const ldouble step,
+                 const ldouble *initial_derivs)
+{
+   return( take_rk_step_t( ctx, jd, ref_orbit, ival, ovals, n_vals, step,
+                                 initial_derivs));
+}
+
+double take_rk_step( INTEGRATION_CONTEXT *ctx, const double jd,
+                 ELEMENTS *ref_orbit, const double *ival, double *ovals,
+                 const int n_vals, const double step,
+                 const double *initial_derivs)
+{
+   return( take_rk_step_t( ctx, jd, ref_orbit, ival, ovals, n_vals, step,
+                                 initial_derivs));
+}
+
+/* 'Lockstep' or 'batch' integration.  Monte Carlo and statistical ranging
+variants,  and the variant orbits shown in ephemerides,  are many nearly
+identical orbits integrated over the same span.  Integrated one at a time,
+each repeats the same step size adjustments and planet position lookups.
+integrate_orbits() (in 'orb_func.cpp') instead advances all of them with
+the same steps,  using the following two functions.
+
+   calc_derivatives_batch() gets the planetary positions once for all the
+orbits.  The orbits are then handled in blocks of BATCH_WIDTH,  with the
+positions and accelerations for a block stored 'structure of arrays' style
+(all the x's,  then all the y's,  etc.).  That lets the compiler vectorize
+the loops over the orbits in a block for the point-mass attractions of the
+planets,  which are most of the work.  This is done in double precision,
+by the method of Cowell (i.e.,  reference_planet = -1).
+
+   The 'fast' path handles only gravity from the sun,  planets,  and
+asteroids,  plus relativity.  If any orbit in a block is within .03 AU of
+a perturbing planet (so that J2 and higher,  satellites,  drag,  or hitting
+the planet may matter) or inside the sun,  that block is done one orbit at
+a time with calc_derivatives_ctx().  If there are non-gravs,  variational
+equations,  or satellites turned on as perturbers,  all orbits are done that
+way.  Either way,  the results match calc_derivatives_ctx() for each orbit.
+
+   'ivals' and 'ovals' are n_orbits state vectors of six values each.  The
+return value is the planet hit by any orbit,  or -1 if none were.  */
+
+#define BATCH_WIDTH 4
+#define BATCH_CLOSE_APPROACH .03
+
+int calc_derivatives_batch( INTEGRATION_CONTEXT *ctx, const double jd,
+            const int n_orbits, const double *ivals, double *ovals)
+{
+   const unsigned planets = (ctx->perturbers & ~ctx->excluded_perturbers)
+                                 & 0x7fe;
+   const double close2 = BATCH_CLOSE_APPROACH * BATCH_CLOSE_APPROACH;
+   const double sun_radius = (double)planet_radius( 0);
+   double planet_posns[11 * 3], gm[11], indirect[3];
+   int i, j, lane, block, hit = -1;
+   extern int force_model;
+
+   if( ctx->n_orbit_params != 6 || ctx->n_variational_eqns || force_model
+                  || (ctx->perturbers & (0x1ff << IDX_IO)))
+      {
+      for( i = 0; i < n_orbits; i++)
+         if( calc_derivatives_ctx( ctx, jd, ivals + i * 6, ovals + i * 6, -1) != -1)
+            hit = ctx->planet_hit;
+      ctx->planet_hit = hit;
+      return( hit);
+      }
+   for( j = 0; j < 3; j++)
+      indirect[j] = 0.;
+   if( planets)
+      perturber_posns_ctx( ctx, planets, jd, planet_posns);
+   for( i = 1; i <= IDX_MOON; i++)
+      if( (planets >> i) & 1)
+         {
+         const double *loc = planet_posns + i * 3;
+         const double r = vector3_length( loc);
+         double mass_to_use = planet_mass[i];
+
+         if( i == IDX_JUPITER)         /* see calc_derivatives_t() */
+            mass_to_use = MASS_JUPITER_SYSTEM;
+         if( i == IDX_SATURN)
+            mass_to_use = MASS_SATURN_SYSTEM;
+         if( i == IDX_EARTH && !((planets >> IDX_MOON) & 1))
+            mass_to_use += planet_mass[IDX_MOON];
+         gm[i] = -SOLAR_GM * mass_to_use;
+         for( j = 0; j < 3; j++)          /* same for all orbits */
+            indirect[j] += gm[i] * loc[j] / (r * r * r);
+         }
+
+   for( block = 0; block < n_orbits; block += BATCH_WIDTH)
+      {
+      const int n_lanes = (n_orbits - block < BATCH_WIDTH ?
+                                    n_orbits - block : BATCH_WIDTH);
+      double posn[3][BATCH_WIDTH], accel[3][BATCH_WIDTH];
+      double r[BATCH_WIDTH], solar_accel[BATCH_WIDTH];
+      int too_close = 0;
+
+      for( lane = 0; lane < BATCH_WIDTH; lane++)
+         {        /* unused lanes in the last block repeat the last orbit */
+         const double *iptr = ivals + 6 * (block
+                           + (lane < n_lanes ? lane : n_lanes - 1));
+
+         for( j = 0; j < 3; j++)
+            posn[j][lane] = iptr[j];
+         }
+      for( lane = 0; lane < BATCH_WIDTH; lane++)
+         r[lane] = sqrt( posn[0][lane] * posn[0][lane]
+                  + posn[1][lane] * posn[1][lane]
+                  + posn[2][lane] * posn[2][lane]);
+      for( lane = 0; lane < BATCH_WIDTH; lane++)
+         too_close |= (r[lane] < sun_radius);
+      for( i = 1; i <= IDX_MOON && !too_close; i++)
+         if( (planets >> i) & 1)
+            {
+            const double *loc = planet_posns + i * 3;
+
+            for( lane = 0; lane < BATCH_WIDTH; lane++)
+               {
+               const double dx = posn[0][lane] - loc[0];
+               const double dy = posn[1][lane] - loc[1];
+               const double dz = posn[2][lane] - loc[2];
+
+               too_close |= (dx * dx + dy * dy + dz * dz < close2);
+               }
+            }
+      if( too_close)    /* do this block the 'usual' way */
+         {
+         for( lane = 0; lane < n_lanes; lane++)
+            {
+            const int idx = 6 * (block + lane);
+
+            if( calc_derivatives_ctx( ctx, jd, ivals + idx, ovals + idx, -1) != -1)
+               hit = ctx->planet_hit;
+            }
+         continue;
+         }
+      ctx->counters.n_derivs += n_lanes;
+      for( lane = 0; lane < n_lanes; lane++)
+         solar_accel[lane] = -SOLAR_GM * (1. + object_mass)
+                  * include_thrown_in_planets( r[lane], ctx->perturbers);
+      for( lane = n_lanes; lane < BATCH_WIDTH; lane++)
+         solar_accel[lane] = solar_accel[n_lanes - 1];
+      for( lane = 0; lane < BATCH_WIDTH; lane++)
+         solar_accel[lane] /= r[lane] * r[lane] * r[lane];
+      for( j = 0; j < 3; j++)
+         for( lane = 0; lane < BATCH_WIDTH; lane++)
+            accel[j][lane] = solar_accel[lane] * posn[j][lane] + indirect[j];
+
+      for( i = 1; i <= IDX_MOON; i++)
+         if( (planets >> i) & 1)
+            {
+            const double *loc = planet_posns + i * 3;
+            const double gm_i = gm[i];
+
+            for( lane = 0; lane < BATCH_WIDTH; lane++)
+               {
+               const double dx = posn[0][lane] - loc[0];
+               const double dy = posn[1][lane] - loc[1];
+               const double dz = posn[2][lane] - loc[2];
+               const double d2 = dx * dx + dy * dy + dz * dz;
+               const double factor = gm_i / (d2 * sqrt( d2));
+
+               accel[0][lane] += factor * dx;
+               accel[1][lane] += factor * dy;
+               accel[2][lane] += factor * dz;
+               }
+            }
+
+      for( lane = 0; lane < n_lanes; lane++)
+         {
+         const double *iptr = ivals + 6 * (block + lane);
+         double *optr = ovals + 6 * (block + lane);
+
+         for( j = 0; j < 3; j++)
+            {
+            optr[j] = iptr[j + 3];
+            optr[j + 3] = accel[j][lane];
+            }
+         if( ctx->perturbers)
+            {
+            double relativistic_accel[3];
+
+            set_relativistic_accel( relativistic_accel, iptr);
+            for( j = 0; j < 3; j++)
+               optr[j + 3] += SOLAR_GM * relativistic_accel[j];
+            }
+         if( (ctx->perturbers >> IDX_ASTEROIDS) & 1)
+            if( r[lane] < 11.5 && r[lane] > 1.)
+               {
+               double asteroid_accel[6];
+
+               for( j = 3; j < 6; j++)
+                  asteroid_accel[j] = 0.;
+               detect_perturbers_ctx( ctx, jd, iptr, asteroid_accel);
+               for( j = 3; j < 6; j++)
+                  optr[j] += asteroid_accel[j];
+               }
+         }
+      }
+   ctx->best_fit_planet = 0;
+   ctx->planet_hit = hit;
+   return( hit);
+}
+
+/* Takes one Runge-Kutta-Fehlberg step for n_orbits orbits at once,  as
+take_rk_step() does for one orbit (Cowell only).  Returns the largest of
+the orbits' error estimates;  ctx->planet_hit is set if any orbit hit a
+planet at any stage.  */
+
+double take_rk_step_batch( INTEGRATION_CONTEXT *ctx, const double jd,
+                 const int n_orbits, const double *ival, double *ovals,
+                 const double step)
+{
+   const double bvals[21] = { RKF_B21,
+            RKF_B31, RKF_B32,
+            RKF_B41, RKF_B42, RKF_B43,
+            RKF_B51, RKF_B52, RKF_B53, RKF_B54,
+            RKF_B61, RKF_B62, RKF_B63, RKF_B64, RKF_B65,
+            RKF_CHAT1, RKF_CHAT2, RKF_CHAT3,
+            RKF_CHAT4, RKF_CHAT5, RKF_CHAT6 };
+   const double avals[7] = { RKF_A1, RKF_A2, RKF_A3, RKF_A4, RKF_A5, RKF_A6, 1.};
+   static const double err_coeffs[6] = {
+            RKF_CHAT1 - RKF_C1, RKF_CHAT2 - RKF_C2, RKF_CHAT3 - RKF_C3,
+            RKF_CHAT4 - RKF_C4, RKF_CHAT5 - RKF_C5, RKF_CHAT6 - RKF_C6 };
+   const double *bptr = bvals;
+   const int n_vals = 6 * n_orbits;
+   double *ivals_p[6], *state_j, rval = 0.;
+   int i, j, k, hit = -1;
+
+   ivals_p[0] = (double *)malloc( 7 * n_vals * sizeof( double));
+   assert( ivals_p[0]);
+   if( !ivals_p[0])
+      return( 0.);
+   for( j = 1; j < 6; j++)
+      ivals_p[j] = ivals_p[0] + j * n_vals;
+   state_j = ivals_p[0] + 6 * n_vals;
+   for( j = 0; j < 7; j++)
+      {
+      if( !j)
+         memcpy( state_j, ival, n_vals * sizeof( double));
+      else
+         for( i = 0; i < n_vals; i++)
+            {
+            double tval = 0.;
+
+            for( k = 0; k < j; k++)
+               tval += bptr[k] * ivals_p[k][i];
+            state_j[i] = tval * step + ival[i];
+            }
+      bptr += j;
+      if( j != 6)
+         {
+         if( calc_derivatives_batch( ctx, jd + step * avals[j], n_orbits,
+                                 state_j, ivals_p[j]) != -1)
+            hit = ctx->planet_hit;
+         }
+      else     /* on last iteration,  we have our answer: */
+         memcpy( ovals, state_j, n_vals * sizeof( double));
+      }
+
+   for( i = 0; i < n_orbits; i++)
+      {
+      double err = 0.;
+
+      for( j = 0; j < 6; j++)
+         {
+         double tval = 0.;
+
+         for( k = 0; k < 6; k++)
+            tval += err_coeffs[k] * ivals_p[k][i * 6 + j];
+         err += tval * tval;
+         }
+      if( rval < err)
+         rval = err;
+      }
+   free( ivals_p[0]);
+   ctx->planet_hit = hit;
+   return( sqrt( rval * step * step));
+}
+
+/* 'Dense output',  a.k.a. continuous output.  When computing positions
+for (say) five thousand observations,  we don't want to stop the integrator
+at each observation time;  that would mean taking thousands of truncated
+steps,  each costing as much as a full-sized one (and those truncated
+steps don't land on the 'usual' step boundaries,  so the planetary
+positions they require don't come from the cache).  Instead,  we take the
+steps the integrator would normally take,  then interpolate within each
+step to get the state vector at any observation time within that step.
+
+   We know the position,  velocity,  and acceleration at both ends of the
+step.  That's enough to fit a quintic Hermite polynomial to the position;
+differentiating that polynomial gets us the velocity.  The interpolation
+error scales as step^6 (and step^5 for the velocity),  i.e.,  it's of the
+same order as the error of the integrator itself.  And the acceleration
+at the end of one step is the acceleration at the start of the next,  so
+computing it costs nothing extra;  see the 'initial_derivs' argument to
+take_rk_step() and take_pd89_step().
+
+   As with the steps themselves,  we actually interpolate the difference
+between the numerically integrated orbit and the two-body reference orbit
+(if the method of Encke is in use),  then add the reference orbit back in.
+'derivs0' and 'derivs1' are the calc_derivativesl() outputs at the start
+and end of the step,  computed relative to ref_orbit->central_obj just as
+take_rk_step() would compute them.
+
+   If variational equations are being integrated,  the n_partials sets of
+partial derivatives are interpolated the same way (but without any
+reference orbit),  and stored after the position and velocity.  */
+
+template <typename T>
+static void dense_output_interpolate_t( INTEGRATION_CONTEXT *ctx,
+                 ELEMENTS *ref_orbit, const T jd0,
+                 const T *state0, const T *derivs0,
+                 const T *state1, const T *derivs1,
+                 const T step, const T jd, T *ostate,
+                 const int n_partials)
+{
+   const T s = (jd - jd0) / step, s2 = s * s, s3 = s2 * s;
+   const T s4 = s2 * s2, s5 = s4 * s;
+   const T h0 = 1. - 10. * s3 + 15. * s4 - 6. * s5;
+   const T h1 = s - 6. * s3 + 8. * s4 - 3. * s5;
+   const T h2 = (s2 - 3. * s3 + 3. * s4 - s5) * .5;
+   const T h3 = (s3 - 2. * s4 + s5) * .5;
+   const T h4 = -4. * s3 + 7. * s4 - 3. * s5;
+   const T h5 = 10. * s3 - 15. * s4 + 6. * s5;
+            /* ...and the derivatives of the above with respect to s : */
+   const T d0 = -30. * s2 + 60. * s3 - 30. * s4;
+   const T d1 = 1. - 18. * s2 + 32. * s3 - 15. * s4;
+   const T d2 = (2. * s - 9. * s2 + 12. * s3 - 5. * s4) * .5;
+   const T d3 = (3. * s2 - 8. * s3 + 5. * s4) * .5;
+   const T d4 = -12. * s2 + 28. * s3 - 15. * s4;
+   const T d5 = -d0;
+   const T step2 = step * step;
+   T delta0[9], delta1[9];
+   double ref0[9], ref1[9], ref[9];
+   int i, j;
+
+   compute_ref_state( ctx, ref_orbit, ref0, (double)jd0);
+   compute_ref_state( ctx, ref_orbit, ref1, (double)( jd0 + step));
+   compute_ref_state( ctx, ref_orbit, ref, (double)jd);
+   for( i = 0; i < 6; i++)
+      {
+      delta0[i] = state0[i] - ref0[i];
+      delta1[i] = state1[i] - ref1[i];
+      }
+   for( i = 6; i < 9; i++)
+      {
+      delta0[i] = derivs0[i - 3] - ref0[i];
+      delta1[i] = derivs1[i - 3] - ref1[i];
+      }
+   for( i = 0; i < 3; i++)
+      {
+      ostate[i] = h0 * delta0[i] + h5 * delta1[i]
+               + step * (h1 * delta0[i + 3] + h4 * delta1[i + 3])
+               + step2 * (h2 * delta0[i + 6] + h3 * delta1[i + 6])
+               + ref[i];
+      ostate[i + 3] = (d0 * delta0[i] + d5 * delta1[i]) / step
+               + d1 * delta0[i + 3] + d4 * delta1[i + 3]
+               + step * (d2 * delta0[i + 6] + d3 * delta1[i + 6])
+               + ref[i + 3];
+      }
+   for( j = 0; j < n_partials; j++)
+      {
+      const int offset = ctx->n_orbit_params + 6 * j;
+      const T *p0 = state0 + offset, *p1 = state1 + offset;
+      const T *dp0 = derivs0 + offset, *dp1 = derivs1 + offset;
+
+      ostate += 6;
+      for( i = 0; i < 3; i++)
+         {
+         ostate[i] = h0 * p0[i] + h5 * p1[i]
+                  + step * (h1 * p0[i + 3] + h4 * p1[i + 3])
+                  + step2 * (h2 * dp0[i + 3] + h3 * dp1[i + 3]);
+         ostate[i + 3] = (d0 * p0[i] + d5 * p1[i]) / step
+                  + d1 * p0[i + 3] + d4 * p1[i + 3]
+                  + step * (d2 * dp0[i + 3] + d3 * dp1[i + 3]);
+         }
+      }
+}
+
+void dense_output_interpolate( INTEGRATION_CONTEXT *ctx,
+                 ELEMENTS *ref_orbit, const ldouble jd0,
+                 const ldouble *state0, const ldouble *derivs0,
+                 const ldouble *state1, const ldouble *derivs1,
+                 const ldouble step, const ldouble jd,
+                 ldouble *ostate, const int n_partials)
+{
+   dense_output_interpolate_t( ctx, ref_orbit, jd0, state0, derivs0,
+                  state1, derivs1, step, jd, ostate, n_partials);
+}
+
+void dense_output_interpolate( INTEGRATION_CONTEXT *ctx,
+                 ELEMENTS *ref_orbit, const double jd0,
+                 const double *state0, const double *derivs0,
+                 const double *state1, const double *derivs1,
+                 const double step, const double jd,
+                 double *ostate, const int n_partials)
+{
+   dense_output_interpolate_t( ctx, ref_orbit, jd0, state0, derivs0,
+                  state1, derivs1, step, jd, ostate, n_partials);
 }
 
 int symplectic_6( double jd, ELEMENTS *ref_orbit, double *vect,